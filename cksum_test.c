@@ -0,0 +1,202 @@
+/*-----------------------------------------------------------------------------
+ * File: cksum_test.c
+ *
+ * Description:
+ *
+ * Checks the cksum() kernels in sr_utils.c against the byte pair loop they
+ * replaced (make check), and measures them (make bench).
+ *
+ * The check runs every kernel the CPU has over random lengths, alignments
+ * and contents, and over all zero and all ones buffers, which are where end
+ * around carry goes wrong, and exits 1 at the first disagreement. With -b
+ * it prints the throughput of every kernel and of the old loop instead.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sr_protocol.h"
+#include "sr_utils.h"
+
+#define CKSUM_TEST_MAX_LEN 9000
+#define CKSUM_TEST_MAX_OFF 64
+#define CKSUM_TEST_UNIFORM_LEN 1600
+#define CKSUM_TEST_ROUNDS 50000
+
+/* seconds spent on each kernel and size in the benchmark */
+#define CKSUM_BENCH_SECS 0.25
+
+static const int cksum_bench_sizes[] = { 20, 64, 576, 1500, 9000, 65536 };
+
+/*-----------------------------------------------------------------------------
+ * Method: cksum_test_one(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int cksum_test_one(const uint8_t* data, int len, int off)
+{
+    uint16_t want = cksum_ref(data, len);
+    uint16_t got;
+    int k;
+
+    for (k = 0; k < cksum_kernel_count; k++)
+    {
+        if (!cksum_kernel_available(k))
+        { continue; }
+        if ((got = cksum_with(k, data, len)) != want)
+        {
+            fprintf(stderr, "%s kernel: len %d offset %d gave %04x, expected %04x\n",
+                    cksum_kernel_name(k), len, off, got, want);
+            return -1;
+        }
+    }
+    if ((got = cksum(data, len)) != want)
+    {
+        fprintf(stderr, "cksum: len %d offset %d gave %04x, expected %04x\n",
+                len, off, got, want);
+        return -1;
+    }
+    return 0;
+} /* -- cksum_test_one -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: cksum_test(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int cksum_test(uint8_t* buf)
+{
+    int i, k, len, off, fill;
+
+    for (k = 0; k < cksum_kernel_count; k++)
+    {
+        printf("%s kernel %s\n", cksum_kernel_name(k),
+               cksum_kernel_available(k) ? "checked" : "not available, skipped");
+    }
+
+    /* every alignment of the uniform buffers, and every length up to a
+       full frame */
+    for (fill = 0; fill <= 0xff; fill += 0xff)
+    {
+        memset(buf, fill, CKSUM_TEST_MAX_LEN + CKSUM_TEST_MAX_OFF);
+        for (off = 0; off < CKSUM_TEST_MAX_OFF; off++)
+        {
+            for (len = 0; len <= CKSUM_TEST_UNIFORM_LEN; len++)
+            {
+                if (cksum_test_one(buf + off, len, off) != 0)
+                { return -1; }
+            }
+        }
+    }
+
+    /* random contents, lengths and alignments */
+    srand(1);
+    for (i = 0; i < CKSUM_TEST_ROUNDS; i++)
+    {
+        off = rand() % CKSUM_TEST_MAX_OFF;
+        len = (i < CKSUM_TEST_ROUNDS / 2) ? rand() % 128 : rand() % (CKSUM_TEST_MAX_LEN + 1);
+        for (k = 0; k < len; k++)
+        { buf[off + k] = (uint8_t)rand(); }
+        if (cksum_test_one(buf + off, len, off) != 0)
+        { return -1; }
+    }
+
+    printf("cksum agrees with the byte pair loop on %d random and %d uniform buffers\n",
+           CKSUM_TEST_ROUNDS, 2 * CKSUM_TEST_MAX_OFF * (CKSUM_TEST_UNIFORM_LEN + 1));
+    return 0;
+} /* -- cksum_test -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: cksum_bench_now(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static double cksum_bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+} /* -- cksum_bench_now -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: cksum_bench(..)
+ * Scope: Local
+ *
+ * GB/s of the old loop (kernel -1) or a kernel over len bytes.
+ *
+ *---------------------------------------------------------------------------*/
+
+static double cksum_bench(const uint8_t* buf, int len, int kernel)
+{
+    volatile uint16_t sink = 0;
+    double start = cksum_bench_now();
+    double secs;
+    unsigned long n = 0;
+    int i;
+
+    do
+    {
+        for (i = 0; i < 1000; i++)
+        {
+            sink += (kernel < 0) ? cksum_ref(buf, len) : cksum_with(kernel, buf, len);
+        }
+        n += 1000;
+        secs = cksum_bench_now() - start;
+    } while (secs < CKSUM_BENCH_SECS);
+
+    return (double)n * len / secs / 1e9;
+} /* -- cksum_bench -- */
+
+/*-----------------------------------------------------------------------------
+ *---------------------------------------------------------------------------*/
+
+int main(int argc, char **argv)
+{
+    static uint8_t buf[65536 + CKSUM_TEST_MAX_OFF];
+    unsigned int s;
+    int c, k, bench = 0;
+
+    while ((c = getopt(argc, argv, "b")) != EOF)
+    {
+        switch (c)
+        {
+            case 'b':
+                bench = 1;
+                break;
+            default:
+                fprintf(stderr, "Format: %s [-b]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if (!bench)
+    { return (cksum_test(buf) == 0) ? 0 : 1; }
+
+    for (s = 0; s < sizeof(buf); s++)
+    { buf[s] = (uint8_t)rand(); }
+
+    printf("%-8s", "bytes");
+    printf(" %10s", "old");
+    for (k = 0; k < cksum_kernel_count; k++)
+    { printf(" %10s", cksum_kernel_name(k)); }
+    printf("   GB/s\n");
+
+    for (s = 0; s < sizeof(cksum_bench_sizes) / sizeof(cksum_bench_sizes[0]); s++)
+    {
+        printf("%-8d %10.2f", cksum_bench_sizes[s], cksum_bench(buf, cksum_bench_sizes[s], -1));
+        for (k = 0; k < cksum_kernel_count; k++)
+        {
+            if (cksum_kernel_available(k))
+            { printf(" %10.2f", cksum_bench(buf, cksum_bench_sizes[s], k)); }
+            else
+            { printf(" %10s", "-"); }
+        }
+        printf("\n");
+    }
+    return 0;
+} /* -- main -- */
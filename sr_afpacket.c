@@ -0,0 +1,468 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_afpacket.c
+ *
+ * Description:
+ *
+ * AF_PACKET backend (-i packet:eth1=veth0@10.0.1.1,...) running the router
+ * straight on Linux interfaces. Each interface gets a raw socket with a
+ * TPACKET_V3 receive ring and transmit ring mapped into the process.
+ * Received frames are handed to the router where the kernel put them, a
+ * block of them per wakeup. Sent frames are copied into the transmit ring
+ * and the kernel is told to send them with one send() per flush, or sooner
+ * when a batch has built up.
+ *
+ * The kernel stack still gets every frame as well, which is why the
+ * interfaces must have no IPv4 address of their own (see sr_io.h).
+ *
+ * Frames from a local sender, such as the other end of a veth pair, can
+ * arrive with the TCP or UDP checksum left for the hardware to finish.
+ * The ring marks them, and the checksum is completed before the router
+ * sees them, as it would be on the wire, so NAT's incremental updates have
+ * something valid to update. Frames too big for a ring slot, which is
+ * what segmentation offload on the device or its peer produces, are
+ * dropped rather than passed on cut short, so TSO and GRO want turning off
+ * (ethtool -K dev tso off gso off gro off).
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+
+#include "sr_io.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+
+/* interfaces one router can have here */
+#define SR_AFPACKET_MAX_IFS 16
+
+/* receive ring: blocks handed over whole, or after SR_AFPACKET_RX_TOV ms */
+#define SR_AFPACKET_RX_BLOCK (256 * 1024)
+#define SR_AFPACKET_RX_BLOCKS 8
+#define SR_AFPACKET_RX_TOV 1
+
+/* transmit ring: fixed frames, the kernel is kicked every SR_AFPACKET_TX_BATCH */
+#define SR_AFPACKET_TX_BLOCK (256 * 1024)
+#define SR_AFPACKET_TX_BLOCKS 2
+#define SR_AFPACKET_FRAME 2048
+#define SR_AFPACKET_TX_BATCH 64
+
+/* where frame data starts in a transmit slot */
+#define SR_AFPACKET_TX_DATA (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+struct sr_afpacket_if
+{
+    char name[sr_IFACE_NAMELEN];
+    int fd;
+    uint8_t* map;
+    size_t map_sz;
+
+    uint8_t* rx_ring;
+    unsigned int rx_block; /* next block to look at */
+
+    uint8_t* tx_ring;
+    unsigned int tx_frames;
+    unsigned int tx_cur; /* next slot to fill */
+    unsigned int tx_queued; /* slots filled since the last kick */
+    unsigned long tx_drops;
+};
+
+struct sr_afpacket
+{
+    int nifs;
+    struct sr_afpacket_if ifs[SR_AFPACKET_MAX_IFS];
+};
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afpacket_close_if(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void sr_afpacket_close_if(struct sr_afpacket_if* pif)
+{
+    if (pif->map != NULL && pif->map != MAP_FAILED)
+    { munmap(pif->map, pif->map_sz); }
+    if (pif->fd >= 0)
+    { close(pif->fd); }
+    pif->map = NULL;
+    pif->fd = -1;
+} /* -- sr_afpacket_close_if -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afpacket_open_if(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_afpacket_open_if(struct sr_afpacket_if* pif, int ifindex)
+{
+    struct tpacket_req3 rx, tx;
+    struct sockaddr_ll sll;
+    int ver = TPACKET_V3;
+    int one = 1;
+
+    /* no protocol until bind, or the ring fills with frames from every
+       interface while it is set up */
+    if ((pif->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0)
+    {
+        perror("socket(AF_PACKET):sr_afpacket_open_if");
+        return -1;
+    }
+
+    memset(&rx, 0, sizeof(rx));
+    rx.tp_block_size = SR_AFPACKET_RX_BLOCK;
+    rx.tp_block_nr = SR_AFPACKET_RX_BLOCKS;
+    rx.tp_frame_size = SR_AFPACKET_FRAME;
+    rx.tp_frame_nr = SR_AFPACKET_RX_BLOCK / SR_AFPACKET_FRAME * SR_AFPACKET_RX_BLOCKS;
+    rx.tp_retire_blk_tov = SR_AFPACKET_RX_TOV;
+
+    memset(&tx, 0, sizeof(tx));
+    tx.tp_block_size = SR_AFPACKET_TX_BLOCK;
+    tx.tp_block_nr = SR_AFPACKET_TX_BLOCKS;
+    tx.tp_frame_size = SR_AFPACKET_FRAME;
+    tx.tp_frame_nr = SR_AFPACKET_TX_BLOCK / SR_AFPACKET_FRAME * SR_AFPACKET_TX_BLOCKS;
+
+    if (setsockopt(pif->fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0 ||
+        setsockopt(pif->fd, SOL_PACKET, PACKET_RX_RING, &rx, sizeof(rx)) < 0 ||
+        setsockopt(pif->fd, SOL_PACKET, PACKET_TX_RING, &tx, sizeof(tx)) < 0)
+    {
+        perror("setsockopt(PACKET_*_RING):sr_afpacket_open_if");
+        return -1;
+    }
+
+    /* our own frames are no use to us, nor is the qdisc */
+#ifdef PACKET_IGNORE_OUTGOING
+    setsockopt(pif->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+#endif
+    setsockopt(pif->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+
+    /* the receive ring is mapped first, the transmit ring right after it */
+    pif->map_sz = (size_t)SR_AFPACKET_RX_BLOCK * SR_AFPACKET_RX_BLOCKS +
+        (size_t)SR_AFPACKET_TX_BLOCK * SR_AFPACKET_TX_BLOCKS;
+    pif->map = (uint8_t *)mmap(NULL, pif->map_sz, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_LOCKED, pif->fd, 0);
+    if (pif->map == MAP_FAILED)
+    {
+        pif->map = (uint8_t *)mmap(NULL, pif->map_sz, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED, pif->fd, 0);
+    }
+    if (pif->map == MAP_FAILED)
+    {
+        perror("mmap(..):sr_afpacket_open_if");
+        return -1;
+    }
+    pif->rx_ring = pif->map;
+    pif->tx_ring = pif->map + (size_t)SR_AFPACKET_RX_BLOCK * SR_AFPACKET_RX_BLOCKS;
+    pif->tx_frames = tx.tp_frame_nr;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(pif->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+    {
+        perror("bind(..):sr_afpacket_open_if");
+        return -1;
+    }
+    return 0;
+} /* -- sr_afpacket_open_if -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afpacket_csum(..)
+ * Scope: Local
+ *
+ * Finish the TCP or UDP checksum of a frame the kernel marked as not ready.
+ * The sender left the pseudo header sum in the checksum field, so summing
+ * from the start of the segment gives the checksum.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_afpacket_csum(uint8_t* frame, unsigned int len)
+{
+    sr_ip_hdr_t* ip = (sr_ip_hdr_t *)(frame + sizeof(sr_ethernet_hdr_t));
+    unsigned int hl, tot;
+    uint8_t* l4;
+
+    if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) ||
+        ntohs(((sr_ethernet_hdr_t *)frame)->ether_type) != ethertype_ip ||
+        (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) != 0)
+    { return; }
+
+    hl = ip->ip_hl * 4;
+    tot = ntohs(ip->ip_len);
+    if (tot > len - sizeof(sr_ethernet_hdr_t) || tot < hl)
+    { return; }
+    l4 = (uint8_t *)ip + hl;
+
+    if (ip->ip_p == ip_protocol_tcp && tot >= hl + sizeof(sr_tcp_hdr_t))
+    { ((sr_tcp_hdr_t *)l4)->tcp_sum = cksum(l4, tot - hl); }
+    else if (ip->ip_p == ip_protocol_udp && tot >= hl + sizeof(sr_udp_hdr_t))
+    { ((sr_udp_hdr_t *)l4)->udp_sum = cksum(l4, tot - hl); }
+} /* -- sr_afpacket_csum -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afpacket_kick(..)
+ * Scope: Local
+ *
+ * Have the kernel send every filled slot of the transmit ring.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_afpacket_kick(struct sr_afpacket_if* pif, int wait)
+{
+    pif->tx_queued = 0;
+    if (send(pif->fd, NULL, 0, wait ? 0 : MSG_DONTWAIT) < 0 &&
+        errno != EAGAIN && errno != ENOBUFS && errno != EINTR)
+    {
+        perror("send(..):sr_afpacket_kick");
+        return -1;
+    }
+    return 0;
+} /* -- sr_afpacket_kick -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afpacket_open(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void sr_afpacket_close(struct sr_instance* sr);
+
+static int sr_afpacket_open(struct sr_instance* sr, char* spec)
+{
+    struct sr_afpacket* st;
+    struct sr_afpacket_if* pif;
+    char *name, *dev, *addr;
+    int ifindex;
+
+    if ((st = (struct sr_afpacket *)calloc(1, sizeof(struct sr_afpacket))) == NULL)
+    { return -1; }
+    sr->io_state = st;
+
+    while (sr_io_next_iface(&spec, &name, &dev, &addr))
+    {
+        if (st->nifs == SR_AFPACKET_MAX_IFS)
+        {
+            fprintf(stderr, "More than %d interfaces\n", SR_AFPACKET_MAX_IFS);
+            sr_afpacket_close(sr);
+            return -1;
+        }
+        pif = &st->ifs[st->nifs++];
+        pif->fd = -1;
+        strncpy(pif->name, name, sr_IFACE_NAMELEN - 1);
+
+        /* the kernel sees every frame a packet socket does */
+        if (sr_io_kernel_addr(name, dev) != 0 ||
+            (ifindex = sr_io_add_iface(sr, name, dev, addr)) < 0 ||
+            sr_afpacket_open_if(pif, ifindex) != 0)
+        {
+            fprintf(stderr, "Unable to open %s on %s\n", name, dev);
+            sr_afpacket_close(sr);
+            return -1;
+        }
+    }
+
+    if (st->nifs == 0)
+    {
+        fprintf(stderr, "No interfaces given, expected packet:eth1=dev@ip,...\n");
+        sr_afpacket_close(sr);
+        return -1;
+    }
+    return 0;
+} /* -- sr_afpacket_open -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afpacket_send(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_afpacket_send(struct sr_instance* sr, uint8_t* buf, unsigned int len,
+                            const char* iface)
+{
+    struct sr_afpacket* st = (struct sr_afpacket *)sr->io_state;
+    struct sr_afpacket_if* pif = NULL;
+    struct tpacket3_hdr* hdr;
+    int i;
+
+    for (i = 0; i < st->nifs; i++)
+    {
+        if (strncmp(st->ifs[i].name, iface, sr_IFACE_NAMELEN) == 0)
+        {
+            pif = &st->ifs[i];
+            break;
+        }
+    }
+    if (pif == NULL || len > SR_AFPACKET_FRAME - SR_AFPACKET_TX_DATA)
+    {
+        fprintf(stderr, "** Error: cannot send %u bytes on %s\n", len, iface);
+        return -1;
+    }
+
+    /* a slot the kernel has not sent yet means the ring is full, send
+       what is in it and wait once before giving up on the frame */
+    hdr = (struct tpacket3_hdr *)(pif->tx_ring + (size_t)pif->tx_cur * SR_AFPACKET_FRAME);
+    if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+        (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+    {
+        sr_afpacket_kick(pif, 1);
+        if (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+            (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+        {
+            pif->tx_drops++;
+            return -1;
+        }
+    }
+
+    memcpy((uint8_t *)hdr + SR_AFPACKET_TX_DATA, buf, len);
+    hdr->tp_len = len;
+    hdr->tp_snaplen = len;
+    hdr->tp_next_offset = 0;
+    __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+    pif->tx_cur = (pif->tx_cur + 1) % pif->tx_frames;
+    sr->tx_len += len;
+    if (++pif->tx_queued >= SR_AFPACKET_TX_BATCH)
+    { return sr_afpacket_kick(pif, 0); }
+    return 0;
+} /* -- sr_afpacket_send -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afpacket_flush(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_afpacket_flush(struct sr_instance* sr)
+{
+    struct sr_afpacket* st = (struct sr_afpacket *)sr->io_state;
+    int i, ret = 0;
+
+    for (i = 0; i < st->nifs; i++)
+    {
+        if (st->ifs[i].tx_queued > 0 && sr_afpacket_kick(&st->ifs[i], 0) != 0)
+        { ret = -1; }
+    }
+    sr->tx_len = 0;
+    return ret;
+} /* -- sr_afpacket_flush -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afpacket_fds(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_afpacket_fds(struct sr_instance* sr, int* fds, int max)
+{
+    struct sr_afpacket* st = (struct sr_afpacket *)sr->io_state;
+    int i;
+
+    for (i = 0; i < st->nifs && i < max; i++)
+    { fds[i] = st->ifs[i].fd; }
+    return i;
+} /* -- sr_afpacket_fds -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afpacket_ready(..)
+ * Scope: Local
+ *
+ * Hand the router every frame of every block the kernel has finished, in
+ * place, and give the blocks back.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_afpacket_ready(struct sr_instance* sr, int fd)
+{
+    struct sr_afpacket* st = (struct sr_afpacket *)sr->io_state;
+    struct sr_afpacket_if* pif = NULL;
+    struct tpacket_block_desc* bd;
+    struct tpacket3_hdr* ppd;
+    struct sockaddr_ll* sll;
+    unsigned int i, n, seen;
+
+    for (i = 0; i < (unsigned int)st->nifs; i++)
+    {
+        if (st->ifs[i].fd == fd)
+        {
+            pif = &st->ifs[i];
+            break;
+        }
+    }
+    if (pif == NULL)
+    { return 1; }
+
+    for (seen = 0; seen < SR_AFPACKET_RX_BLOCKS; seen++)
+    {
+        bd = (struct tpacket_block_desc *)(pif->rx_ring +
+                                           (size_t)pif->rx_block * SR_AFPACKET_RX_BLOCK);
+        if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+        { break; }
+
+        n = bd->hdr.bh1.num_pkts;
+        ppd = (struct tpacket3_hdr *)((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+        for (i = 0; i < n; i++)
+        {
+            /* without PACKET_IGNORE_OUTGOING our own frames come back */
+            sll = (struct sockaddr_ll *)((uint8_t *)ppd + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+            if (sll->sll_pkttype != PACKET_OUTGOING &&
+                ppd->tp_snaplen >= sizeof(sr_ethernet_hdr_t) &&
+                ppd->tp_snaplen == ppd->tp_len)
+            {
+                if (ppd->tp_status & TP_STATUS_CSUMNOTREADY)
+                { sr_afpacket_csum((uint8_t *)ppd + ppd->tp_mac, ppd->tp_snaplen); }
+                sr_receive_packet(sr, (uint8_t *)ppd + ppd->tp_mac, ppd->tp_snaplen,
+                                  pif->name);
+            }
+            ppd = (struct tpacket3_hdr *)((uint8_t *)ppd + ppd->tp_next_offset);
+        }
+
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        pif->rx_block = (pif->rx_block + 1) % SR_AFPACKET_RX_BLOCKS;
+    }
+    return 1;
+} /* -- sr_afpacket_ready -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_afpacket_close(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void sr_afpacket_close(struct sr_instance* sr)
+{
+    struct sr_afpacket* st = (struct sr_afpacket *)sr->io_state;
+    int i;
+
+    if (st == NULL)
+    { return; }
+
+    for (i = 0; i < st->nifs; i++)
+    {
+        if (st->ifs[i].tx_queued > 0)
+        { sr_afpacket_kick(&st->ifs[i], 1); }
+        if (st->ifs[i].tx_drops > 0)
+        {
+            fprintf(stderr, "%s dropped %lu frames on a full transmit ring\n",
+                    st->ifs[i].name, st->ifs[i].tx_drops);
+        }
+        sr_afpacket_close_if(&st->ifs[i]);
+    }
+    free(st);
+    sr->io_state = NULL;
+} /* -- sr_afpacket_close -- */
+
+const struct sr_io sr_io_packet =
+{
+    "packet",
+    sr_afpacket_open,
+    sr_afpacket_send,
+    sr_afpacket_flush,
+    sr_afpacket_fds,
+    sr_afpacket_ready,
+    sr_afpacket_close,
+    NULL
+};
@@ -3,7 +3,6 @@
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
-#include <pthread.h>
 #include <sched.h>
 #include <string.h>
 #include "sr_arpcache.h"
@@ -11,6 +10,7 @@
 #include "sr_if.h"
 #include "sr_protocol.h"
 #include "sr_rt.h"
+#include "sr_buf.h"
 
 /* 
   This function gets called every second. For each request sent out, we keep
@@ -22,8 +22,11 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr) {
     struct sr_arpcache *cache = &(sr->cache);
     
     struct sr_arpreq *current = NULL;
+    struct sr_arpreq *next = NULL;
 
-    for (current = cache->requests; current != NULL; current=current->next){
+    /* sr_handle_arpreq may destroy current, step past it first */
+    for (current = cache->requests; current != NULL; current = next){
+      next = current->next;
       sr_handle_arpreq(sr, current);
     }
     
@@ -50,9 +53,10 @@ void sr_handle_arpreq(struct sr_instance* sr, struct sr_arpreq* req){
   
         sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(packet_temp->buf + sizeof(sr_ethernet_hdr_t));
 
-        struct sr_rt* rtable = sr_helper_rtable(sr, ip_hdr->ip_src);
+        struct sr_rt rtable;
+        sr_helper_rtable(sr, ip_hdr->ip_src, &rtable);
         /* Type 3, Code 1, Destination host unreachable */
-        sr_handle_unreachable(sr, packet_temp->buf, rtable->interface, 3, 1);
+        sr_handle_unreachable(sr, packet_temp->buf, rtable.interface, 3, 1);
       }
 
       sr_arpreq_destroy(&(sr->cache), req);
@@ -64,7 +68,7 @@ void sr_handle_arpreq(struct sr_instance* sr, struct sr_arpreq* req){
 
       uint8_t * arp_packet = sr_create_arppacket(if_list->addr, if_list->ip, req->ip); 
       sr_send_packet(sr, arp_packet, sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t), req->packets->iface);
-      free(arp_packet);
+      sr_buf_free(arp_packet);
 
       req->sent = now;
       req->times_sent++;
@@ -73,11 +77,12 @@ void sr_handle_arpreq(struct sr_instance* sr, struct sr_arpreq* req){
   
 }
 
-/* create a new ARP packet */
+/* create a new ARP packet, in a pool buffer the caller gives back with
+   sr_buf_free */
 uint8_t* sr_create_arppacket(uint8_t * ether_shost, uint32_t ar_sip, uint32_t ar_tip){
 
-  /* malloc space for new packet */
-  uint8_t * new_packet = (uint8_t *)malloc( sizeof(sr_ethernet_hdr_t)
+  /* take space for new packet */
+  uint8_t * new_packet = (uint8_t *)sr_buf_alloc( sizeof(sr_ethernet_hdr_t)
    + sizeof(sr_arp_hdr_t));
   
   /* set up all the header */
@@ -125,75 +130,87 @@ uint8_t* sr_create_arppacket(uint8_t * ether_shost, uint32_t ar_sip, uint32_t ar
 /* You should not need to touch the rest of this code. */
 
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
-   You must free the returned structure if it is not NULL. */
-struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
-    pthread_mutex_lock(&(cache->lock));
-    
-    struct sr_arpentry *entry = NULL, *copy = NULL;
-    
-    int i;
+   Copies the entry into *copy, so the packet path does not allocate.
+   Returns 1 on a hit, 0 otherwise. */
+int sr_arpcache_get(struct sr_arpcache *cache, uint32_t ip, struct sr_arpentry *copy) {
+    int i, hit = 0;
     for (i = 0; i < SR_ARPCACHE_SZ; i++) {
         if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
-            entry = &(cache->entries[i]);
+            memcpy(copy, &(cache->entries[i]), sizeof(struct sr_arpentry));
+            hit = 1;
         }
     }
     
-    /* Must return a copy b/c another thread could jump in and modify
-       table after we return. */
-    if (entry) {
-        copy = (struct sr_arpentry *) malloc(sizeof(struct sr_arpentry));
-        memcpy(copy, entry, sizeof(struct sr_arpentry));
-    }
-        
-    pthread_mutex_unlock(&(cache->lock));
-    
-    return copy;
+    return hit;
 }
 
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
-   that corresponds to this ARP request. You should free the passed *packet.
+   that corresponds to this ARP request. The passed *packet is copied.
    
    A pointer to the ARP request is returned; it should not be freed. The caller
-   can remove the ARP request from the queue by calling sr_arpreq_destroy. */
+   can remove the ARP request from the queue by calling sr_arpreq_destroy.
+   Records come from the cache's free lists and the copy from the buffer
+   pool; if either runs out the packet is dropped and counted. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                                        uint32_t ip,
                                        uint8_t *packet,           /* borrowed */
                                        unsigned int packet_len,
                                        char *iface)
 {
-    pthread_mutex_lock(&(cache->lock));
-    
     struct sr_arpreq *req;
+    struct sr_packet *new_pkt = NULL;
+    uint8_t *buf = NULL;
     for (req = cache->requests; req != NULL; req = req->next) {
         if (req->ip == ip) {
             break;
         }
     }
     
+    /* Take the packet's record and copy first, so that a request never
+       goes on the queue with nothing waiting on it */
+    if (packet && packet_len && iface) {
+        if (cache->free_pkts != NULL) {
+            buf = (uint8_t *)sr_buf_alloc(packet_len);
+        }
+        if (buf == NULL) {
+            cache->dropped++;
+            return req;
+        }
+        new_pkt = cache->free_pkts;
+        cache->free_pkts = new_pkt->next;
+        memcpy(buf, packet, packet_len);
+        new_pkt->buf = buf;
+        new_pkt->len = packet_len;
+        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN - 1);
+        new_pkt->iface[sr_IFACE_NAMELEN - 1] = '\0';
+    }
+    
     /* If the IP wasn't found, add it */
     if (!req) {
-        req = (struct sr_arpreq *) calloc(1, sizeof(struct sr_arpreq));
+        if (cache->free_reqs == NULL) {
+            if (new_pkt) {
+                sr_buf_free(new_pkt->buf);
+                new_pkt->next = cache->free_pkts;
+                cache->free_pkts = new_pkt;
+                cache->dropped++;
+            }
+            return NULL;
+        }
+        req = cache->free_reqs;
+        cache->free_reqs = req->next;
+        memset(req, 0, sizeof(struct sr_arpreq));
         req->ip = ip;
         req->next = cache->requests;
         cache->requests = req;
     }
     
     /* Add the packet to the list of packets for this request */
-    if (packet && packet_len && iface) {
-        struct sr_packet *new_pkt = (struct sr_packet *)malloc(sizeof(struct sr_packet));
-        
-        new_pkt->buf = (uint8_t *)malloc(packet_len);
-        memcpy(new_pkt->buf, packet, packet_len);
-        new_pkt->len = packet_len;
-		new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
-        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
+    if (new_pkt) {
         new_pkt->next = req->packets;
         req->packets = new_pkt;
     }
     
-    pthread_mutex_unlock(&(cache->lock));
-    
     return req;
 }
 
@@ -205,8 +222,6 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
                                      uint32_t ip)
 {
-    pthread_mutex_lock(&(cache->lock));
-    
     struct sr_arpreq *req, *prev = NULL, *next = NULL; 
     for (req = cache->requests; req != NULL; req = req->next) {
         if (req->ip == ip) {            
@@ -237,16 +252,12 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
         cache->entries[i].valid = 1;
     }
     
-    pthread_mutex_unlock(&(cache->lock));
-    
     return req;
 }
 
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
 void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
-    pthread_mutex_lock(&(cache->lock));
-    
     if (entry) {
         struct sr_arpreq *req, *prev = NULL, *next = NULL; 
         for (req = cache->requests; req != NULL; req = req->next) {
@@ -270,16 +281,14 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
         for (pkt = entry->packets; pkt; pkt = nxt) {
             nxt = pkt->next;
             if (pkt->buf)
-                free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
-            free(pkt);
+                sr_buf_free(pkt->buf);
+            pkt->next = cache->free_pkts;
+            cache->free_pkts = pkt;
         }
         
-        free(entry);
+        entry->next = cache->free_reqs;
+        cache->free_reqs = entry;
     }
-    
-    pthread_mutex_unlock(&(cache->lock));
 }
 
 /* Prints out the ARP table. */
@@ -294,10 +303,10 @@ void sr_arpcache_dump(struct sr_arpcache *cache) {
         fprintf(stderr, "%.1x%.1x%.1x%.1x%.1x%.1x   %.8x   %.24s   %d\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], ntohl(cur->ip), ctime(&(cur->added)), cur->valid);
     }
     
-    fprintf(stderr, "\n");
+    fprintf(stderr, "\n%lu packets dropped with the ARP queue full\n\n", cache->dropped);
 }
 
-/* Initialize table + table lock. Returns 0 on success. */
+/* Initialize table. Returns 0 on success. */
 int sr_arpcache_init(struct sr_arpcache *cache) {  
     /* Seed RNG to kick out a random entry if all entries full. */
     srand(time(NULL));
@@ -306,44 +315,43 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
     memset(cache->entries, 0, sizeof(cache->entries));
     cache->requests = NULL;
     
-    /* Acquire mutex lock */
-    pthread_mutexattr_init(&(cache->attr));
-    pthread_mutexattr_settype(&(cache->attr), PTHREAD_MUTEX_RECURSIVE);
-    int success = pthread_mutex_init(&(cache->lock), &(cache->attr));
+    /* Every queue record starts out free */
+    int i;
+    cache->free_reqs = NULL;
+    for (i = SR_ARPCACHE_NREQS - 1; i >= 0; i--) {
+        cache->req_pool[i].next = cache->free_reqs;
+        cache->free_reqs = &(cache->req_pool[i]);
+    }
+    cache->free_pkts = NULL;
+    for (i = SR_ARPCACHE_NPKTS - 1; i >= 0; i--) {
+        cache->pkt_pool[i].next = cache->free_pkts;
+        cache->free_pkts = &(cache->pkt_pool[i]);
+    }
+    cache->dropped = 0;
     
-    return success;
+    return 0;
 }
 
-/* Destroys table + table lock. Returns 0 on success. */
+/* Destroys table. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache) {
-    return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
+    return 0;
 }
 
-/* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
-void *sr_arpcache_timeout(void *sr_ptr) {
-    struct sr_instance *sr = sr_ptr;
+/* Called every second by the event loop. Invalidates entries that were
+   added more than SR_ARPCACHE_TO seconds ago, then resends or gives up on
+   outstanding requests. */
+void sr_arpcache_tick(struct sr_instance *sr) {
     struct sr_arpcache *cache = &(sr->cache);
     
-    while (1) {
-        sleep(1.0);
-        
-        pthread_mutex_lock(&(cache->lock));
+    time_t curtime = time(NULL);
     
-        time_t curtime = time(NULL);
-        
-        int i;    
-        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-            if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-                cache->entries[i].valid = 0;
-            }
+    int i;    
+    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+        if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
+            cache->entries[i].valid = 0;
         }
-        
-        sr_arpcache_sweepreqs(sr);
-
-        pthread_mutex_unlock(&(cache->lock));
     }
     
-    return NULL;
+    /* the requests are only touched from the event loop */
+    sr_arpcache_sweepreqs(sr);
 }
-
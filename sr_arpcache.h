@@ -9,11 +9,8 @@
    --
 
    # When sending packet to next_hop_ip
-   entry = arpcache_lookup(next_hop_ip)
-
-   if entry:
+   if arpcache_get(next_hop_ip, &entry):
        use next_hop_ip->mac mapping in entry to send the packet
-       free entry
    else:
        req = arpcache_queuereq(next_hop_ip, packet, len)
        handle_arpreq(req)
@@ -68,16 +65,19 @@
 
 #include <inttypes.h>
 #include <time.h>
-#include <pthread.h>
 #include "sr_if.h"
 
 #define SR_ARPCACHE_SZ    100  
 #define SR_ARPCACHE_TO    15.0
 
+/* outstanding requests, and packets waiting on them, the queue holds */
+#define SR_ARPCACHE_NREQS 100
+#define SR_ARPCACHE_NPKTS 512
+
 struct sr_packet {
     uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
     unsigned int len;           /* Length of raw Ethernet frame */
-    char *iface;                /* The outgoing interface */
+    char iface[sr_IFACE_NAMELEN]; /* The outgoing interface */
     struct sr_packet *next;
 };
 
@@ -102,21 +102,27 @@ struct sr_arpreq {
 struct sr_arpcache {
     struct sr_arpentry entries[SR_ARPCACHE_SZ];
     struct sr_arpreq *requests;
-    pthread_mutex_t lock;
-    pthread_mutexattr_t attr;
+    /* fixed records for the request queue, unused ones on the free lists */
+    struct sr_arpreq req_pool[SR_ARPCACHE_NREQS];
+    struct sr_packet pkt_pool[SR_ARPCACHE_NPKTS];
+    struct sr_arpreq *free_reqs;
+    struct sr_packet *free_pkts;
+    unsigned long dropped;      /* packets not queued, the pools were empty */
 };
 
-/* Checks if an IP->MAC mapping is in the cache. IP is in network byte order. 
-   You must free the returned structure if it is not NULL. */
-struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
+/* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
+   Copies the entry into *copy and returns 1 if it was found, 0 otherwise. */
+int sr_arpcache_get(struct sr_arpcache *cache, uint32_t ip, struct sr_arpentry *copy);
 
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
-   that corresponds to this ARP request. The packet argument should not be
-   freed by the caller.
+   that corresponds to this ARP request. The packet argument is copied and
+   stays the caller's.
 
-   A pointer to the ARP request is returned; it should be freed. The caller
-   can remove the ARP request from the queue by calling sr_arpreq_destroy. */
+   A pointer to the ARP request is returned; it should not be freed. The caller
+   can remove the ARP request from the queue by calling sr_arpreq_destroy.
+   When the queue is out of records or buffers the packet is dropped, and
+   NULL is returned if there was no request for ip already. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                          uint32_t ip,
                          uint8_t *packet,               /* borrowed */
@@ -140,12 +146,12 @@ void sr_arpcache_dump(struct sr_arpcache *cache);
 
 /* You shouldn't have to call these methods--they're already called in the
    starter code for you. The init call is a constructor, the destroy call is
-   a destructor, and a cleanup thread times out cache entries every 15
-   seconds. */
+   a destructor, and the event loop calls the tick every second to time out
+   cache entries and sweep the requests. */
 
 int   sr_arpcache_init(struct sr_arpcache *cache);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
-void *sr_arpcache_timeout(void *cache_ptr);
+void  sr_arpcache_tick(struct sr_instance *sr);
 uint8_t* sr_create_arppacket(uint8_t * ether_shost, uint32_t ar_sip, uint32_t ar_tip);
 void sr_handle_arpreq(struct sr_instance* sr, struct sr_arpreq* req);
 void sr_arpcache_sweepreqs(struct sr_instance *sr);
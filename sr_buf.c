@@ -0,0 +1,122 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_buf.c
+ *
+ * Description:
+ *
+ * The pool is one aligned block cut into SR_BUF_SIZE buffers. Free buffers
+ * form a stack threaded through an array of indexes. The top of the stack
+ * is a 64 bit word holding the index of the top buffer (plus one, zero for
+ * empty) in its low half and a tag bumped on every change in its high half,
+ * so a compare and swap cannot succeed against a top that was popped and
+ * pushed back in between (the ABA problem).
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "sr_buf.h"
+
+static uint8_t* sr_buf_base = NULL;
+static unsigned int sr_buf_count = 0;
+static uint32_t* sr_buf_next = NULL; /* next free index plus one, per buffer */
+static volatile uint64_t sr_buf_top = 0; /* tag << 32 | top index plus one */
+static unsigned long sr_buf_fallbacks = 0;
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_buf_init(..)
+ *---------------------------------------------------------------------------*/
+
+int sr_buf_init(unsigned int count)
+{
+    void* base;
+    unsigned int i;
+
+    if (count == 0 ||
+        posix_memalign(&base, SR_BUF_ALIGN, (size_t)count * SR_BUF_SIZE) != 0)
+    {
+        return -1;
+    }
+    sr_buf_next = (uint32_t *)malloc(count * sizeof(uint32_t));
+    if (sr_buf_next == NULL)
+    {
+        free(base);
+        return -1;
+    }
+
+    /* every buffer starts out free, the first on top */
+    for (i = 0; i < count; i++)
+    {
+        sr_buf_next[i] = (i + 1 < count) ? i + 2 : 0;
+    }
+    sr_buf_count = count;
+    sr_buf_top = 1;
+    sr_buf_base = (uint8_t *)base;
+    return 0;
+} /* -- sr_buf_init -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_buf_alloc(..)
+ *---------------------------------------------------------------------------*/
+
+void* sr_buf_alloc(unsigned int len)
+{
+    uint64_t top, next;
+    uint32_t idx;
+    unsigned long n;
+
+    if (len <= SR_BUF_SIZE && sr_buf_base != NULL)
+    {
+        do
+        {
+            top = sr_buf_top;
+            idx = (uint32_t)top;
+            if (idx == 0)
+            { break; }
+            next = ((top >> 32) + 1) << 32 | sr_buf_next[idx - 1];
+        } while (!__sync_bool_compare_and_swap(&sr_buf_top, top, next));
+
+        if (idx != 0)
+        { return sr_buf_base + (size_t)(idx - 1) * SR_BUF_SIZE; }
+
+        /* say so on the first time and every 1000th after that */
+        n = __sync_fetch_and_add(&sr_buf_fallbacks, 1);
+        if (n % 1000 == 0)
+        {
+            fprintf(stderr, "** Packet buffer pool of %u empty, %lu allocations fell back to malloc\n",
+                    sr_buf_count, n + 1);
+        }
+    }
+
+    return malloc(len);
+} /* -- sr_buf_alloc -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_buf_free(..)
+ *---------------------------------------------------------------------------*/
+
+void sr_buf_free(void* buf)
+{
+    uint8_t* p = (uint8_t *)buf;
+    uint64_t top, next;
+    uint32_t idx;
+
+    if (p == NULL)
+    { return; }
+
+    if (sr_buf_base == NULL || p < sr_buf_base ||
+        p >= sr_buf_base + (size_t)sr_buf_count * SR_BUF_SIZE)
+    {
+        free(buf);
+        return;
+    }
+
+    idx = (p - sr_buf_base) / SR_BUF_SIZE + 1;
+    do
+    {
+        top = sr_buf_top;
+        sr_buf_next[idx - 1] = (uint32_t)top;
+        next = ((top >> 32) + 1) << 32 | idx;
+    } while (!__sync_bool_compare_and_swap(&sr_buf_top, top, next));
+} /* -- sr_buf_free -- */
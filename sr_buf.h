@@ -0,0 +1,39 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_buf.h
+ *
+ * Description:
+ *
+ * Fixed pool of packet buffers shared by the whole packet path: commands
+ * read from the server, frames written to it, generated ICMP and ARP
+ * packets, and packets waiting in the ARP queue. Buffers are big enough for
+ * one VNS packet command carrying a full ethernet frame, and start on a
+ * cache line. Anything bigger, or anything asked for while the pool is
+ * empty, falls back to malloc; sr_buf_free tells the two apart.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_BUF_H
+#define SR_BUF_H
+
+/* bytes per buffer, a multiple of SR_BUF_ALIGN */
+#define SR_BUF_SIZE 2048
+
+/* alignment of every buffer, one cache line */
+#define SR_BUF_ALIGN 64
+
+/* buffers in the pool unless told otherwise */
+#define SR_BUF_DEFAULT_COUNT 1024
+
+/* Set up a pool of count buffers. Until this has been called every
+   allocation falls back to malloc. Returns 0 on success. */
+int sr_buf_init(unsigned int count);
+
+/* A buffer of at least len bytes, NULL only if malloc fails as well. Safe to
+   call from any thread. */
+void* sr_buf_alloc(unsigned int len);
+
+/* Give back a buffer from sr_buf_alloc, NULL is ignored. Safe to call from
+   any thread. */
+void sr_buf_free(void* buf);
+
+#endif /* -- SR_BUF_H -- */
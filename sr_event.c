@@ -0,0 +1,347 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_event.c
+ *
+ * Description:
+ *
+ * The loop waits in epoll_wait only while nothing is queued for the
+ * server. With output pending it just looks for more work, and writes the
+ * queue out as soon as there is none, so packets arriving back to back go
+ * out together while a lone packet is not held up. The queue's own timer
+ * caps how long a steady stream of input can hold output back. If the
+ * server socket is full the rest of the queue waits for EPOLLOUT on it
+ * instead, and the loop blocks until then.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+#include "sr_event.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_arpcache.h"
+#include "sr_nat.h"
+#include "sr_uring.h"
+#include "sr_io.h"
+
+/* events taken per epoll_wait */
+#define SR_EVENT_MAX 32
+
+/* descriptors an I/O backend may have watched */
+#define SR_EVENT_IO_FDS 16
+
+/* the instance the signal handlers post to */
+static struct sr_instance* sr_event_owner = NULL;
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_event_signal(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void sr_event_signal(int sig)
+{
+    if (sr_event_owner != NULL)
+    {
+        sr_event_post(sr_event_owner, (sig == SIGUSR1) ? SR_CTL_DUMP : SR_CTL_STOP);
+    }
+} /* -- sr_event_signal -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_event_watch(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_event_watch(struct sr_instance* sr, int fd)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(sr->ev_fd, EPOLL_CTL_ADD, fd, &ev);
+} /* -- sr_event_watch -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_event_read(..)
+ * Scope: Local
+ *
+ * Reset a timerfd or eventfd that has fired.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_event_read(int fd)
+{
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        perror("read(..):sr_event_read");
+    }
+} /* -- sr_event_read -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_event_dump(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void sr_event_dump(struct sr_instance* sr)
+{
+    struct sr_nat_stats stats;
+
+    sr_print_if_list(sr);
+    sr_print_routing_table(sr);
+    sr_arpcache_dump(&(sr->cache));
+
+    if (sr->tx_buf != 0)
+    {
+        fprintf(stderr, "Output queue %u bytes%s, %lu packets dropped\n", sr->tx_len,
+                sr->tx_blocked ? " waiting for the server" : "", sr->tx_dropped);
+    }
+
+    if (sr->io != NULL && sr->io->report != NULL)
+    { sr->io->report(sr); }
+
+    if (sr->enable_nat)
+    {
+        sr_nat_get_stats(&(sr->nat), &stats);
+        fprintf(stderr, "NAT blocks %lu/%lu mappings %lu/%lu connections %lu/%lu"
+                " hosts %lu/%lu peers %lu/%lu\n",
+                stats.blocks_used, stats.blocks_total, stats.mappings_used,
+                stats.mappings_total, stats.conns_used, stats.conns_total,
+                stats.hosts_used, stats.hosts_total, stats.peers_used, stats.peers_total);
+        fprintf(stderr, "NAT failed blocks %lu mappings %lu connections %lu hosts %lu peers %lu,"
+                " evicted %lu, refused %lu\n",
+                stats.block_exhausted, stats.mapping_exhausted, stats.conn_exhausted,
+                stats.host_exhausted, stats.peer_exhausted, stats.evictions, stats.quota_hits);
+    }
+} /* -- sr_event_dump -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_event_init(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+int sr_event_init(struct sr_instance* sr)
+{
+    struct itimerspec tick;
+    struct sigaction sa;
+    int fds[SR_EVENT_IO_FDS];
+    int i, n, flags = 0;
+
+    sr->ctl_pending = 0;
+    sr->ev_fd = epoll_create1(EPOLL_CLOEXEC);
+    sr->tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    sr->ctl_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sr->ev_fd < 0 || sr->tick_fd < 0 || sr->ctl_fd < 0)
+    {
+        perror("sr_event_init");
+        sr_event_destroy(sr);
+        return -1;
+    }
+
+    /* once a second, for the ARP cache and the NAT */
+    memset(&tick, 0, sizeof(tick));
+    tick.it_interval.tv_sec = 1;
+    tick.it_value.tv_sec = 1;
+
+    /* an I/O backend's own descriptors, or the server connection, which
+       the loop must never block on */
+    if (sr->io != NULL)
+    {
+        n = sr->io->fds(sr, fds, SR_EVENT_IO_FDS);
+        for (i = 0; i < n; i++)
+        {
+            if (sr_event_watch(sr, fds[i]) != 0)
+            { flags = -1; }
+        }
+    }
+    else if ((flags = fcntl(sr->sockfd, F_GETFL)) >= 0 &&
+             (fcntl(sr->sockfd, F_SETFL, flags | O_NONBLOCK) != 0 ||
+              sr_event_watch(sr, sr->uring ? sr_uring_fd(sr) : sr->sockfd) != 0))
+    {
+        flags = -1;
+    }
+
+    if (flags < 0 || timerfd_settime(sr->tick_fd, 0, &tick, NULL) != 0 ||
+        sr_event_watch(sr, sr->tick_fd) != 0 ||
+        sr_event_watch(sr, sr->ctl_fd) != 0 ||
+        (sr->tx_buf != 0 && sr_event_watch(sr, sr->tx_timerfd) != 0))
+    {
+        perror("sr_event_init");
+        sr_event_destroy(sr);
+        return -1;
+    }
+
+    sr_event_owner = sr;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sr_event_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    return 0;
+} /* -- sr_event_init -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_event_loop(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+int sr_event_loop(struct sr_instance* sr)
+{
+    struct epoll_event events[SR_EVENT_MAX];
+    unsigned int cmds;
+    int i, n, fd;
+    int ret = 1;
+
+    /* commands that came in behind the handshake are already buffered */
+    if (sr->rx_tail > sr->rx_head)
+    {
+        ret = sr_read_from_server_buffered(sr);
+    }
+
+    while (ret == 1)
+    {
+        n = epoll_wait(sr->ev_fd, events, SR_EVENT_MAX,
+                       (sr->tx_len > 0 && !sr->tx_blocked) ? 0 : -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            { continue; }
+            perror("epoll_wait(..):sr_event_loop");
+            return -1;
+        }
+
+        /* nothing left to do, send what the last events produced */
+        if (n == 0)
+        {
+            if (sr_flush_output(sr) != 0)
+            { return -1; }
+            continue;
+        }
+
+        for (i = 0; i < n && ret == 1; i++)
+        {
+            fd = events[i].data.fd;
+            if (sr->uring != NULL && fd == sr_uring_fd(sr))
+            {
+                ret = sr_uring_read(sr);
+            }
+            else if (sr->io == NULL && fd == sr->sockfd)
+            {
+                /* room again for output the socket turned away */
+                if ((events[i].events & EPOLLOUT) && sr_flush_output(sr) != 0)
+                { ret = -1; }
+                else if (events[i].events & ~EPOLLOUT)
+                { ret = sr_read_from_server_ready(sr); }
+            }
+            else if (fd == sr->tick_fd)
+            {
+                sr_event_read(fd);
+                sr_arpcache_tick(sr);
+                if (sr->enable_nat)
+                { sr_nat_tick(&(sr->nat)); }
+            }
+            else if (fd == sr->tx_timerfd)
+            {
+                sr_event_read(fd);
+                if (sr_flush_output(sr) != 0)
+                { ret = -1; }
+            }
+            else if (fd == sr->ctl_fd)
+            {
+                sr_event_read(fd);
+                cmds = __sync_fetch_and_and(&(sr->ctl_pending), 0);
+                if (cmds & SR_CTL_DUMP)
+                { sr_event_dump(sr); }
+                if (cmds & SR_CTL_STOP)
+                {
+                    fprintf(stderr, "Stopping\n");
+                    return (sr_flush_output(sr) != 0) ? -1 : 0;
+                }
+            }
+            else if (sr->io != NULL)
+            {
+                ret = sr->io->ready(sr, fd);
+            }
+        }
+    }
+
+    return (ret < 0) ? -1 : 0;
+} /* -- sr_event_loop -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_event_want_write(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+int sr_event_want_write(struct sr_instance* sr, int on)
+{
+    struct epoll_event ev;
+
+    /* before the loop is set up the socket still blocks */
+    if (sr->ev_fd < 0 || sr->tx_blocked == on)
+    { return 0; }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = on ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.fd = sr->sockfd;
+    if (epoll_ctl(sr->ev_fd, EPOLL_CTL_MOD, sr->sockfd, &ev) != 0)
+    {
+        perror("epoll_ctl(..):sr_event_want_write");
+        return -1;
+    }
+    sr->tx_blocked = on;
+    return 0;
+} /* -- sr_event_want_write -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_event_post(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+void sr_event_post(struct sr_instance* sr, unsigned int cmd)
+{
+    uint64_t one = 1;
+
+    __sync_fetch_and_or(&(sr->ctl_pending), cmd);
+
+    /* fails only when the counter is about to overflow, still readable */
+    if (write(sr->ctl_fd, &one, sizeof(one)) < 0)
+    { return; }
+} /* -- sr_event_post -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_event_destroy(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+void sr_event_destroy(struct sr_instance* sr)
+{
+    if (sr_event_owner == sr)
+    {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGUSR1, SIG_DFL);
+        sr_event_owner = NULL;
+    }
+
+    if (sr->ev_fd >= 0)
+    { close(sr->ev_fd); }
+    if (sr->tick_fd >= 0)
+    { close(sr->tick_fd); }
+    if (sr->ctl_fd >= 0)
+    { close(sr->ctl_fd); }
+    sr->ev_fd = sr->tick_fd = sr->ctl_fd = -1;
+} /* -- sr_event_destroy -- */
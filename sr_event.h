@@ -0,0 +1,46 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_event.h
+ *
+ * Description:
+ *
+ * Single threaded event loop driving the router. One epoll set watches the
+ * socket to the server (or the io_uring carrying it, or the interfaces of
+ * an I/O backend), a timerfd ticking once a second for the ARP cache and
+ * NAT timeouts, the output queue's deadline timer, and an eventfd that
+ * signal handlers (or any other thread) use to post control commands.
+ * Packets, timeouts and commands are all handled on the thread running
+ * sr_event_loop, one at a time.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_EVENT_H
+#define SR_EVENT_H
+
+struct sr_instance;
+
+/* control commands, bits so that several can be pending at once */
+#define SR_CTL_STOP 0x1 /* flush the output queue and leave the loop */
+#define SR_CTL_DUMP 0x2 /* print the interfaces, ARP cache and NAT usage */
+
+/* Set up the loop for a connected instance, after sr_init, and make its
+   socket non-blocking. SIGINT and SIGTERM post SR_CTL_STOP, SIGUSR1 posts
+   SR_CTL_DUMP. Returns 0 on success. */
+int sr_event_init(struct sr_instance* sr);
+
+/* Run until the server closes the session, the connection breaks or
+   SR_CTL_STOP is posted. Returns 0 on a close or stop, -1 on an error. */
+int sr_event_loop(struct sr_instance* sr);
+
+/* Have the loop watch the server socket for room to write (on) or stop
+   (off), for an output queue the socket could not take all of. Sets
+   tx_blocked to match. Returns 0 on success. */
+int sr_event_want_write(struct sr_instance* sr, int on);
+
+/* Have the loop act on cmd. Safe to call from a signal handler or from any
+   thread. */
+void sr_event_post(struct sr_instance* sr, unsigned int cmd);
+
+/* Close what sr_event_init opened. */
+void sr_event_destroy(struct sr_instance* sr);
+
+#endif /* -- SR_EVENT_H -- */
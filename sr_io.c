@@ -0,0 +1,171 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_io.c
+ *
+ * Description:
+ *
+ * Lookup of the packet I/O backends and the interface setup they share.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sr_io.h"
+#include "sr_router.h"
+#include "sr_if.h"
+
+static const struct sr_io* sr_io_backends[] =
+{
+    &sr_io_packet,
+    &sr_io_xdp,
+    &sr_io_tap,
+    NULL
+};
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_io_find(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+const struct sr_io* sr_io_find(const char* arg)
+{
+    size_t len = strcspn(arg, ":");
+    int i;
+
+    for (i = 0; sr_io_backends[i] != NULL; i++)
+    {
+        if (strlen(sr_io_backends[i]->name) == len &&
+            strncmp(sr_io_backends[i]->name, arg, len) == 0)
+        {
+            return sr_io_backends[i];
+        }
+    }
+    return NULL;
+} /* -- sr_io_find -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_io_next_iface(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+int sr_io_next_iface(char** spec, char** name, char** dev, char** addr)
+{
+    char* tok;
+    char* eq;
+    char* at;
+
+    while ((tok = strsep(spec, ",")) != NULL && *tok == '\0')
+        ;
+    if (tok == NULL)
+    { return 0; }
+
+    *addr = NULL;
+    if ((at = strchr(tok, '@')) != NULL)
+    {
+        *at = '\0';
+        *addr = at + 1;
+    }
+
+    if ((eq = strchr(tok, '=')) != NULL)
+    {
+        *eq = '\0';
+        *name = tok;
+        *dev = eq + 1;
+    }
+    else
+    {
+        *name = *dev = tok;
+    }
+    return 1;
+} /* -- sr_io_next_iface -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_io_add_iface(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+int sr_io_add_iface(struct sr_instance* sr, const char* name, const char* dev,
+                    const char* addr)
+{
+    struct ifreq ifr;
+    struct in_addr ip;
+    int fd, ifindex;
+
+    if (strlen(name) >= sr_IFACE_NAMELEN || strlen(dev) >= IFNAMSIZ)
+    {
+        fprintf(stderr, "Interface name %s or %s too long\n", name, dev);
+        return -1;
+    }
+    if (addr == NULL || inet_aton(addr, &ip) == 0)
+    {
+        fprintf(stderr, "Interface %s needs the router's address, as %s=%s@a.b.c.d\n",
+                name, name, dev);
+        return -1;
+    }
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        perror("socket(..):sr_io_add_iface");
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+    if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0)
+    {
+        fprintf(stderr, "No interface %s\n", dev);
+        close(fd);
+        return -1;
+    }
+    ifindex = ifr.ifr_ifindex;
+
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0)
+    {
+        perror("ioctl(SIOCGIFHWADDR):sr_io_add_iface");
+        close(fd);
+        return -1;
+    }
+    sr_add_interface(sr, name);
+    sr_set_ether_addr(sr, (unsigned char *)ifr.ifr_hwaddr.sa_data);
+    sr_set_ether_ip(sr, ip.s_addr);
+
+    close(fd);
+    return ifindex;
+} /* -- sr_io_add_iface -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_io_kernel_addr(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+int sr_io_kernel_addr(const char* name, const char* dev)
+{
+    struct ifreq ifr;
+    int fd, owned;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        perror("socket(..):sr_io_kernel_addr");
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+    owned = (ioctl(fd, SIOCGIFADDR, &ifr) == 0);
+    if (owned)
+    {
+        fprintf(stderr, "Interface %s has IPv4 address %s in the kernel, remove it"
+                " (ip addr flush dev %s) and give the router's as %s=%s@a.b.c.d\n",
+                dev, inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr),
+                dev, name, dev);
+    }
+
+    close(fd);
+    return owned;
+} /* -- sr_io_kernel_addr -- */
@@ -0,0 +1,89 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_io.h
+ *
+ * Description:
+ *
+ * Packet I/O backends that take the place of the VNS server, selected with
+ * -i name:spec. A backend brings up the router's interfaces itself and
+ * moves ethernet frames on them directly: sr_send_packet hands frames to
+ * it, and it passes what arrives to sr_handlepacket from the event loop.
+ * The spec is a comma separated list of router=device@address entries,
+ * such as eth1=veth0@10.0.1.1,eth2=veth2@172.64.3.1, naming each router
+ * interface, the Linux interface under it and the router's IPv4 address
+ * on it; without router= the device keeps its own name.
+ *
+ * The address is the router's alone. A backend whose frames also reach
+ * the kernel's stack, as AF_PACKET's do, refuses a Linux interface with an
+ * IPv4 address of its own: the kernel would answer ARP and pings for it
+ * alongside the router and reset TCP connections it knows nothing about,
+ * NAT'd ones included.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_IO_H
+#define SR_IO_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+struct sr_instance;
+
+struct sr_io
+{
+    const char* name;
+
+    /* Open every interface in spec and add it to sr->if_list. Returns 0,
+       or -1 with nothing left open. */
+    int (*open)(struct sr_instance* sr, char* spec);
+
+    /* Send, or queue for the next flush, one frame out of iface. Returns 0
+       or -1. */
+    int (*send)(struct sr_instance* sr, uint8_t* buf, unsigned int len,
+                const char* iface);
+
+    /* Push out everything queued. Returns 0 or -1. */
+    int (*flush)(struct sr_instance* sr);
+
+    /* Put up to max descriptors for the event loop to watch in fds,
+       returns how many. */
+    int (*fds)(struct sr_instance* sr, int* fds, int max);
+
+    /* One of them is readable, hand what arrived to the router. Returns 1
+       to carry on, -1 on error. */
+    int (*ready)(struct sr_instance* sr, int fd);
+
+    void (*close)(struct sr_instance* sr);
+
+    /* Print interface statistics on SIGUSR1, NULL if the backend keeps
+       none. */
+    void (*report)(struct sr_instance* sr);
+};
+
+/* AF_PACKET sockets with TPACKET_V3 rings, sr_afpacket.c */
+extern const struct sr_io sr_io_packet;
+
+/* AF_XDP sockets in generic mode, sr_xdp.c */
+extern const struct sr_io sr_io_xdp;
+
+/* TAP devices set up from a config file, sr_tap.c */
+extern const struct sr_io sr_io_tap;
+
+/* The backend named by the part of arg before the colon, NULL if none. */
+const struct sr_io* sr_io_find(const char* arg);
+
+/* Take the next router=device@address entry off *spec, returns 0 at the
+   end. addr is NULL if the entry has none. */
+int sr_io_next_iface(char** spec, char** name, char** dev, char** addr);
+
+/* Add router interface name with the MAC of Linux interface dev and IPv4
+   address addr. Returns dev's ifindex, or -1 if there is no such
+   interface or addr is missing or bad. */
+int sr_io_add_iface(struct sr_instance* sr, const char* name, const char* dev,
+                    const char* addr);
+
+/* 1 if Linux interface dev, under router interface name, has an IPv4
+   address in the kernel, saying how to remove it; 0 if not, -1 on error. */
+int sr_io_kernel_addr(const char* name, const char* dev);
+
+#endif /* -- SR_IO_H -- */
@@ -33,6 +33,10 @@
 #include "sr_router.h"
 #include "sr_rt.h"
 #include "sr_nat.h"
+#include "sr_buf.h"
+#include "sr_event.h"
+#include "sr_uring.h"
+#include "sr_io.h"
 
 extern char* optarg;
 
@@ -45,19 +49,29 @@ extern char* optarg;
 #define DEFAULT_SERVER "localhost"
 #define DEFAULT_RTABLE "rtable"
 #define DEFAULT_TOPO 0
+#define DEFAULT_NAT_BLOCK 256
+#define DEFAULT_NAT_MAPPINGS 65536
+#define DEFAULT_NAT_CONNS 262144
+#define DEFAULT_NAT_HOST_MAPPINGS 4096
+#define DEFAULT_TX_DELAY_US 200
+#define DEFAULT_IO "epoll"
+#define MAX_NAT_EXT_IPS 64
 
 static void usage(char* );
 static void sr_init_instance(struct sr_instance* );
 static void sr_destroy_instance(struct sr_instance* );
 static void sr_set_user(struct sr_instance* );
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
+static int sr_parse_nat_behavior(const char* arg, const char* ei, const char* ad,
+        const char* apd, sr_nat_behavior* mode);
+static int sr_parse_nat_pool(char* arg, uint32_t* ips, unsigned int max);
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
 
 int main(int argc, char **argv)
 {
-    int c;
+    int c, ret;
     char *host   = DEFAULT_HOST;
     char *user = 0;
     char *server = DEFAULT_SERVER;
@@ -65,6 +79,9 @@ int main(int argc, char **argv)
     char *template = NULL;
     unsigned int port = DEFAULT_PORT;
     unsigned int topo = DEFAULT_TOPO;
+    unsigned int tx_delay_us = DEFAULT_TX_DELAY_US;
+    char *io = DEFAULT_IO;
+    const struct sr_io *io_backend = NULL;
     char *logfile = 0;
     struct sr_instance sr;
 
@@ -73,11 +90,22 @@ int main(int argc, char **argv)
     double ICMP_timeout = 60.0;
     double TCP_Est_timeout = 7440.0;
     double TCP_Tran_timeout = 300.0;
+    double UDP_timeout = 300.0;
+    unsigned int port_min = 1024;
+    unsigned int port_max = 65535;
+    sr_nat_behavior mapping_mode = nat_endpoint_independent;
+    sr_nat_behavior filtering_mode = nat_endpoint_independent;
+    uint32_t ext_ips[MAX_NAT_EXT_IPS];
+    int next_ips = 0;
+    unsigned int block_size = DEFAULT_NAT_BLOCK;
+    unsigned int max_mappings = DEFAULT_NAT_MAPPINGS;
+    unsigned int max_conns = DEFAULT_NAT_CONNS;
+    unsigned int max_host_mappings = DEFAULT_NAT_HOST_MAPPINGS;
     struct sr_nat_timeout_s setting;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:n:I:E:R:")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:n:I:E:R:U:P:M:F:X:B:m:c:H:w:i:")) != EOF)
     {
         switch (c)
         {
@@ -125,6 +153,80 @@ int main(int argc, char **argv)
                 TCP_Tran_timeout = strtod((char *) optarg, NULL);
                 break;
 
+            case 'U':
+                UDP_timeout = strtod((char *) optarg, NULL);
+                break;
+
+            case 'P':
+                if (sscanf(optarg, "%u-%u", &port_min, &port_max) != 2 ||
+                    port_min == 0 || port_min > port_max || port_max > 65535)
+                {
+                    fprintf(stderr, "Invalid NAT port range %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'M':
+                if (sr_parse_nat_behavior(optarg, "eim", "adm", "apdm", &mapping_mode) != 0)
+                {
+                    fprintf(stderr, "Invalid NAT mapping mode %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'F':
+                if (sr_parse_nat_behavior(optarg, "eif", "adf", "apdf", &filtering_mode) != 0)
+                {
+                    fprintf(stderr, "Invalid NAT filtering mode %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'X':
+                if ((next_ips = sr_parse_nat_pool(optarg, ext_ips, MAX_NAT_EXT_IPS)) <= 0)
+                {
+                    fprintf(stderr, "Invalid NAT address pool %s\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'B':
+                block_size = atoi((char *) optarg);
+                if (block_size == 0 || block_size % 32 != 0)
+                {
+                    fprintf(stderr, "NAT block size must be a multiple of 32\n");
+                    exit(1);
+                }
+                break;
+
+            case 'm':
+                max_mappings = atoi((char *) optarg);
+                break;
+
+            case 'c':
+                max_conns = atoi((char *) optarg);
+                break;
+
+            case 'H':
+                max_host_mappings = atoi((char *) optarg);
+                break;
+
+            case 'w':
+                tx_delay_us = atoi((char *) optarg);
+                break;
+
+            case 'i':
+                io = optarg;
+                io_backend = sr_io_find(io);
+                if (io_backend == NULL && strcmp(io, "epoll") != 0 &&
+                    strcmp(io, "uring") != 0)
+                {
+                    fprintf(stderr, "Unknown io %s\n", io);
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
 
         } /* switch */
     } /* -- while -- */
@@ -134,6 +236,17 @@ int main(int argc, char **argv)
     setting.ICMP_timeout = ICMP_timeout;
     setting.TCP_Est_timeout = TCP_Est_timeout;
     setting.TCP_Tran_timeout = TCP_Tran_timeout;
+    setting.UDP_timeout = UDP_timeout;
+    setting.port_min = port_min;
+    setting.port_max = port_max;
+    setting.mapping_mode = mapping_mode;
+    setting.filtering_mode = filtering_mode;
+    setting.ext_ips = ext_ips;
+    setting.next_ips = next_ips;
+    setting.block_size = block_size;
+    setting.max_mappings = max_mappings;
+    setting.max_conns = max_conns;
+    setting.max_host_mappings = max_host_mappings;
 
 
     /* -- zero out sr instance -- */
@@ -173,31 +286,78 @@ int main(int argc, char **argv)
     else
         Debug("Requesting topology %d\n", topo);
 
-    /* connect to server and negotiate session */
-    if(sr_connect_to_server(&sr,port,server) == -1)
+    /* packet buffers, the router still works off malloc without them */
+    if(sr_buf_init(SR_BUF_DEFAULT_COUNT) != 0)
     {
-        return 1;
+        fprintf(stderr, "Unable to set up the packet buffer pool\n");
     }
 
-    if(template != NULL && strcmp(rtable, "rtable.vrhost") == 0) { /* we've recv'd the rtable now, so read it in */
-        Debug("Connected to new instantiation of topology template %s\n", template);
-        sr_load_rt_wrap(&sr, "rtable.vrhost");
+    if(io_backend != NULL)
+    {
+        /* run on local interfaces instead, the routing table is loaded */
+        if(template != NULL)
+        {
+            fprintf(stderr, "Topology templates need the server, not -i %s\n", io);
+            return 1;
+        }
+        sr.io = io_backend;
+        io = strchr(io, ':');
+        if(sr.io->open(&sr, io ? io + 1 : "") != 0)
+        {
+            return 1;
+        }
+        printf("Router interfaces:\n");
+        sr_print_if_list(&sr);
+        if(sr_verify_routing_table(&sr) != 0)
+        {
+            fprintf(stderr,"Routing table not consistent with hardware\n");
+            return 1;
+        }
     }
-    else {
-      /* Read from specified routing table */
-      sr_load_rt_wrap(&sr, rtable);
+    else
+    {
+        /* connect to server and negotiate session */
+        if(sr_connect_to_server(&sr,port,server) == -1)
+        {
+            return 1;
+        }
+
+        /* queue outgoing packets, or write each one straight away */
+        if(tx_delay_us > 0 && sr_init_output(&sr, tx_delay_us) != 0)
+        {
+            fprintf(stderr, "Unable to set up the output queue, writing packets one by one\n");
+        }
+
+        if(template != NULL && strcmp(rtable, "rtable.vrhost") == 0) { /* we've recv'd the rtable now, so read it in */
+            Debug("Connected to new instantiation of topology template %s\n", template);
+            sr_load_rt_wrap(&sr, "rtable.vrhost");
+        }
+        else {
+          /* Read from specified routing table */
+          sr_load_rt_wrap(&sr, rtable);
+        }
     }
 
     /* call router init (for arp subsystem etc.) */
     sr_init(&sr, flag, setting);
 
 
+    /* io_uring if asked for, recv and writev if it is not to be had */
+    if(io_backend == NULL && strcmp(io, "uring") == 0 && sr_uring_init(&sr) != 0)
+    {
+        fprintf(stderr, "Unable to set up io_uring, using recv and writev\n");
+    }
+
     /* -- whizbang main loop ;-) */
-    while( sr_read_from_server(&sr) == 1);
+    if(sr_event_init(&sr) != 0)
+    {
+        return 1;
+    }
+    ret = sr_event_loop(&sr);
 
     sr_destroy_instance(&sr);
 
-    return 0;
+    return (ret == 0) ? 0 : 1;
 }/* -- main -- */
 
 /*-----------------------------------------------------------------------------
@@ -211,11 +371,73 @@ static void usage(char* argv0)
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-T template_name] [-u username] \n");
     printf("           [-t topo id] [-r routing table] \n");
-    printf("           [-l log file] \n");
+    printf("           [-l log file] [-w max usecs to hold output, 0 for none] \n");
+    printf("           [-i io to the server, epoll or uring, packet|xdp:eth1=dev@ip,... or tap:config] \n");
+    printf("           [-n] [-I icmp timeout] [-E tcp established timeout] \n");
+    printf("           [-R tcp transitory timeout] [-U udp timeout] \n");
+    printf("           [-P nat port range min-max] [-M eim|adm|apdm] [-F eif|adf|apdf] \n");
+    printf("           [-X nat address,...] [-B nat ports per block] \n");
+    printf("           [-m nat max mappings] [-c nat max connections] \n");
+    printf("           [-H nat max mappings per host, 0 for none] \n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
 } /* -- usage -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_nat_behavior(..)
+ * Scope: local
+ *
+ * Map one of the three names of a mapping or filtering mode onto
+ * sr_nat_behavior, returns -1 for anything else.
+ *---------------------------------------------------------------------------*/
+
+static int sr_parse_nat_behavior(const char* arg, const char* ei, const char* ad,
+        const char* apd, sr_nat_behavior* mode)
+{
+    if (strcmp(arg, ei) == 0)
+    {
+        *mode = nat_endpoint_independent;
+    }
+    else if (strcmp(arg, ad) == 0)
+    {
+        *mode = nat_address_dependent;
+    }
+    else if (strcmp(arg, apd) == 0)
+    {
+        *mode = nat_address_port_dependent;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+} /* -- sr_parse_nat_behavior -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_nat_pool(..)
+ * Scope: local
+ *
+ * Fill ips with a comma separated list of dotted quads, returns how many
+ * there were or -1 if one did not parse or there were more than max.
+ *---------------------------------------------------------------------------*/
+
+static int sr_parse_nat_pool(char* arg, uint32_t* ips, unsigned int max)
+{
+    struct in_addr addr;
+    char* tok;
+    unsigned int n = 0;
+
+    for (tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ","))
+    {
+        if (n == max || inet_aton(tok, &addr) == 0)
+        {
+            return -1;
+        }
+        ips[n++] = addr.s_addr;
+    }
+    return n;
+} /* -- sr_parse_nat_pool -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_set_user(..)
  * Scope: local
@@ -258,6 +480,24 @@ static void sr_destroy_instance(struct sr_instance* sr)
         sr_dump_close(sr->logfile);
     }
 
+    sr_uring_destroy(sr);
+    if(sr->io)
+    {
+        sr->io->close(sr);
+    }
+    sr_event_destroy(sr);
+    if(sr->tx_timerfd >= 0)
+    {
+        close(sr->tx_timerfd);
+    }
+    if(sr->enable_nat)
+    {
+        sr_nat_destroy(&(sr->nat));
+    }
+
+    free(sr->rx_buf);
+    free(sr->tx_buf);
+
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -282,6 +522,23 @@ static void sr_init_instance(struct sr_instance* sr)
     sr->if_list = 0;
     sr->routing_table = 0;
     sr->logfile = 0;
+    sr->rx_buf = 0;
+    sr->rx_head = 0;
+    sr->rx_tail = 0;
+    sr->tx_buf = 0;
+    sr->tx_len = 0;
+    sr->tx_delay_us = 0;
+    sr->tx_timerfd = -1;
+    sr->tx_blocked = 0;
+    sr->tx_dropped = 0;
+    sr->ev_fd = -1;
+    sr->tick_fd = -1;
+    sr->ctl_fd = -1;
+    sr->ctl_pending = 0;
+    sr->uring = 0;
+    sr->io = 0;
+    sr->io_state = 0;
+    sr->enable_nat = 0;
 } /* -- sr_init_instance -- */
 
 /*-----------------------------------------------------------------------------
@@ -1,415 +1,1372 @@
-#include <signal.h>
 #include <assert.h>
 #include "sr_nat.h"
 #include <unistd.h>
 #include "sr_utils.h"
 
 
-int sr_nat_init(struct sr_nat *nat, struct sr_nat_timeout_s setting) { /* Initializes the nat */
+/* Mix a key into a well spread 32 bit value */
+static uint32_t sr_nat_hash(uint32_t key) {
+  key ^= key >> 16;
+  key *= 0x45d9f3bU;
+  key ^= key >> 16;
+  return key;
+}
 
-  assert(nat);
+static unsigned int sr_nat_hash_int(uint32_t ip_int, uint16_t aux_int,
+  sr_nat_mapping_type type, uint32_t ip_rem, uint16_t aux_rem) {
+  uint32_t key = sr_nat_hash(ip_int ^ (((uint32_t)aux_int << 16) | (uint32_t)type));
+  return sr_nat_hash(key ^ ip_rem ^ ((uint32_t)aux_rem << 16)) & (SR_NAT_HASH_SZ - 1);
+}
 
-  /* Acquire mutex lock */
-  pthread_mutexattr_init(&(nat->attr));
-  pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
-  int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
+static unsigned int sr_nat_hash_ext(uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type) {
+  return sr_nat_hash(ip_ext ^ (((uint32_t)aux_ext << 16) | (uint32_t)type)) & (SR_NAT_HASH_SZ - 1);
+}
 
-  /* Initialize timeout thread */
+static unsigned int sr_nat_hash_host(uint32_t ip_int) {
+  return sr_nat_hash(ip_int) & (SR_NAT_HASH_SZ - 1);
+}
 
-  pthread_attr_init(&(nat->thread_attr));
-  pthread_attr_setdetachstate(&(nat->thread_attr), PTHREAD_CREATE_JOINABLE);
-  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, nat);
+/* A connection is keyed by its mapping's internal end and the remote end,
+   which together with the type make up the 5-tuple */
+static unsigned int sr_nat_hash_conn(struct sr_nat_mapping *mapping,
+  uint32_t target_ip, uint16_t target_port) {
+  uint32_t key = sr_nat_hash(mapping->ip_int ^ (((uint32_t)mapping->aux_int << 16) | (uint32_t)mapping->type));
+  return sr_nat_hash(key ^ target_ip ^ ((uint32_t)target_port << 16)) & (SR_NAT_CONN_HASH_SZ - 1);
+}
 
-  /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
+/* Clear the parts of a remote end that the mapping mode leaves out of a
+   mapping's key */
+static void sr_nat_mapping_key(struct sr_nat *nat, uint32_t *ip_rem, uint16_t *aux_rem) {
+  if (nat->setting.mapping_mode == nat_endpoint_independent){
+    *ip_rem = 0;
+  }
+  if (nat->setting.mapping_mode != nat_address_port_dependent){
+    *aux_rem = 0;
+  }
+}
 
-  nat->mappings = NULL;
-  /* Initialize any variables here */
-  /*struct in_addr external;
-  struct in_addr internal;
-  inet_pton(AF_INET, "172.64.3.1", &(external));
-  inet_pton(AF_INET, "10.0.1.11", &(internal));
+/* TCP always tracks its connections, ICMP and UDP only keep sessions when
+   the filter has to know who the internal host talked to */
+static int sr_nat_tracks_sessions(struct sr_nat *nat, sr_nat_mapping_type type) {
+  return type == nat_mapping_tcp || nat->setting.filtering_mode != nat_endpoint_independent;
+}
 
-  nat->ext_ip = external.s_addr;
-  nat->int_ip = internal.s_addr;*/
-  nat->setting = setting;
+/* Shard that owns the mappings of an internal host */
+static struct sr_nat_shard *sr_nat_shard_int(struct sr_nat *nat, uint32_t ip_int) {
+  return &(nat->shards[(sr_nat_hash(ip_int) >> 16) & (SR_NAT_NSHARDS - 1)]);
+}
 
+/* Shard that owns the port block of an external (ip, port) in network order,
+   NULL if either is outside the pool */
+static struct sr_nat_shard *sr_nat_shard_ext(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext) {
+  uint16_t port = ntohs(aux_ext);
+  unsigned int i, block;
 
+  if (port < nat->setting.port_min){
+    return NULL;
+  }
+  block = (port - nat->setting.port_min) / nat->setting.block_size;
+  if (block >= nat->blocks_per_ip){
+    return NULL;
+  }
 
-  return success;
+  for (i = 0; i < nat->next_ips; i++){
+    if (nat->ext_ips[i] == ip_ext){
+      return &(nat->shards[(i * nat->blocks_per_ip + block) % SR_NAT_NSHARDS]);
+    }
+  }
+  return NULL;
 }
 
+/* Add a mapping to both indexes. */
+static void sr_nat_hash_mapping(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping) {
+  unsigned int int_idx = sr_nat_hash_int(mapping->ip_int, mapping->aux_int, mapping->type,
+    mapping->ip_rem, mapping->aux_rem);
+  unsigned int ext_idx = sr_nat_hash_ext(mapping->ip_ext, mapping->aux_ext, mapping->type);
 
-int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
+  mapping->int_next = shard->int_table[int_idx];
+  shard->int_table[int_idx] = mapping;
+
+  mapping->ext_next = shard->ext_table[ext_idx];
+  shard->ext_table[ext_idx] = mapping;
+}
 
-  pthread_mutex_lock(&(nat->lock));
+/* Remove a mapping from both indexes. */
+static void sr_nat_unhash_mapping(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping) {
+  struct sr_nat_mapping **walker;
 
-  /* free nat memory here */
-  if (nat){
+  walker = &(shard->int_table[sr_nat_hash_int(mapping->ip_int, mapping->aux_int, mapping->type,
+    mapping->ip_rem, mapping->aux_rem)]);
+  while (*walker != mapping){
+    walker = &((*walker)->int_next);
+  }
+  *walker = mapping->int_next;
 
-    /* initial pointer for mappings and conns*/
-    struct sr_nat_mapping *mapping = nat->mappings;
-    struct sr_nat_mapping *curr_mapping;
+  walker = &(shard->ext_table[sr_nat_hash_ext(mapping->ip_ext, mapping->aux_ext, mapping->type)]);
+  while (*walker != mapping){
+    walker = &((*walker)->ext_next);
+  }
+  *walker = mapping->ext_next;
+}
 
-    struct sr_nat_connection *conn;
-    struct sr_nat_connection *curr_conn;
+/* Find the mapping for an internal (ip, port) pair and the remote end as
+   keyed by sr_nat_mapping_key. */
+static struct sr_nat_mapping *sr_nat_find_internal(struct sr_nat_shard *shard,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
+  uint32_t ip_rem, uint16_t aux_rem) {
 
-    /* free all the mappings */ 
-    while (mapping != NULL){
-      curr_mapping = mapping;
+  struct sr_nat_mapping *mapping;
 
-      conn = mapping->conns;
-      /* free all the conns in mapping */
-      while (conn != NULL){
-        curr_conn = conn;
-        conn = conn->next;
-        free(curr_conn);
-      }
+  for (mapping = shard->int_table[sr_nat_hash_int(ip_int, aux_int, type, ip_rem, aux_rem)];
+       mapping != NULL; mapping = mapping->int_next){
+    if (mapping->ip_int == ip_int && mapping->aux_int == aux_int && mapping->type == type &&
+        mapping->ip_rem == ip_rem && mapping->aux_rem == aux_rem){
+      return mapping;
+    }
+  }
+  return NULL;
+}
+
+/* Find the mapping for an external (ip, port). */
+static struct sr_nat_mapping *sr_nat_find_external(struct sr_nat_shard *shard,
+  uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type) {
+
+  struct sr_nat_mapping *mapping;
+
+  for (mapping = shard->ext_table[sr_nat_hash_ext(ip_ext, aux_ext, type)];
+       mapping != NULL; mapping = mapping->ext_next){
+    if (mapping->aux_ext == aux_ext && mapping->ip_ext == ip_ext && mapping->type == type){
+      return mapping;
+    }
+  }
+  return NULL;
+}
+
+/* Claim a free bit of a bitmap of nbits bits, a multiple of 32. The search
+   starts at a random offset so that ports are not reused in order, and
+   skips whole words at a time. Returns the bit, or -1 when all are taken. */
+static int sr_nat_alloc_bit(uint32_t *bitmap, unsigned int nbits) {
+
+  unsigned int nwords = nbits / 32;
+  unsigned int start = rand() % nbits;
+  unsigned int word, bit, i;
+  uint32_t free_bits;
+
+  /* visit the start word twice: bits above the offset first, below it last */
+  for (i = 0; i <= nwords; i++){
+    word = (start / 32 + i) % nwords;
+    free_bits = ~bitmap[word];
+
+    if (i == 0){
+      free_bits &= ~0U << (start % 32);
+    }
+    else if (i == nwords){
+      free_bits &= ~(~0U << (start % 32));
+    }
+
+    if (free_bits != 0){
+      bit = __builtin_ctz(free_bits);
+      bitmap[word] |= 1U << bit;
+      return word * 32 + bit;
+    }
+  }
+
+  return -1;
+}
 
-      mapping = mapping->next;
-      free(curr_mapping);
+/* Find the record of an internal host. */
+static struct sr_nat_host *sr_nat_find_host(struct sr_nat_shard *shard, uint32_t ip_int) {
 
-    } 
+  struct sr_nat_host *host;
+
+  for (host = shard->host_table[sr_nat_hash_host(ip_int)]; host != NULL; host = host->hash_next){
+    if (host->ip_int == ip_int){
+      return host;
+    }
   }
+  return NULL;
+}
 
+/* Print one block hand over, the only per host line the NAT logs */
+static void sr_nat_log_block(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_block *block, const char *what) {
 
-  pthread_kill(nat->thread, SIGKILL);
-  return pthread_mutex_destroy(&(nat->lock)) &&
-    pthread_mutexattr_destroy(&(nat->attr));
+  unsigned int num = (block - shard->blocks) * SR_NAT_NSHARDS + (shard - nat->shards);
+  unsigned int first = nat->setting.port_min + (num % nat->blocks_per_ip) * nat->setting.block_size;
+  char int_buf[INET_ADDRSTRLEN], ext_buf[INET_ADDRSTRLEN];
 
+  inet_ntop(AF_INET, &(block->host->ip_int), int_buf, sizeof(int_buf));
+  inet_ntop(AF_INET, &(nat->ext_ips[num / nat->blocks_per_ip]), ext_buf, sizeof(ext_buf));
+  printf("nat_block: %s %s %s:%u-%u\n", int_buf, what, ext_buf, first,
+    first + nat->setting.block_size - 1);
 }
 
-void *sr_nat_timeout(void *nat_ptr) {  /* Periodic Timout handling */
-  struct sr_nat *nat = (struct sr_nat *)nat_ptr;
-  while (1) {
-    sleep(1.0);
-    pthread_mutex_lock(&(nat->lock));
+/* Note a host being refused a mapping for its limit, on the first refusal
+   and then every 1000th so a host spraying ports does not flood the log */
+static void sr_nat_log_quota(struct sr_nat *nat, struct sr_nat_host *host) {
+  char int_buf[INET_ADDRSTRLEN];
 
-    time_t curtime = time(NULL);
+  if (host->quota_hits++ % 1000 == 0){
+    inet_ntop(AF_INET, &(host->ip_int), int_buf, sizeof(int_buf));
+    printf("nat_quota: %s at its limit of %u mappings, %lu refused\n", int_buf,
+      nat->setting.max_host_mappings, host->quota_hits);
+  }
+}
 
-    /* handle periodic tasks here */
-    struct sr_nat_mapping *mapping = (struct sr_nat_mapping *)malloc(sizeof(struct sr_nat_mapping));
-    struct sr_nat_mapping *curr;
-    mapping->next = nat->mappings;
-    nat->mappings = mapping;
+/* Hand a free block of the shard to a host. A host's first block is picked
+   by hashing its address, so it lands on the same ports again as long as
+   they are free; later ones follow on from the newest block it holds,
+   which keeps them on the same external address where possible. Returns
+   NULL when every block is taken. */
+static struct sr_nat_block *sr_nat_claim_block(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_host *host) {
 
+  unsigned int words = nat->setting.block_size / 32;
+  unsigned int start, i;
+  struct sr_nat_block *block;
 
-    struct sr_nat_connection *conn = (struct sr_nat_connection *)malloc(sizeof(struct sr_nat_connection));
-    struct sr_nat_connection *curr_conn;
+  if (host->blocks){
+    start = (host->blocks - shard->blocks) + 1;
+  }
+  else{
+    start = sr_nat_hash(~host->ip_int);
+  }
 
-    while (nat->mappings->next != NULL){
-      /* case that mapping is ICMP */
-      if (nat->mappings->next->type == nat_mapping_icmp){
+  for (i = 0; i < shard->nblocks; i++){
+    block = &(shard->blocks[(start + i) % shard->nblocks]);
+    if (block->host == NULL){
+      block->host = host;
+      block->nmappings = 0;
+      memset(block->ports, 0, SR_NAT_NTYPES * words * sizeof(uint32_t));
+      block->host_next = host->blocks;
+      host->blocks = block;
+      shard->blocks_used++;
+      sr_nat_log_block(nat, shard, block, "gets");
+      return block;
+    }
+  }
 
-        if (difftime(curtime, nat->mappings->next->last_updated) >= nat->setting.ICMP_timeout){
-          nat->mappings->next = nat->mappings->next->next;
-          curr = nat->mappings->next;
-          free(curr);
-        }
-        else{
-          nat->mappings = nat->mappings->next;
-        }
-      }
+  shard->block_exhausted++;
+  return NULL;
+}
 
-      /* case for TCP */
-      else{
-        conn->next = nat->mappings->next->conns;
-        nat->mappings->next->conns->next = conn;
-        while (nat->mappings->next->conns->next != NULL){
-
-          /* TCP Established State */
-          if (nat->mappings->next->conns->next->state == ESTABLISHED){
-            if (difftime(curtime, nat->mappings->next->conns->next->last_updated) >= nat->setting.TCP_Est_timeout){
-              nat->mappings->next->conns->next = nat->mappings->next->conns->next->next;
-              curr_conn = nat->mappings->next->conns->next;
-              free(curr_conn);
-            }
-          }
-
-          /* In other state */
-          else{
-            if (difftime(curtime, nat->mappings->next->conns->next->last_updated) >= nat->setting.TCP_Tran_timeout){
-              nat->mappings->next->conns->next = nat->mappings->next->conns->next->next;
-              curr_conn = nat->mappings->next->conns->next;
-              free(curr_conn);
-            }
-          } 
-        }
-
-        /* if there are still some TCP working */
-        if (conn->next != NULL){
-          nat->mappings->next->conns = conn->next;
-        }
-
-        /* if all TCP timeout, removing the mapping */
-        else{
-          nat->mappings->next = nat->mappings->next->next;
-          curr = nat->mappings->next;
-          free(curr);
-        }
-      }
+/* Give a mapping an external (ip, port) from its host's blocks, claiming
+   another block when those are full. Fills in ip_ext, aux_ext and block.
+   Returns 0 when no port, or no record for a new host, is left. */
+static int sr_nat_alloc_port(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+
+  unsigned int words = nat->setting.block_size / 32;
+  struct sr_nat_host *host = sr_nat_find_host(shard, mapping->ip_int);
+  struct sr_nat_block *block;
+  unsigned int num, idx;
+  int bit = -1;
+
+  if (host == NULL){
+    if ((host = shard->free_hosts) == NULL){
+      shard->host_exhausted++;
+      return 0;
+    }
+    shard->free_hosts = host->hash_next;
+    shard->hosts_used++;
+
+    idx = sr_nat_hash_host(mapping->ip_int);
+    host->ip_int = mapping->ip_int;
+    host->nmappings = 0;
+    host->quota_hits = 0;
+    host->blocks = NULL;
+    host->hash_next = shard->host_table[idx];
+    shard->host_table[idx] = host;
+  }
+
+  for (block = host->blocks; block != NULL; block = block->host_next){
+    bit = sr_nat_alloc_bit(block->ports + mapping->type * words, nat->setting.block_size);
+    if (bit >= 0){
+      break;
     }
+  }
+
+  if (block == NULL && (block = sr_nat_claim_block(nat, shard, host)) != NULL){
+    bit = sr_nat_alloc_bit(block->ports + mapping->type * words, nat->setting.block_size);
+  }
+
+  if (block == NULL){
+    /* a host that never got a block is not kept around */
+    if (host->nmappings == 0){
+      shard->host_table[sr_nat_hash_host(host->ip_int)] = host->hash_next;
+      host->hash_next = shard->free_hosts;
+      shard->free_hosts = host;
+      shard->hosts_used--;
+    }
+    return 0;
+  }
+
+  block->nmappings++;
+  host->nmappings++;
+
+  num = (block - shard->blocks) * SR_NAT_NSHARDS + (shard - nat->shards);
+  mapping->block = block - shard->blocks;
+  mapping->ip_ext = nat->ext_ips[num / nat->blocks_per_ip];
+  mapping->aux_ext = htons(nat->setting.port_min +
+    (num % nat->blocks_per_ip) * nat->setting.block_size + bit);
+  return 1;
+}
+
+/* Return a mapping's external port to its block. A block goes back to the
+   shard with its last mapping, the host with its last block. */
+static void sr_nat_free_port(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+
+  unsigned int words = nat->setting.block_size / 32;
+  unsigned int bit = (ntohs(mapping->aux_ext) - nat->setting.port_min) % nat->setting.block_size;
+  struct sr_nat_block *block = &(shard->blocks[mapping->block]);
+  struct sr_nat_host *host = block->host;
+  struct sr_nat_block **bwalker;
+  struct sr_nat_host **hwalker;
+
+  block->ports[mapping->type * words + bit / 32] &= ~(1U << (bit % 32));
+
+  if (--block->nmappings == 0){
+    sr_nat_log_block(nat, shard, block, "returns");
+    for (bwalker = &(host->blocks); *bwalker != block; bwalker = &((*bwalker)->host_next));
+    *bwalker = block->host_next;
+    block->host = NULL;
+    shard->blocks_used--;
+  }
 
-    nat->mappings = mapping->next;
-    free(mapping);
-    free(conn);
+  if (--host->nmappings == 0){
+    for (hwalker = &(shard->host_table[sr_nat_hash_host(host->ip_int)]);
+         *hwalker != host; hwalker = &((*hwalker)->hash_next));
+    *hwalker = host->hash_next;
+    host->hash_next = shard->free_hosts;
+    shard->free_hosts = host;
+    shard->hosts_used--;
+  }
+}
 
-    pthread_mutex_unlock(&(nat->lock));
+/* Take an armed timer out of its wheel slot. If the expiry walk was about
+   to visit it, step the walk past it. */
+static void sr_nat_timer_unlink(struct sr_nat_shard *shard, struct sr_nat_timer *timer) {
+  if (shard->expire_next == timer){
+    shard->expire_next = timer->next;
+  }
+  if (timer->prev){
+    timer->prev->next = timer->next;
+  }
+  else{
+    shard->wheel[timer->expires & (SR_NAT_WHEEL_SZ - 1)] = timer->next;
+  }
+  if (timer->next){
+    timer->next->prev = timer->prev;
+  }
+}
+
+/* Link a timer into the wheel slot for its expiry time, moving it if it was
+   already armed. */
+static void sr_nat_timer_arm(struct sr_nat_shard *shard, struct sr_nat_timer *timer, time_t expires) {
+  struct sr_nat_timer **slot;
+
+  if (timer->armed){
+    sr_nat_timer_unlink(shard, timer);
+  }
+
+  /* never file a timer into a slot the wheel has already passed */
+  if (expires <= shard->wheel_time){
+    expires = shard->wheel_time + 1;
+  }
+
+  slot = &(shard->wheel[expires & (SR_NAT_WHEEL_SZ - 1)]);
+  timer->expires = expires;
+  timer->armed = 1;
+  timer->prev = NULL;
+  timer->next = *slot;
+  if (*slot){
+    (*slot)->prev = timer;
+  }
+  *slot = timer;
+}
+
+/* Unlink a timer from the wheel. */
+static void sr_nat_timer_cancel(struct sr_nat_shard *shard, struct sr_nat_timer *timer) {
+  if (!timer->armed){
+    return;
+  }
+  sr_nat_timer_unlink(shard, timer);
+  timer->armed = 0;
+}
+
+/* Idle timeout for an ICMP or UDP mapping, which carry no connections */
+static double sr_nat_mapping_timeout(struct sr_nat *nat, sr_nat_mapping_type type) {
+  if (type == nat_mapping_udp){
+    return nat->setting.UDP_timeout;
+  }
+  return nat->setting.ICMP_timeout;
+}
+
+/* Idle timeout for a connection in its current state */
+static double sr_nat_conn_timeout(struct sr_nat *nat, struct sr_nat_connection *conn) {
+  if (conn->mapping->type != nat_mapping_tcp){
+    return sr_nat_mapping_timeout(nat, conn->mapping->type);
+  }
+  if (conn->state == ESTABLISHED){
+    return nat->setting.TCP_Est_timeout;
+  }
+  return nat->setting.TCP_Tran_timeout;
+}
+
+/* Find the peer entry of a mapping for a remote ip. */
+static struct sr_nat_peer *sr_nat_find_peer(struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping, uint32_t ip) {
+
+  struct sr_nat_peer *peer;
+
+  for (peer = shard->peer_table[sr_nat_hash_conn(mapping, ip, 0)];
+       peer != NULL; peer = peer->hash_next){
+    if (peer->mapping == mapping && peer->ip == ip){
+      return peer;
+    }
   }
   return NULL;
 }
 
-/* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type,
-    uint32_t source_ip, uint16_t source_port, int ack, int syn, int fin) {
+/* Count one more connection of a mapping to ip. Returns 0 when a new peer
+   is needed and the shard's peer pool is empty. */
+static int sr_nat_peer_ref(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping,
+  uint32_t ip) {
 
-  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_peer *peer = sr_nat_find_peer(shard, mapping, ip);
+  unsigned int idx;
 
-  /* handle lookup here, malloc and assign to copy */
-  struct sr_nat_mapping *copy = NULL;
-  struct sr_nat_mapping *mapping = NULL;
+  if (peer == NULL){
+    if ((peer = shard->free_peers) == NULL){
+      shard->peer_exhausted++;
+      return 0;
+    }
+    shard->free_peers = peer->hash_next;
+    shard->peers_used++;
+
+    idx = sr_nat_hash_conn(mapping, ip, 0);
+    peer->mapping = mapping;
+    peer->ip = ip;
+    peer->refs = 0;
+    peer->hash_next = shard->peer_table[idx];
+    shard->peer_table[idx] = peer;
+  }
+  peer->refs++;
+  return 1;
+}
 
-  time_t curtime = time(NULL);
+/* Drop one connection of a mapping to ip, forgetting the peer with its last
+   one. */
+static void sr_nat_peer_unref(struct sr_nat_shard *shard, struct sr_nat_mapping *mapping,
+  uint32_t ip) {
 
-  /* if type is ICMP, No need to look up TCP */
-  if (type == nat_mapping_icmp){
+  struct sr_nat_peer **walker = &(shard->peer_table[sr_nat_hash_conn(mapping, ip, 0)]);
+  struct sr_nat_peer *peer;
 
-    for(mapping = nat->mappings; mapping != NULL; mapping = mapping->next){
-      if (mapping->aux_ext == aux_ext && mapping->type == type){
-        copy = (struct sr_nat_mapping *)malloc(sizeof(struct sr_nat_mapping));
-        memcpy(copy, mapping, sizeof(struct sr_nat_mapping)); 
-      }
+  while ((*walker)->mapping != mapping || (*walker)->ip != ip){
+    walker = &((*walker)->hash_next);
+  }
+  peer = *walker;
+  if (--peer->refs == 0){
+    *walker = peer->hash_next;
+    peer->hash_next = shard->free_peers;
+    shard->free_peers = peer;
+    shard->peers_used--;
+  }
+}
+
+/* Find the connection of a mapping to a remote (ip, port). */
+static struct sr_nat_connection *sr_nat_find_connection(struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping, uint32_t target_ip, uint16_t target_port) {
+
+  struct sr_nat_connection *conn;
+
+  for (conn = shard->conn_table[sr_nat_hash_conn(mapping, target_ip, target_port)];
+       conn != NULL; conn = conn->hash_next){
+    if (conn->mapping == mapping && conn->target_ip == target_ip && conn->target_port == target_port){
+      return conn;
     }
   }
+  return NULL;
+}
 
-  /* similar case as internal */
+/* Keep a connection's place in the shard's LRU list of transitory TCP
+   connections: to the back when it was just used and is not established,
+   out of the list otherwise. */
+static void sr_nat_lru_update(struct sr_nat_shard *shard, struct sr_nat_connection *conn, int keep) {
+  if (conn->on_lru){
+    if (conn->lru_prev){
+      conn->lru_prev->lru_next = conn->lru_next;
+    }
+    else{
+      shard->lru_head = conn->lru_next;
+    }
+    if (conn->lru_next){
+      conn->lru_next->lru_prev = conn->lru_prev;
+    }
+    else{
+      shard->lru_tail = conn->lru_prev;
+    }
+    conn->on_lru = 0;
+  }
+
+  if (keep && conn->mapping->type == nat_mapping_tcp && conn->state != ESTABLISHED){
+    conn->lru_prev = shard->lru_tail;
+    conn->lru_next = NULL;
+    if (shard->lru_tail){
+      shard->lru_tail->lru_next = conn;
+    }
+    else{
+      shard->lru_head = conn;
+    }
+    shard->lru_tail = conn;
+    conn->on_lru = 1;
+  }
+}
+
+static int sr_nat_evict(struct sr_nat *nat, struct sr_nat_shard *shard,
+  uint32_t ip_int, int need_mapping, struct sr_nat_mapping *keep);
+
+/* Create a connection on a mapping and index it. Returns NULL when the
+   shard's connection pool is empty. */
+static struct sr_nat_connection *sr_nat_add_connection(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping, uint32_t target_ip, uint16_t target_port, time_t curtime) {
+
+  struct sr_nat_connection *conn;
+  unsigned int idx = sr_nat_hash_conn(mapping, target_ip, target_port);
+
+  if (shard->free_conns == NULL){
+    sr_nat_evict(nat, shard, 0, 0, mapping);
+  }
+  conn = sr_create_connection(shard, target_ip, target_port, curtime);
+  if (conn == NULL){
+    return NULL;
+  }
+
+  /* address dependent filtering counts it against its remote address */
+  if (shard->peer_table && !sr_nat_peer_ref(shard, mapping, target_ip)){
+    conn->next = shard->free_conns;
+    shard->free_conns = conn;
+    shard->conns_used--;
+    return NULL;
+  }
+
+  conn->mapping = mapping;
+  conn->timer.mapping = mapping;
+  conn->timer.conn = conn;
+
+  /* set it at the front */
+  conn->prev = NULL;
+  conn->next = mapping->conns;
+  if (mapping->conns){
+    mapping->conns->prev = conn;
+  }
+  mapping->conns = conn;
+
+  conn->hash_next = shard->conn_table[idx];
+  shard->conn_table[idx] = conn;
+  return conn;
+}
+
+/* Unlink a connection from its mapping and the index, and return it to the
+   pool. */
+static void sr_nat_remove_connection(struct sr_nat_shard *shard,
+  struct sr_nat_connection *conn) {
+
+  struct sr_nat_connection **walker;
+
+  if (conn->prev){
+    conn->prev->next = conn->next;
+  }
   else{
+    conn->mapping->conns = conn->next;
+  }
+  if (conn->next){
+    conn->next->prev = conn->prev;
+  }
 
-    struct sr_nat_connection* connection = NULL;
+  walker = &(shard->conn_table[sr_nat_hash_conn(conn->mapping, conn->target_ip, conn->target_port)]);
+  while (*walker != conn){
+    walker = &((*walker)->hash_next);
+  }
+  *walker = conn->hash_next;
 
-    /* find right mapping */
-    for(mapping = nat->mappings; mapping != NULL; mapping = mapping->next){
-      if (mapping->aux_ext == aux_ext && mapping->type == type){
-        copy = (struct sr_nat_mapping *)malloc(sizeof(struct sr_nat_mapping));
-        memcpy(copy, mapping, sizeof(struct sr_nat_mapping)); 
+  if (shard->peer_table){
+    sr_nat_peer_unref(shard, conn->mapping, conn->target_ip);
+  }
 
-        /* find right connection */
-        for (connection = mapping->conns; connection != NULL; connection = connection->next){
-          if (connection->target_ip == source_ip && connection->target_port == source_port){
-            /* update it */
-            sr_nat_update_connection_ext(connection, ack, syn, fin, curtime);
-          }
+  sr_nat_timer_cancel(shard, &(conn->timer));
+  sr_nat_lru_update(shard, conn, 0);
 
-        }
-      }
-    }
+  conn->next = shard->free_conns;
+  shard->free_conns = conn;
+  shard->conns_used--;
+}
 
+/* Unlink a mapping from its shard, release its port and return it to the
+   pool along with its connections. */
+static void sr_nat_remove_mapping(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_mapping *mapping) {
+
+  if (mapping->prev){
+    mapping->prev->next = mapping->next;
+  }
+  else{
+    shard->mappings = mapping->next;
   }
+  if (mapping->next){
+    mapping->next->prev = mapping->prev;
+  }
+
+  sr_nat_unhash_mapping(shard, mapping);
+  sr_nat_free_port(nat, shard, mapping);
+  sr_nat_timer_cancel(shard, &(mapping->timer));
 
+  while (mapping->conns != NULL){
+    sr_nat_remove_connection(shard, mapping->conns);
+  }
+
+  mapping->next = shard->free_mappings;
+  shard->free_mappings = mapping;
+  shard->mappings_used--;
+}
 
-  if(copy != NULL)
-  printf("lookup_external: int port %d, ext port %d\n", ntohs(copy->aux_int), ntohs(aux_ext));
+/* Make room by dropping the least recently used transitory TCP connection,
+   of host ip_int only unless it is 0. With need_mapping only a mapping's
+   last connection will do, so the mapping goes with it. Connections of
+   keep are left alone. Returns 1 if something was evicted. */
+static int sr_nat_evict(struct sr_nat *nat, struct sr_nat_shard *shard,
+  uint32_t ip_int, int need_mapping, struct sr_nat_mapping *keep) {
 
+  struct sr_nat_connection *conn;
+  struct sr_nat_mapping *mapping;
 
-  pthread_mutex_unlock(&(nat->lock));
-  return copy;
+  for (conn = shard->lru_head; conn != NULL; conn = conn->lru_next){
+    mapping = conn->mapping;
+    if (mapping == keep || (ip_int != 0 && mapping->ip_int != ip_int)){
+      continue;
+    }
+    if (need_mapping && (conn->prev != NULL || conn->next != NULL)){
+      continue;
+    }
+
+    sr_nat_remove_connection(shard, conn);
+    if (mapping->conns == NULL){
+      sr_nat_remove_mapping(nat, shard, mapping);
+    }
+    shard->evictions++;
+    return 1;
+  }
+  return 0;
 }
 
-/* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
-  uint32_t target_ip, uint16_t target_port, int ack, int syn, int fin) {
+/* Fire a timer whose deadline has passed. */
+static void sr_nat_timer_expire(struct sr_nat *nat, struct sr_nat_shard *shard,
+  struct sr_nat_timer *timer) {
 
-  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_mapping *mapping = timer->mapping;
 
-  /* handle lookup here, malloc and assign to copy. */
-  struct sr_nat_mapping *copy = NULL;
-  struct sr_nat_mapping *mapping = NULL;
+  /* a connection timed out, the TCP mapping goes with its last one, ICMP
+     and UDP mappings keep their own timer */
+  if (timer->conn){
+    sr_nat_remove_connection(shard, timer->conn);
 
-  time_t curtime = time(NULL);
+    if (mapping->conns == NULL && mapping->type == nat_mapping_tcp){
+      sr_nat_remove_mapping(nat, shard, mapping);
+    }
+  }
 
-  /* if type is ICMP, No need to look up TCP */
-  if (type == nat_mapping_icmp){
+  /* an ICMP or UDP mapping timed out */
+  else{
+    sr_nat_remove_mapping(nat, shard, mapping);
+  }
+}
+
+/* Copy the fields the packet path needs out of a mapping. */
+static void sr_nat_fill_xlate(struct sr_nat_xlate *xlate, struct sr_nat_mapping *mapping,
+  struct sr_nat_connection *conn) {
+  xlate->type = mapping->type;
+  xlate->ip_int = mapping->ip_int;
+  xlate->ip_ext = mapping->ip_ext;
+  xlate->aux_int = mapping->aux_int;
+  xlate->aux_ext = mapping->aux_ext;
+  xlate->state = conn ? conn->state : LISTEN;
+}
+
+/* Expire the timers of one shard that came due by curtime. */
+static void sr_nat_shard_timeout(struct sr_nat *nat, struct sr_nat_shard *shard,
+  time_t curtime) {
+
+  struct sr_nat_timer *timer;
+  int budget = SR_NAT_EXPIRE_BUDGET;
+  time_t last = curtime;
 
-    for(mapping = nat->mappings; mapping != NULL; mapping = mapping->next){
-      if (mapping->ip_int == ip_int && mapping->aux_int == aux_int && mapping->type == type){
-        copy = (struct sr_nat_mapping *)malloc(sizeof(struct sr_nat_mapping));
-        memcpy(copy, mapping, sizeof(struct sr_nat_mapping)); 
+  /* one revolution covers every slot, no need to go round twice */
+  if (last - shard->wheel_time > SR_NAT_WHEEL_SZ){
+    last = shard->wheel_time + SR_NAT_WHEEL_SZ;
+  }
+
+  /* walk the slots that came due since the last tick, skipping timers
+     that belong to a later revolution. Expiring a mapping can cancel
+     other timers of the same slot, so the walk goes through
+     shard->expire_next, which cancelling keeps pointing past them. */
+  while (shard->wheel_time < last && budget > 0){
+    shard->expire_next = shard->wheel[(shard->wheel_time + 1) & (SR_NAT_WHEEL_SZ - 1)];
+    while (shard->expire_next != NULL && budget > 0){
+      timer = shard->expire_next;
+      shard->expire_next = timer->next;
+      if (timer->expires <= curtime){
+        sr_nat_timer_expire(nat, shard, timer);
+        budget--;
       }
-    }    
+    }
+
+    /* out of budget, pick this slot up again next tick */
+    if (shard->expire_next != NULL){
+      shard->expire_next = NULL;
+      break;
+    }
+    shard->wheel_time++;
   }
 
-  /* if type is TCP, Need to look up conns */
-  else{
+  /* caught up after a stall that spanned the whole wheel */
+  if (budget > 0 && shard->wheel_time < curtime){
+    shard->wheel_time = curtime;
+  }
+}
 
-    struct sr_nat_connection* connection = NULL;
-    int flag_check = 0;
+/* Free a shard's tables and pools. Every record lives in a pool, so there
+   is nothing to hand back one by one. Fields sr_nat_init got no further
+   than are NULL. */
+static void sr_nat_free_shard(struct sr_nat_shard *shard) {
+  free(shard->int_table);
+  free(shard->ext_table);
+  free(shard->conn_table);
+  free(shard->peer_table);
+  free(shard->wheel);
+  free(shard->host_table);
+  if (shard->blocks != NULL){
+    free(shard->blocks[0].ports);
+  }
+  free(shard->blocks);
+  free(shard->mapping_pool);
+  free(shard->conn_pool);
+  free(shard->host_pool);
+  free(shard->peer_pool);
+}
 
-    /* find right mapping */
-    for(mapping = nat->mappings; mapping != NULL; mapping = mapping->next){
-      if (mapping->ip_int == ip_int && mapping->aux_int == aux_int && mapping->type == type){
-        copy = (struct sr_nat_mapping *)malloc(sizeof(struct sr_nat_mapping));
-        memcpy(copy, mapping, sizeof(struct sr_nat_mapping)); 
+/* Undo a sr_nat_init that failed on shard n: the shards before it are
+   complete, shard n has what it got. */
+static int sr_nat_init_fail(struct sr_nat *nat, int n) {
+  int i;
+
+  for (i = 0; i < n; i++){
+    sr_nat_free_shard(&(nat->shards[i]));
+  }
+  sr_nat_free_shard(&(nat->shards[n]));
+  free(nat->ext_ips);
+  nat->ext_ips = NULL;
+  return -1;
+}
+
+int sr_nat_init(struct sr_nat *nat, struct sr_nat_timeout_s setting) { /* Initializes the nat */
 
-        /* find right connection and update it*/
-        for (connection = mapping->conns; connection != NULL; connection = connection->next){
-          if (connection->target_ip == target_ip && connection->target_port == target_port){
-            flag_check = 1;
-            sr_nat_update_connection_int(connection, ack, syn, fin, curtime);
-          }
-        }
+  assert(nat);
 
-        /* if we have the mapping, but not the conn, create a connection and update it */
-        if (flag_check == 0){
-          connection = sr_create_connection(target_ip, target_port, curtime);
+  /* Initialize any variables here */
+  nat->setting = setting;
 
-          /* set it at the front */
-          connection->next = mapping->conns;
-          mapping->conns = connection;
+  unsigned int nports = setting.port_max - setting.port_min + 1;
+  unsigned int words = setting.block_size / 32;
+  unsigned int nblocks;
+  uint32_t *bits;
+  int i, j;
+
+  /* the address pool, without one eth2's address is filled in by the first
+     insert, once the interfaces are known */
+  nat->next_ips = setting.next_ips ? setting.next_ips : 1;
+  nat->ext_ips = (uint32_t *)calloc(nat->next_ips, sizeof(uint32_t));
+  if (nat->ext_ips == NULL){
+    return -1;
+  }
+  if (setting.next_ips){
+    memcpy(nat->ext_ips, setting.ext_ips, setting.next_ips * sizeof(uint32_t));
+  }
 
-          /*update it */
-          sr_nat_update_connection_int(connection, ack, syn, fin, curtime);
+  /* a partial block at the top of the port range goes unused */
+  nat->blocks_per_ip = setting.block_size ? nports / setting.block_size : 0;
+  nblocks = nat->next_ips * nat->blocks_per_ip;
+  if (setting.block_size == 0 || setting.block_size % 32 || nblocks < SR_NAT_NSHARDS){
+    fprintf(stderr, "** Error: NAT needs at least %d port blocks of a multiple of 32 ports\n",
+      SR_NAT_NSHARDS);
+    free(nat->ext_ips);
+    return -1;
+  }
+  if (setting.max_mappings < SR_NAT_NSHARDS || setting.max_conns < SR_NAT_NSHARDS){
+    fprintf(stderr, "** Error: NAT needs room for at least %d mappings and connections\n",
+      SR_NAT_NSHARDS);
+    free(nat->ext_ips);
+    return -1;
+  }
 
-        }
+  for (i = 0; i < SR_NAT_NSHARDS; i++){
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+
+    /* everything NULL, for sr_nat_init_fail */
+    memset(shard, 0, sizeof(struct sr_nat_shard));
+    shard->mappings = NULL;
+    shard->int_table = (struct sr_nat_mapping **)calloc(SR_NAT_HASH_SZ, sizeof(struct sr_nat_mapping *));
+    shard->ext_table = (struct sr_nat_mapping **)calloc(SR_NAT_HASH_SZ, sizeof(struct sr_nat_mapping *));
+    shard->conn_table = (struct sr_nat_connection **)calloc(SR_NAT_CONN_HASH_SZ, sizeof(struct sr_nat_connection *));
+    shard->wheel = (struct sr_nat_timer **)calloc(SR_NAT_WHEEL_SZ, sizeof(struct sr_nat_timer *));
+    shard->wheel_time = time(NULL);
+    shard->expire_next = NULL;
+    if (shard->int_table == NULL || shard->ext_table == NULL ||
+        shard->conn_table == NULL || shard->wheel == NULL){
+      return sr_nat_init_fail(nat, i);
+    }
 
+    /* the shard's share of the records, peers only for address dependent
+       filtering, every record starts on its free list */
+    shard->nmappings = (setting.max_mappings - i + SR_NAT_NSHARDS - 1) / SR_NAT_NSHARDS;
+    shard->nconns = (setting.max_conns - i + SR_NAT_NSHARDS - 1) / SR_NAT_NSHARDS;
+
+    shard->peer_table = NULL;
+    shard->peer_pool = NULL;
+    shard->free_peers = NULL;
+    shard->npeers = 0;
+    if (setting.filtering_mode == nat_address_dependent){
+      shard->npeers = shard->nconns;
+      shard->peer_table = (struct sr_nat_peer **)calloc(SR_NAT_CONN_HASH_SZ, sizeof(struct sr_nat_peer *));
+      shard->peer_pool = (struct sr_nat_peer *)calloc(shard->npeers, sizeof(struct sr_nat_peer));
+      if (shard->peer_table == NULL || shard->peer_pool == NULL){
+        return sr_nat_init_fail(nat, i);
+      }
+      for (j = shard->npeers - 1; j >= 0; j--){
+        shard->peer_pool[j].hash_next = shard->free_peers;
+        shard->free_peers = &(shard->peer_pool[j]);
       }
     }
+    shard->peers_used = 0;
+    shard->peer_exhausted = 0;
+
+    /* the blocks b with b % shards == i, their bitmaps in one allocation */
+    shard->host_table = (struct sr_nat_host **)calloc(SR_NAT_HASH_SZ, sizeof(struct sr_nat_host *));
+    shard->nblocks = (nblocks - i + SR_NAT_NSHARDS - 1) / SR_NAT_NSHARDS;
+    shard->blocks = (struct sr_nat_block *)calloc(shard->nblocks, sizeof(struct sr_nat_block));
+    bits = (uint32_t *)calloc(shard->nblocks * SR_NAT_NTYPES * words, sizeof(uint32_t));
+    if (shard->host_table == NULL || shard->blocks == NULL || bits == NULL){
+      free(bits);
+      return sr_nat_init_fail(nat, i);
+    }
+    for (j = 0; j < (int)shard->nblocks; j++){
+      shard->blocks[j].ports = bits + j * SR_NAT_NTYPES * words;
+    }
+    shard->blocks_used = 0;
+    shard->block_exhausted = 0;
+
+    /* a host holds a mapping, so there are never more of them */
+    shard->nhosts = shard->nmappings;
+    shard->mapping_pool = (struct sr_nat_mapping *)calloc(shard->nmappings, sizeof(struct sr_nat_mapping));
+    shard->conn_pool = (struct sr_nat_connection *)calloc(shard->nconns, sizeof(struct sr_nat_connection));
+    shard->host_pool = (struct sr_nat_host *)calloc(shard->nhosts, sizeof(struct sr_nat_host));
+    if (shard->mapping_pool == NULL || shard->conn_pool == NULL || shard->host_pool == NULL){
+      return sr_nat_init_fail(nat, i);
+    }
+    shard->free_mappings = NULL;
+    for (j = shard->nmappings - 1; j >= 0; j--){
+      shard->mapping_pool[j].next = shard->free_mappings;
+      shard->free_mappings = &(shard->mapping_pool[j]);
+    }
+    shard->free_conns = NULL;
+    for (j = shard->nconns - 1; j >= 0; j--){
+      shard->conn_pool[j].next = shard->free_conns;
+      shard->free_conns = &(shard->conn_pool[j]);
+    }
+    shard->free_hosts = NULL;
+    for (j = shard->nhosts - 1; j >= 0; j--){
+      shard->host_pool[j].hash_next = shard->free_hosts;
+      shard->free_hosts = &(shard->host_pool[j]);
+    }
+    shard->mappings_used = 0;
+    shard->mapping_exhausted = 0;
+    shard->conns_used = 0;
+    shard->conn_exhausted = 0;
+    shard->hosts_used = 0;
+    shard->host_exhausted = 0;
+    shard->lru_head = NULL;
+    shard->lru_tail = NULL;
+    shard->evictions = 0;
+    shard->quota_hits = 0;
   }
-  
 
-  if(copy != NULL)
-  printf("lookup_internal: int port %d, ext port %d\n", ntohs(aux_int), ntohs(copy->aux_ext));
+  /* timeouts are driven by the event loop through sr_nat_tick */
+  nat->reported_blocks = 0;
+  nat->reported_mappings = 0;
+  nat->reported_conns = 0;
+  nat->reported_hosts = 0;
+  nat->reported_peers = 0;
+  nat->reported_evictions = 0;
+  nat->reported_quota = 0;
 
+  /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
 
-  pthread_mutex_unlock(&(nat->lock));
-  return copy;
+  return 0;
 }
 
-/* Insert a new mapping into the nat's mapping table.
-   Actually returns a copy to the new mapping, for thread safety.
- */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_instance* sr, struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
-  uint32_t target_ip, uint16_t target_port, int ack, int syn, int fin ) {
 
-  pthread_mutex_lock(&(nat->lock));
+int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
 
-  /* handle insert here, create a mapping, and then return a copy of it */
-  struct sr_nat_mapping *mapping = (struct sr_nat_mapping *)malloc(sizeof(struct sr_nat_mapping));
+  int i;
+
+  /* free nat memory here, the mappings and their conns go with the pools,
+     without returning each port and logging every block on the way out */
+  for (i = 0; i < SR_NAT_NSHARDS; i++){
+    sr_nat_free_shard(&(nat->shards[i]));
+  }
+
+  free(nat->ext_ips);
+  return 0;
+}
+
+void sr_nat_tick(struct sr_nat *nat) {  /* Periodic Timout handling */
+  struct sr_nat_stats stats;
+  int i;
 
   time_t curtime = time(NULL);
-  mapping->type = type;
-  mapping->ip_int = ip_int;
-  /*mapping->ip_ext = nat->ext_ip;*/
-  mapping->ip_ext = sr_get_interface(sr, "eth2")->ip;
-  mapping->aux_int = aux_int;
+
+  /* handle periodic tasks here, a shard at a time */
+  for (i = 0; i < SR_NAT_NSHARDS; i++){
+    sr_nat_shard_timeout(nat, &(nat->shards[i]), curtime);
+  }
+
+  /* report running out of blocks once per tick it happened in */
+  sr_nat_get_stats(nat, &stats);
+  if (stats.block_exhausted != nat->reported_blocks){
+    fprintf(stderr, "** NAT port blocks exhausted: %lu of %lu in use, %lu failed allocations\n",
+      stats.blocks_used, stats.blocks_total, stats.block_exhausted);
+    nat->reported_blocks = stats.block_exhausted;
+  }
+  if (stats.mapping_exhausted != nat->reported_mappings){
+    fprintf(stderr, "** NAT mapping pool exhausted: %lu of %lu in use, %lu failed allocations\n",
+      stats.mappings_used, stats.mappings_total, stats.mapping_exhausted);
+    nat->reported_mappings = stats.mapping_exhausted;
+  }
+  if (stats.conn_exhausted != nat->reported_conns){
+    fprintf(stderr, "** NAT connection pool exhausted: %lu of %lu in use, %lu failed allocations\n",
+      stats.conns_used, stats.conns_total, stats.conn_exhausted);
+    nat->reported_conns = stats.conn_exhausted;
+  }
+  if (stats.host_exhausted != nat->reported_hosts){
+    fprintf(stderr, "** NAT host pool exhausted: %lu of %lu in use, %lu failed allocations\n",
+      stats.hosts_used, stats.hosts_total, stats.host_exhausted);
+    nat->reported_hosts = stats.host_exhausted;
+  }
+  if (stats.peer_exhausted != nat->reported_peers){
+    fprintf(stderr, "** NAT peer pool exhausted: %lu of %lu in use, %lu failed allocations\n",
+      stats.peers_used, stats.peers_total, stats.peer_exhausted);
+    nat->reported_peers = stats.peer_exhausted;
+  }
+  if (stats.evictions != nat->reported_evictions || stats.quota_hits != nat->reported_quota){
+    fprintf(stderr, "** NAT under pressure: %lu transitory connections evicted, %lu mappings refused by host limits\n",
+      stats.evictions, stats.quota_hits);
+    nat->reported_evictions = stats.evictions;
+    nat->reported_quota = stats.quota_hits;
+  }
+}
+
+/* Whether ip is one of the NAT's external addresses */
+int sr_nat_is_external(struct sr_nat *nat, uint32_t ip) {
+  unsigned int i;
+
+  for (i = 0; i < nat->next_ips; i++){
+    if (nat->ext_ips[i] == ip && ip != 0){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Port block and pool usage summed over the shards */
+void sr_nat_get_stats(struct sr_nat *nat, struct sr_nat_stats *stats) {
+  int i;
+
+  memset(stats, 0, sizeof(struct sr_nat_stats));
+  for (i = 0; i < SR_NAT_NSHARDS; i++){
+    struct sr_nat_shard *shard = &(nat->shards[i]);
+
+    stats->blocks_total += shard->nblocks;
+    stats->blocks_used += shard->blocks_used;
+    stats->block_exhausted += shard->block_exhausted;
+    stats->mappings_total += shard->nmappings;
+    stats->mappings_used += shard->mappings_used;
+    stats->mapping_exhausted += shard->mapping_exhausted;
+    stats->conns_total += shard->nconns;
+    stats->conns_used += shard->conns_used;
+    stats->conn_exhausted += shard->conn_exhausted;
+    stats->hosts_total += shard->nhosts;
+    stats->hosts_used += shard->hosts_used;
+    stats->host_exhausted += shard->host_exhausted;
+    stats->peers_total += shard->npeers;
+    stats->peers_used += shard->peers_used;
+    stats->peer_exhausted += shard->peer_exhausted;
+    stats->evictions += shard->evictions;
+    stats->quota_hits += shard->quota_hits;
+  }
+}
+
+/* Refresh a mapping for a packet from inside to target, and the connection
+   or session that goes with it. Returns that connection, or NULL when the
+   mapping does not track any. */
+static struct sr_nat_connection *sr_nat_touch_internal(struct sr_nat *nat,
+  struct sr_nat_shard *shard, struct sr_nat_mapping *mapping,
+  uint32_t target_ip, uint16_t target_port, int ack, int syn, int fin, time_t curtime) {
+
+  struct sr_nat_connection *conn = NULL;
+
   mapping->last_updated = curtime;
 
-  /* look for unused port */
-  struct sr_nat_mapping *temp_mapping;
-  uint16_t port = 1024;
+  /* if type is ICMP or UDP, push the mapping deadline back */
+  if (mapping->type != nat_mapping_tcp){
+    sr_nat_timer_arm(shard, &(mapping->timer), curtime + sr_nat_mapping_timeout(nat, mapping->type));
+  }
 
-  while (1){
+  if (sr_nat_tracks_sessions(nat, mapping->type)){
+    /* find right connection, or create it */
+    conn = sr_nat_find_connection(shard, mapping, target_ip, target_port);
+    if (conn == NULL){
+      conn = sr_nat_add_connection(nat, shard, mapping, target_ip, target_port, curtime);
+    }
 
-    for (temp_mapping = nat->mappings; temp_mapping != NULL; temp_mapping = temp_mapping->next){
-      if (port == temp_mapping->aux_ext){
-        port += 1;
-        break;
+    /* update it, an untracked packet still goes through when the pool is
+       empty */
+    if (conn != NULL){
+      if (mapping->type == nat_mapping_tcp){
+        sr_nat_update_connection_int(conn, ack, syn, fin, curtime);
       }
+      conn->last_updated = curtime;
+      sr_nat_timer_arm(shard, &(conn->timer), curtime + sr_nat_conn_timeout(nat, conn));
+      sr_nat_lru_update(shard, conn, 1);
     }
+  }
 
-    if (temp_mapping == NULL){
-      break;
+  return conn;
+}
+
+/* Run the filter on a packet from source arriving on a mapping, and refresh
+   the mapping if it passes. Returns 0 if the packet is filtered, otherwise
+   1 with *connp set to the matching connection (or NULL). */
+static int sr_nat_touch_external(struct sr_nat *nat,
+  struct sr_nat_shard *shard, struct sr_nat_mapping *mapping,
+  uint32_t source_ip, uint16_t source_port, int ack, int syn, int fin, time_t curtime,
+  struct sr_nat_connection **connp) {
+
+  struct sr_nat_connection *conn = NULL;
+
+  if (sr_nat_tracks_sessions(nat, mapping->type)){
+    conn = sr_nat_find_connection(shard, mapping, source_ip, source_port);
+  }
+
+  /* only let in what the internal host has sent to before */
+  if (nat->setting.filtering_mode == nat_address_dependent &&
+      conn == NULL && sr_nat_find_peer(shard, mapping, source_ip) == NULL){
+    return 0;
+  }
+  if (nat->setting.filtering_mode == nat_address_port_dependent && conn == NULL){
+    return 0;
+  }
+
+  mapping->last_updated = curtime;
+
+  /* if type is ICMP or UDP, push the mapping deadline back */
+  if (mapping->type != nat_mapping_tcp){
+    sr_nat_timer_arm(shard, &(mapping->timer), curtime + sr_nat_mapping_timeout(nat, mapping->type));
+  }
+
+  /* if type is TCP, a new peer the filter let through is tracked like the
+     inside does */
+  else if (conn == NULL){
+    conn = sr_nat_add_connection(nat, shard, mapping, source_ip, source_port, curtime);
+  }
+
+  if (conn != NULL){
+    if (mapping->type == nat_mapping_tcp){
+      sr_nat_update_connection_ext(conn, ack, syn, fin, curtime);
     }
-  } 
-  
-  mapping->aux_ext = port;
-  
+    conn->last_updated = curtime;
+    sr_nat_timer_arm(shard, &(conn->timer), curtime + sr_nat_conn_timeout(nat, conn));
+    sr_nat_lru_update(shard, conn, 1);
+  }
+
+  *connp = conn;
+  return 1;
+}
 
-  /* set up conns for Case ICMP or TCP*/
-  if (type == nat_mapping_icmp){
-    mapping->conns = NULL;
+/* Get the translation associated with given external port, for a packet
+   from (source_ip, source_port). Fills in *xlate and returns 1 on a hit,
+   returns 0 on a miss or when the filtering mode turns the packet away. */
+int sr_nat_lookup_external(struct sr_nat *nat,
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type,
+    uint32_t source_ip, uint16_t source_port, int ack, int syn, int fin,
+    struct sr_nat_xlate *xlate) {
+
+  struct sr_nat_shard *shard = sr_nat_shard_ext(nat, ip_ext, aux_ext);
+  if (shard == NULL){
+    return 0;
   }
 
-  else{
-    mapping->conns = sr_create_connection(target_ip, target_port, curtime);
-    sr_nat_update_connection_int(mapping->conns, ack, syn, fin, curtime);
+  /* handle lookup here, copy the result out to xlate */
+  struct sr_nat_mapping *mapping = sr_nat_find_external(shard, ip_ext, aux_ext, type);
+  struct sr_nat_connection* connection = NULL;
+  int hit = 0;
+
+  if (mapping != NULL){
+    hit = sr_nat_touch_external(nat, shard, mapping, source_ip, source_port,
+      ack, syn, fin, time(NULL), &connection);
   }
 
-  
-  /* put back to nat->mappings */
-  mapping->next = nat->mappings;
-  nat->mappings = mapping;
+  if (hit){
+    sr_nat_fill_xlate(xlate, mapping, connection);
+    printf("lookup_external: int port %d, ext port %d\n", ntohs(mapping->aux_int), ntohs(aux_ext));
+  }
 
-  /* make a copy to return */
-  struct sr_nat_mapping *copy = (struct sr_nat_mapping *)malloc(sizeof(struct sr_nat_mapping));
-  memcpy(copy, mapping, sizeof(struct sr_nat_mapping));
 
-  printf("nat_insert: int port %d, ext port %d\n", ntohs(mapping->aux_int), ntohs(mapping->aux_ext));
+  return hit;
+}
+
+/* Get the translation associated with given internal (ip, port) pair, for
+   a packet to (target_ip, target_port).
+   Fills in *xlate and returns 1 on a hit, returns 0 otherwise. */
+int sr_nat_lookup_internal(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
+  uint32_t target_ip, uint16_t target_port, int ack, int syn, int fin,
+  struct sr_nat_xlate *xlate) {
+
+  struct sr_nat_shard *shard = sr_nat_shard_int(nat, ip_int);
+  uint32_t ip_rem = target_ip;
+  uint16_t aux_rem = target_port;
+
+  sr_nat_mapping_key(nat, &ip_rem, &aux_rem);
+
+  /* handle lookup here, copy the result out to xlate. */
+  struct sr_nat_mapping *mapping = sr_nat_find_internal(shard, ip_int, aux_int, type, ip_rem, aux_rem);
+  struct sr_nat_connection* connection = NULL;
+
+  if (mapping != NULL){
+    connection = sr_nat_touch_internal(nat, shard, mapping, target_ip, target_port,
+      ack, syn, fin, time(NULL));
+
+    sr_nat_fill_xlate(xlate, mapping, connection);
+    printf("lookup_internal: int port %d, ext port %d\n", ntohs(aux_int), ntohs(mapping->aux_ext));
+  }
+
+
+  return mapping != NULL;
+}
 
-  pthread_mutex_unlock(&(nat->lock));
+/* Find the translation for an internal (ip, port) pair talking to
+   (target_ip, target_port) without touching any state, for ICMP errors
+   that quote one of its packets. Returns 1 on a hit. */
+int sr_nat_peek_internal(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
+  uint32_t target_ip, uint16_t target_port, struct sr_nat_xlate *xlate) {
+
+  struct sr_nat_shard *shard = sr_nat_shard_int(nat, ip_int);
+
+  sr_nat_mapping_key(nat, &target_ip, &target_port);
+
+  struct sr_nat_mapping *mapping = sr_nat_find_internal(shard, ip_int, aux_int, type,
+    target_ip, target_port);
+  if (mapping != NULL){
+    sr_nat_fill_xlate(xlate, mapping, NULL);
+  }
+
+  return mapping != NULL;
+}
+
+/* Find the translation for an external (ip, port) without touching any
+   state or filtering, for ICMP errors that quote one of its packets.
+   Returns 1 on a hit. */
+int sr_nat_peek_external(struct sr_nat *nat,
+  uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type,
+  struct sr_nat_xlate *xlate) {
+
+  struct sr_nat_shard *shard = sr_nat_shard_ext(nat, ip_ext, aux_ext);
+  if (shard == NULL){
+    return 0;
+  }
+
+  struct sr_nat_mapping *mapping = sr_nat_find_external(shard, ip_ext, aux_ext, type);
+  if (mapping != NULL){
+    sr_nat_fill_xlate(xlate, mapping, NULL);
+  }
 
-  return copy;
+  return mapping != NULL;
 }
 
+/* Insert a new mapping into the nat's mapping table.
+   Copies the new mapping out to xlate.
+   Returns 0 if the internal host has no port left for this type and no
+   free block can be claimed.
+ */
+int sr_nat_insert_mapping(struct sr_instance* sr, struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
+  uint32_t target_ip, uint16_t target_port, int ack, int syn, int fin,
+  struct sr_nat_xlate *xlate) {
 
-/* create a new connection */
-struct sr_nat_connection* sr_create_connection(uint32_t target_ip,
- uint16_t target_port, time_t last_updated){
+  struct sr_nat_shard *shard = sr_nat_shard_int(nat, ip_int);
 
-  struct sr_nat_connection* new_conn;
-  new_conn = (struct sr_nat_connection *)malloc(sizeof(struct sr_nat_connection));
+  /* no pool was given, use eth2's address now that it is known */
+  if (nat->ext_ips[0] == 0){
+    __sync_bool_compare_and_swap(&(nat->ext_ips[0]), 0, sr_get_interface(sr, "eth2")->ip);
+  }
+
+  /* a host at its limit only gets a mapping in place of one of its own */
+  struct sr_nat_host *host = sr_nat_find_host(shard, ip_int);
+  if (host != NULL && nat->setting.max_host_mappings &&
+      host->nmappings >= nat->setting.max_host_mappings &&
+      !sr_nat_evict(nat, shard, ip_int, 1, NULL)){
+    sr_nat_log_quota(nat, host);
+    shard->quota_hits++;
+    return 0;
+  }
+
+  /* handle insert here, take a mapping from the pool, and then copy it out */
+  if (shard->free_mappings == NULL){
+    sr_nat_evict(nat, shard, 0, 1, NULL);
+  }
+  struct sr_nat_mapping *mapping = shard->free_mappings;
+  if (mapping == NULL){
+    shard->mapping_exhausted++;
+    return 0;
+  }
+
+  mapping->type = type;
+  mapping->ip_int = ip_int;
+
+  /* look for unused port, counted in the shard's stats when there is none */
+  if (!sr_nat_alloc_port(nat, shard, mapping)){
+    return 0;
+  }
+  shard->free_mappings = mapping->next;
+  shard->mappings_used++;
+
+  time_t curtime = time(NULL);
+  mapping->aux_int = aux_int;
+  mapping->ip_rem = target_ip;
+  mapping->aux_rem = target_port;
+  sr_nat_mapping_key(nat, &(mapping->ip_rem), &(mapping->aux_rem));
+  mapping->last_updated = curtime;
+  mapping->conns = NULL;
+  mapping->timer.armed = 0;
+  mapping->timer.mapping = mapping;
+  mapping->timer.conn = NULL;
+
+  /* put back to shard->mappings and index it */
+  mapping->prev = NULL;
+  mapping->next = shard->mappings;
+  if (shard->mappings){
+    shard->mappings->prev = mapping;
+  }
+  shard->mappings = mapping;
+  sr_nat_hash_mapping(shard, mapping);
+
+  /* set up timers, and the first connection or session */
+  struct sr_nat_connection *conn = sr_nat_touch_internal(nat, shard, mapping,
+    target_ip, target_port, ack, syn, fin, curtime);
+
+  /* a TCP mapping only lives as long as its connections, without one it
+     would never expire */
+  if (mapping->type == nat_mapping_tcp && conn == NULL){
+    sr_nat_remove_mapping(nat, shard, mapping);
+    return 0;
+  }
+
+  /* copy it out */
+  sr_nat_fill_xlate(xlate, mapping, conn);
+
+  printf("nat_insert: int port %d, ext port %d\n", ntohs(mapping->aux_int), ntohs(mapping->aux_ext));
+
+  return 1;
+}
+
+
+/* create a new connection, out of the shard's pool */
+struct sr_nat_connection* sr_create_connection(struct sr_nat_shard *shard,
+ uint32_t target_ip, uint16_t target_port, time_t last_updated){
+
+  struct sr_nat_connection* new_conn = shard->free_conns;
+  if (new_conn == NULL){
+    shard->conn_exhausted++;
+    return NULL;
+  }
+  shard->free_conns = new_conn->next;
+  shard->conns_used++;
 
   new_conn->target_ip = target_ip;
   new_conn->target_port = target_port;
   new_conn->last_updated = last_updated;
   new_conn->state = LISTEN;
+  new_conn->timer.armed = 0;
+  new_conn->timer.mapping = NULL;
+  new_conn->timer.conn = new_conn;
+  new_conn->mapping = NULL;
+  new_conn->prev = NULL;
+  new_conn->next = NULL;
+  new_conn->hash_next = NULL;
+  new_conn->on_lru = 0;
+  new_conn->lru_prev = NULL;
+  new_conn->lru_next = NULL;
 
   return new_conn;
 
 }
 
+/* The connection state is kept from the point of view of the internal
+   host, so a segment from outside moves it the way the peer's segment
+   would on that host. FIN is honoured with or without ACK, since real
+   stacks always piggyback it. */
 void sr_nat_update_connection_ext(struct sr_nat_connection *conn, int ack, int syn, int fin, time_t last_updated){
-  /* case 010 */
-  if ((!ack) && syn && (!fin)){
-    conn->state = SYN_RECEIVED;
+
+  /* case 010 or 110: peer opens, or answers our SYN */
+  if (syn && !fin){
+    if (conn->state == LISTEN || conn->state == SYN_SENT || conn->state == CLOSED){
+      conn->state = SYN_RECEIVED;
+    }
   }
 
-  /* case 100 and previous state is SYN_RCVD */
-  else if (ack && (!syn) && (!fin) && (conn->state == SYN_RECEIVED)){
+  /* case 100 and SYN_RCVD: peer acks the internal host's SYN */
+  else if (ack && !syn && !fin && (conn->state == SYN_RECEIVED)){
     conn->state = ESTABLISHED;
   }
 
-  /* case 001 and ESTABLISHED */
-  else if (!ack && !syn && fin && (conn->state == ESTABLISHED)){
-    conn->state = CLOSE_WAIT;
+  /* case 100 and FIN_WAIT_1: our FIN is acked */
+  else if (ack && !syn && !fin && (conn->state == FIN_WAIT_1)){
+    conn->state = FIN_WAIT_2;
   }
 
-  /* case 101 and FIN_WAIT_1 */
-  else if (ack && !syn && fin && (conn->state == FIN_WAIT_1)){
-    conn->state = FIN_WAIT_2;
+  /* case x01 and ESTABLISHED: peer closes first */
+  else if (!syn && fin && (conn->state == ESTABLISHED)){
+    conn->state = CLOSE_WAIT;
   }
 
-  /* case 001 and FIN_WAIT_1 */
-  else if (!ack && !syn && fin && (conn->state == FIN_WAIT_1)){
-    conn->state = CLOSING;
+  /* case x01 and FIN_WAIT_1: simultaneous close */
+  else if (!syn && fin && (conn->state == FIN_WAIT_1)){
+    conn->state = ack ? TIME_WAIT : CLOSING;
   }
 
-  /* case 100 and CLOSING */
-  else if (ack && !syn && !fin && (conn->state == CLOSING)){
+  /* case x01 and FIN_WAIT_2 */
+  else if (!syn && fin && (conn->state == FIN_WAIT_2)){
     conn->state = TIME_WAIT;
   }
 
-  /* case 001 and FIN_WAIT_2 */
-  else if (!ack && !syn && fin && (conn->state == FIN_WAIT_2)){
+  /* case 100 and CLOSING */
+  else if (ack && !syn && !fin && (conn->state == CLOSING)){
     conn->state = TIME_WAIT;
   }
 
-  /* case 100 and LAST_ACK */
+  /* case 100 and LAST_ACK: our FIN is acked, both sides are done */
   else if (ack && !syn && !fin && (conn->state == LAST_ACK)){
     conn->state = CLOSED;
   }
@@ -419,46 +1376,28 @@ void sr_nat_update_connection_ext(struct sr_nat_connection *conn, int ack, int s
 
 void sr_nat_update_connection_int(struct sr_nat_connection *conn, int ack, int syn, int fin, time_t last_updated){
 
-  /* case 010 */
-  if ((!ack) && syn && (!fin)){
-    conn->state = SYN_SENT;
+  /* case 010: internal host opens */
+  if (!ack && syn && !fin){
+    if (conn->state == LISTEN || conn->state == CLOSED || conn->state == TIME_WAIT){
+      conn->state = SYN_SENT;
+    }
   }
 
-  /* case 100 and previous state is SYN_SENT */
-  else if (ack && (!syn) && (!fin) && (conn->state == SYN_SENT)){
+  /* case 100 and SYN_RCVD: three way handshake done */
+  else if (ack && !syn && !fin && (conn->state == SYN_RECEIVED)){
     conn->state = ESTABLISHED;
   }
 
-  /* case 001 and SYN_RECEIVED */
-  else if (!ack && !syn && fin && (conn->state == SYN_RECEIVED)){
+  /* case x01 and ESTABLISHED or SYN_RCVD: internal host closes first */
+  else if (!syn && fin && (conn->state == ESTABLISHED || conn->state == SYN_RECEIVED)){
     conn->state = FIN_WAIT_1;
   }
 
-  /* case 001 and ESTABLISHED */
-  else if (!ack && !syn && fin && (conn->state == ESTABLISHED)){
-    conn->state = FIN_WAIT_1;
-  }
-
-  /* case 101 and FIN_WAIT_1 */
-  else if (ack && !syn && fin && (conn->state == ESTABLISHED)){
-    conn->state = CLOSE_WAIT;
-  }
-
-  /* case 001 and CLOSING */
-  else if (!ack && !syn && fin && (conn->state == CLOSE_WAIT)){
+  /* case x01 and CLOSE_WAIT */
+  else if (!syn && fin && (conn->state == CLOSE_WAIT)){
     conn->state = LAST_ACK;
   }
 
-  /* case 100 and FIN_WAIT_1 */
-  else if (ack && !syn && !fin && (conn->state == FIN_WAIT_1)){
-    conn->state = CLOSING;
-  }
-
-  /* case 100 and TIME_WAIT */
-  else if (ack && !syn && !fin && (conn->state == FIN_WAIT_2)){
-    conn->state = TIME_WAIT;
-  }
-
   conn->last_updated = last_updated;
 }
 
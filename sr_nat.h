@@ -4,7 +4,6 @@
 
 #include <inttypes.h>
 #include <time.h>
-#include <pthread.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
@@ -12,12 +11,41 @@
 #include <stdio.h>
 #include "sr_if.h"
 
+/* number of shards the state is split into, must be a power of two. Mappings
+   live in the shard picked by their internal address; external port blocks
+   are dealt out round robin so block % shards names the owner. */
+#define SR_NAT_NSHARDS 8
+
+/* number of buckets in each shard's mapping index, must be a power of two */
+#define SR_NAT_HASH_SZ 4096
+
+/* number of buckets in each shard's connection index, must be a power of two */
+#define SR_NAT_CONN_HASH_SZ 8192
+
+/* number of sr_nat_mapping_type values, one port space each */
+#define SR_NAT_NTYPES 3
+
+/* timer wheel of one second slots, must be a power of two. Timeouts longer
+   than the wheel wrap around and are skipped until their round comes up. */
+#define SR_NAT_WHEEL_SZ 512
+
+/* most timers expired per tick, the rest wait for the next tick */
+#define SR_NAT_EXPIRE_BUDGET 4096
+
 typedef enum {
   nat_mapping_icmp,
-  nat_mapping_tcp
-  /* nat_mapping_udp, */
+  nat_mapping_tcp,
+  nat_mapping_udp
 } sr_nat_mapping_type;
 
+/* RFC 4787 behaviour, picks which remote end a mapping (or a filter)
+   depends on */
+typedef enum {
+  nat_endpoint_independent,
+  nat_address_dependent,
+  nat_address_port_dependent
+} sr_nat_behavior;
+
 typedef enum {
   LISTEN,
   SYN_SENT,
@@ -36,6 +64,45 @@ struct sr_nat_timeout_s {
   double ICMP_timeout;
   double TCP_Est_timeout;
   double TCP_Tran_timeout;
+  double UDP_timeout;
+
+  /* external port (or icmp id) range handed out to mappings, host order */
+  uint16_t port_min;
+  uint16_t port_max;
+
+  /* external addresses in network order, none means eth2's own address */
+  uint32_t *ext_ips;
+  unsigned int next_ips;
+
+  /* ports per block handed to an internal host, a multiple of 32 */
+  unsigned int block_size;
+
+  /* records preallocated for the whole NAT, split evenly over the shards.
+     Nothing is allocated beyond them. Host records come one per mapping and
+     peer records one per connection, as neither outnumbers what it counts. */
+  unsigned int max_mappings;
+  unsigned int max_conns;
+
+  /* most mappings one internal host may hold, 0 for no limit */
+  unsigned int max_host_mappings;
+
+  sr_nat_behavior mapping_mode;
+  sr_nat_behavior filtering_mode;
+};
+
+struct sr_nat_mapping;
+struct sr_nat_connection;
+struct sr_nat_block;
+
+/* Expiry timer embedded in a mapping or a connection. Re-armed on every
+   update, unlinked when the owner is freed. */
+struct sr_nat_timer {
+  time_t expires;
+  int armed;
+  struct sr_nat_mapping *mapping; /* owner mapping */
+  struct sr_nat_connection *conn; /* owner connection, null for mapping timers */
+  struct sr_nat_timer *prev;
+  struct sr_nat_timer *next;
 };
 
 struct sr_nat_connection {
@@ -46,9 +113,18 @@ struct sr_nat_connection {
   uint32_t target_ip;
   uint16_t target_port;
 
+  struct sr_nat_timer timer;
 
-
+  struct sr_nat_mapping *mapping; /* owner mapping */
+  struct sr_nat_connection *prev;
   struct sr_nat_connection *next;
+  struct sr_nat_connection *hash_next; /* chain in the 5-tuple index */
+
+  /* place in the shard's list of transitory TCP connections, least
+     recently used first */
+  int on_lru;
+  struct sr_nat_connection *lru_prev;
+  struct sr_nat_connection *lru_next;
 };
 
 struct sr_nat_mapping {
@@ -57,9 +133,119 @@ struct sr_nat_mapping {
   uint32_t ip_ext; /* external ip addr */
   uint16_t aux_int; /* internal port or icmp id */
   uint16_t aux_ext; /* external port or icmp id */
+  unsigned int block; /* shard index of the port block aux_ext came from */
+  uint32_t ip_rem; /* remote ip the mapping is bound to, 0 unless address dependent */
+  uint16_t aux_rem; /* remote port the mapping is bound to, 0 unless port dependent */
   time_t last_updated; /* use to timeout mappings */
-  struct sr_nat_connection *conns; /* list of connections. null for ICMP */
+  struct sr_nat_connection *conns; /* TCP connections, or ICMP/UDP sessions when filtering needs them */
+  struct sr_nat_timer timer; /* ICMP only, TCP mappings go with their last conn */
+  struct sr_nat_mapping *prev;
   struct sr_nat_mapping *next;
+  struct sr_nat_mapping *int_next; /* chain in the (ip_int, aux_int, type, remote) index */
+  struct sr_nat_mapping *ext_next; /* chain in the (ip_ext, aux_ext, type) index */
+};
+
+/* An internal host and the port blocks it holds. It goes away with its
+   last mapping. Free ones are chained on hash_next. */
+struct sr_nat_host {
+  uint32_t ip_int;
+  unsigned int nmappings;
+  unsigned long quota_hits; /* mappings refused for being over the limit */
+  struct sr_nat_block *blocks;
+  struct sr_nat_host *hash_next;
+};
+
+/* block_size consecutive ports of one external address, all handed to one
+   internal host, with a port bitmap per mapping type */
+struct sr_nat_block {
+  struct sr_nat_host *host; /* null while free */
+  unsigned int nmappings;
+  uint32_t *ports; /* SR_NAT_NTYPES bitmaps of block_size bits */
+  struct sr_nat_block *host_next;
+};
+
+/* How many of a mapping's connections go to one remote address, kept for
+   address dependent filtering only. Free ones are chained on hash_next. */
+struct sr_nat_peer {
+  struct sr_nat_mapping *mapping;
+  uint32_t ip;
+  unsigned int refs;
+  struct sr_nat_peer *hash_next;
+};
+
+/* What a lookup hands back to the packet path: the two ends of a mapping,
+   copied out by value so nothing has to be allocated or freed per packet. */
+struct sr_nat_xlate {
+  sr_nat_mapping_type type;
+  uint32_t ip_int; /* internal ip addr */
+  uint32_t ip_ext; /* external ip addr */
+  uint16_t aux_int; /* internal port or icmp id */
+  uint16_t aux_ext; /* external port or icmp id */
+  tcp_connection_state state; /* state of the matching connection, TCP only */
+};
+
+/* A slice of the NAT state with its own indexes, pools and timer wheel.
+   Like the rest of the NAT it is only touched from the event loop's
+   thread, so it has no lock. */
+struct sr_nat_shard {
+  struct sr_nat_mapping *mappings;
+
+  /* hash indexes over the mappings list */
+  struct sr_nat_mapping **int_table;
+  struct sr_nat_mapping **ext_table;
+
+  /* hash index over every mapping's conns, keyed by the 5-tuple */
+  struct sr_nat_connection **conn_table;
+
+  /* (mapping, remote ip) index, null unless filtering is address dependent */
+  struct sr_nat_peer **peer_table;
+
+  /* internal hosts by address */
+  struct sr_nat_host **host_table;
+
+  /* the port blocks b with b % SR_NAT_NSHARDS == shard, at b / SR_NAT_NSHARDS */
+  struct sr_nat_block *blocks;
+  unsigned int nblocks;
+
+  /* fixed pools of mappings and connections, free ones chained on next */
+  struct sr_nat_mapping *mapping_pool;
+  struct sr_nat_mapping *free_mappings;
+  struct sr_nat_connection *conn_pool;
+  struct sr_nat_connection *free_conns;
+  unsigned int nmappings;
+  unsigned int nconns;
+
+  /* fixed pools of host records, nmappings of them, and of peer records,
+     nconns of them when there is a peer_table */
+  struct sr_nat_host *host_pool;
+  struct sr_nat_host *free_hosts;
+  struct sr_nat_peer *peer_pool;
+  struct sr_nat_peer *free_peers;
+  unsigned int nhosts;
+  unsigned int npeers;
+  /* transitory TCP connections, evicted oldest first under pressure */
+  struct sr_nat_connection *lru_head;
+  struct sr_nat_connection *lru_tail;
+
+  /* counters */
+  unsigned long blocks_used;
+  unsigned long block_exhausted; /* a host needed a block and none was free */
+  unsigned long mappings_used;
+  unsigned long mapping_exhausted; /* the mapping pool was empty */
+  unsigned long conns_used;
+  unsigned long conn_exhausted; /* the connection pool was empty */
+  unsigned long hosts_used;
+  unsigned long host_exhausted; /* the host pool was empty */
+  unsigned long peers_used;
+  unsigned long peer_exhausted; /* the peer pool was empty */
+  unsigned long evictions; /* transitory connections dropped to make room */
+  unsigned long quota_hits; /* mappings refused by a host's limit */
+
+  /* expiry timers, slot = expires % SR_NAT_WHEEL_SZ */
+  struct sr_nat_timer **wheel;
+  time_t wheel_time; /* last second fully expired */
+  struct sr_nat_timer *expire_next; /* next timer of the slot being expired */
+
 };
 
 struct sr_nat {
@@ -68,40 +254,88 @@ struct sr_nat {
   uint32_t int_ip;*/
   struct sr_nat_timeout_s setting;
 
-  struct sr_nat_mapping *mappings;
+  /* external address pool, blocks number addr * blocks_per_ip + port block */
+  uint32_t *ext_ips;
+  unsigned int next_ips;
+  unsigned int blocks_per_ip;
 
-  /* threading */
-  pthread_mutex_t lock;
-  pthread_mutexattr_t attr;
-  pthread_attr_t thread_attr;
-  pthread_t thread;
+  struct sr_nat_shard shards[SR_NAT_NSHARDS];
+
+  /* failure counters as of the last report, see sr_nat_tick */
+  unsigned long reported_blocks;
+  unsigned long reported_mappings;
+  unsigned long reported_conns;
+  unsigned long reported_hosts;
+  unsigned long reported_peers;
+  unsigned long reported_evictions;
+  unsigned long reported_quota;
 };
 
 
 int   sr_nat_init(struct sr_nat *nat, struct sr_nat_timeout_s setting);     /* Initializes the nat */
 int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
-void *sr_nat_timeout(void *nat_ptr);  /* Periodic Timout */
+void  sr_nat_tick(struct sr_nat *nat);  /* Periodic Timout, once a second */
 
-/* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type,
-    uint32_t source_ip, uint16_t source_port, int ack, int syn, int fin );
+/* Get the translation associated with given external port, for a packet
+   from (source_ip, source_port). Fills in *xlate and returns 1 on a hit,
+   returns 0 on a miss or when the filtering mode turns the packet away. */
+int sr_nat_lookup_external(struct sr_nat *nat,
+    uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type,
+    uint32_t source_ip, uint16_t source_port, int ack, int syn, int fin,
+    struct sr_nat_xlate *xlate );
 
-/* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
+/* Get the translation associated with given internal (ip, port) pair.
+   Fills in *xlate and returns 1 on a hit, returns 0 otherwise. */
+int sr_nat_lookup_internal(struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type, 
-  uint32_t source_ip, uint16_t source_port, int ack, int syn, int fin );
+  uint32_t source_ip, uint16_t source_port, int ack, int syn, int fin,
+  struct sr_nat_xlate *xlate );
+
+/* The same lookups without refreshing timers, tracking connections or
+   filtering, for ICMP errors that quote a translated packet. */
+int sr_nat_peek_internal(struct sr_nat *nat,
+  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
+  uint32_t target_ip, uint16_t target_port, struct sr_nat_xlate *xlate );
+int sr_nat_peek_external(struct sr_nat *nat,
+  uint32_t ip_ext, uint16_t aux_ext, sr_nat_mapping_type type,
+  struct sr_nat_xlate *xlate );
 
 /* Insert a new mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_instance* sr, struct sr_nat *nat,
+   Fills in *xlate and returns 1, or returns 0 when the internal host's
+   port blocks are full and no free block is left. */
+int sr_nat_insert_mapping(struct sr_instance* sr, struct sr_nat *nat,
   uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type,
-  uint32_t source_ip, uint16_t source_port, int ack, int syn, int fin );
+  uint32_t source_ip, uint16_t source_port, int ack, int syn, int fin,
+  struct sr_nat_xlate *xlate );
+
+/* Whether ip is one of the NAT's external addresses */
+int sr_nat_is_external(struct sr_nat *nat, uint32_t ip);
+
+/* Port block and pool usage summed over the shards */
+struct sr_nat_stats {
+  unsigned long blocks_total;
+  unsigned long blocks_used;
+  unsigned long block_exhausted;
+  unsigned long mappings_total;
+  unsigned long mappings_used;
+  unsigned long mapping_exhausted;
+  unsigned long conns_total;
+  unsigned long conns_used;
+  unsigned long conn_exhausted;
+  unsigned long hosts_total;
+  unsigned long hosts_used;
+  unsigned long host_exhausted;
+  unsigned long peers_total;
+  unsigned long peers_used;
+  unsigned long peer_exhausted;
+  unsigned long evictions;
+  unsigned long quota_hits;
+};
+void sr_nat_get_stats(struct sr_nat *nat, struct sr_nat_stats *stats);
 
-struct sr_nat_connection* sr_create_connection(uint32_t target_ip,
- uint16_t target_port, time_t last_updated);
+/* Take a connection from the shard's pool, NULL when it is empty. */
+struct sr_nat_connection* sr_create_connection(struct sr_nat_shard *shard,
+ uint32_t target_ip, uint16_t target_port, time_t last_updated);
 
 void sr_nat_update_connection_ext(struct sr_nat_connection *conn,
  int ack, int syn, int fin, time_t last_updated);
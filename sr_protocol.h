@@ -173,6 +173,19 @@ struct sr_tcp_hdr
 typedef struct sr_tcp_hdr sr_tcp_hdr_t;
 
 
+/*
+ * Structure of a udp header. A zero checksum means none was computed.
+ */
+struct sr_udp_hdr
+  {
+    uint16_t port_src;     /* source port */
+    uint16_t port_dst;      /* destination port */
+    uint16_t length;      /* header and data length */
+    uint16_t udp_sum;      /* checksum */
+  } __attribute__ ((packed)) ;
+typedef struct sr_udp_hdr sr_udp_hdr_t;
+
+
 
 
 /* 
@@ -194,6 +207,8 @@ typedef struct sr_ethernet_hdr sr_ethernet_hdr_t;
 
 enum sr_ip_protocol {
   ip_protocol_icmp = 0x0001,
+  ip_protocol_tcp = 0x0006,
+  ip_protocol_udp = 0x0011,
 };
 
 enum sr_ethertype {
@@ -23,6 +23,7 @@
 #include "sr_arpcache.h"
 #include "sr_utils.h"
 #include "sr_nat.h"
+#include "sr_buf.h"
 
 /*---------------------------------------------------------------------
  * Method: sr_init(void)
@@ -42,18 +43,11 @@ void sr_init(struct sr_instance* sr,
     /* REQUIRES */
     assert(sr);
 
-    /* Initialize cache and cache cleanup thread */
+    /* Initialize cache, the event loop times it out */
     sr_arpcache_init(&(sr->cache));
-
-    pthread_attr_init(&(sr->attr));
-    pthread_attr_setdetachstate(&(sr->attr), PTHREAD_CREATE_JOINABLE);
-    pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
-    pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
-    pthread_t thread;
-
-    pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
     
     /* Add initialization code here! */
+    sr->enable_nat = flag;
     if (flag){
       if (sr_nat_init(&(sr->nat), setting) != 0){
         fprintf(stderr,"Error setting up NAT\n");
@@ -146,8 +140,11 @@ int sr_handle_arppacket(struct sr_instance* sr,
       return -1;
     }
 
-    /* if the ARP packet is not for me, just ignore this packet, return -1 */
-    if (if_list->ip != arp_hdr->ar_tip) {
+    /* if the ARP packet is not for me, just ignore this packet, return -1.
+       On the outside we also answer for the NAT's external addresses. */
+    if (if_list->ip != arp_hdr->ar_tip &&
+        !(sr->enable_nat && (strncmp(interface, eth2, 4)==0) &&
+          sr_nat_is_external(&(sr->nat), arp_hdr->ar_tip))) {
       fprintf(stderr , "** Ingore: the ARP packet is not for us \n"); 
       return -1;
     }
@@ -181,10 +178,7 @@ int sr_handle_arppacket(struct sr_instance* sr,
           memcpy(buf_hdr->ether_shost, if_list->addr, ETHER_ADDR_LEN);
 
           /* set up IP header */
-          buf_iphdr->ip_ttl--;
-          buf_iphdr->ip_sum = buf_iphdr->ip_sum >> 16;
-
-          buf_iphdr->ip_sum = cksum(buf_iphdr, sizeof(sr_ip_hdr_t));
+          ip_decrement_ttl(buf_iphdr);
 
           sr_send_packet(sr, packet_temp->buf, packet_temp->len, packet_temp->iface);
 
@@ -207,8 +201,9 @@ int sr_handle_arppacket(struct sr_instance* sr,
       /* Construct an ARP Reply and Send it back */
 
       /* set arp header */ 
+      uint32_t ar_tip = arp_hdr->ar_tip;
       arp_hdr->ar_tip = arp_hdr->ar_sip;
-      arp_hdr->ar_sip = if_list->ip;
+      arp_hdr->ar_sip = ar_tip;
       arp_hdr->ar_op = htons(arp_op_reply);
       memcpy(arp_hdr->ar_tha, arp_hdr->ar_sha, ETHER_ADDR_LEN);
       memcpy(arp_hdr->ar_sha, if_list->addr, ETHER_ADDR_LEN);
@@ -226,6 +221,11 @@ int sr_handle_arppacket(struct sr_instance* sr,
 
 
 
+/* ICMP types that quote the packet they are about */
+static int sr_icmp_is_error(uint8_t icmp_type){
+  return icmp_type == 3 || icmp_type == 11 || icmp_type == 12;
+}
+
 int sr_handle_ippacket(struct sr_instance* sr,
         uint8_t * packet/* lent */,
         unsigned int len,
@@ -261,28 +261,49 @@ int sr_handle_ippacket(struct sr_instance* sr,
     for (iface = sr->if_list; iface != NULL; iface = iface->next){
       if (ip_hdr->ip_dst == iface->ip) {
         flag = 1;
-        
-        /* If it is a ICMP echo reply, only available WHEN NAT is function */
-        if (sr->enable_nat && (icmp_hdr->icmp_type == 0)){
-          /* if the case is reply, meaning forward it, similar to case not for me */
-          flag = 0;
-          nat_reply_special_mark = 1;
-        }
         break;
       }
     }
+
+    /* the NAT's external addresses are ours too, on the outside */
+    if (!flag && sr->enable_nat && (strncmp(interface, eth2, 4)==0) &&
+        sr_nat_is_external(&(sr->nat), ip_hdr->ip_dst)){
+      flag = 1;
+    }
+
+    /* If it is a ICMP echo reply, only available WHEN NAT is function */
+    if (flag && sr->enable_nat && (ip_hdr->ip_p == ip_protocol_icmp) && (icmp_hdr->icmp_type == 0)){
+      /* if the case is reply, meaning forward it, similar to case not for me */
+      flag = 0;
+      nat_reply_special_mark = 1;
+    }
     
+    /* ICMP errors about translated packets, in either direction */
+    if (sr->enable_nat == 1 && (ip_hdr->ip_p == ip_protocol_icmp) &&
+        len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_hdr_t) &&
+        sr_icmp_is_error(icmp_hdr->icmp_type)){
+
+      if (flag == 1 && (strncmp(interface, eth2, 4)==0)){
+        return sr_handle_icmperror_from_outside(sr, packet, len, interface);
+      }
+      else if (flag == 0 && (strncmp(interface, eth1, 4)==0)){
+        return sr_handle_icmperror_from_inside(sr, packet, len, interface);
+      }
+    }
+
     /* This is a TCP PACKET && NAT IS ON function */
-    if (sr->enable_nat == 1 && (ip_hdr->ip_p == 0x0006)){
+    if (sr->enable_nat == 1 && (ip_hdr->ip_p == ip_protocol_tcp)){
 
       /* TCP from server to client */
       if (flag == 1 && (strncmp(interface, eth2, 4)==0)){
-        sr_handle_tcppacket_from_outside(sr, packet, len, interface);
+        return sr_handle_tcppacket_from_outside(sr, packet, len, interface);
       }
 
-      /* TCP from client to server */
-      else if (flag == 0 && (strncmp(interface, eth1, 4)==0)){
-        sr_handle_tcppacket_from_inside(sr, packet, len, interface);
+      /* TCP from client to server, or to another client through our
+         external address */
+      else if ((strncmp(interface, eth1, 4)==0) &&
+          (flag == 0 || sr_nat_is_external(&(sr->nat), ip_hdr->ip_dst))){
+        return sr_handle_tcppacket_from_inside(sr, packet, len, interface);
       }
 
       else{
@@ -291,6 +312,24 @@ int sr_handle_ippacket(struct sr_instance* sr,
       }
     }
 
+    /* This is a UDP PACKET && NAT IS ON function */
+    if (sr->enable_nat == 1 && (ip_hdr->ip_p == ip_protocol_udp)){
+
+      /* UDP from outside to a mapped port */
+      if (flag == 1 && (strncmp(interface, eth2, 4)==0)){
+        return sr_handle_udppacket_from_outside(sr, packet, len, interface);
+      }
+
+      /* UDP from inside to the outside, or back in through our external
+         address */
+      else if ((strncmp(interface, eth1, 4)==0) &&
+          (flag == 0 || sr_nat_is_external(&(sr->nat), ip_hdr->ip_dst))){
+        return sr_handle_udppacket_from_inside(sr, packet, len, interface);
+      }
+
+      /* anything else, e.g. to the router itself, is handled below */
+    }
+
 
     struct sr_if* if_list;
     if_list = sr_get_interface(sr, interface);
@@ -333,7 +372,8 @@ int sr_handle_ippacket(struct sr_instance* sr,
           /* Using Routing Table to Recheck */
 
           struct sr_rt* rtable;
-          rtable = sr_helper_rtable(sr, ip_hdr->ip_src);    
+          struct sr_rt rt_entry;
+          rtable = sr_helper_rtable(sr, ip_hdr->ip_src, &rt_entry);    
 
           int eth2_flag = 0;
           /* if Nat is enable */
@@ -352,10 +392,7 @@ int sr_handle_ippacket(struct sr_instance* sr,
               new_ip_hdr->ip_sum = cksum(new_ip_hdr, sizeof(sr_ip_hdr_t));
 
               /* Set up ICMP Header */
-              new_icmp_hrd_t8->icmp_type = 0;
-              new_icmp_hrd_t8->icmp_sum = new_icmp_hrd_t8->icmp_sum >> 16;
-              new_icmp_hrd_t8->icmp_sum = cksum(new_icmp_hrd_t8, len - sizeof(struct sr_ethernet_hdr) - 
-                sizeof(struct sr_ip_hdr));
+              icmp_set_type(new_icmp_hrd, 0);
 
             }
 
@@ -363,32 +400,22 @@ int sr_handle_ippacket(struct sr_instance* sr,
             if (strncmp(eth2, interface, 4) == 0){
               
               /* check mapping */
-              struct sr_nat_mapping* mapping;
-              mapping = sr_nat_lookup_external(&(sr->nat), new_icmp_hrd_t8->port, nat_mapping_icmp, 0, 0, 0, 0, 0);
+              struct sr_nat_xlate xlate;
 
               /* Hit */
-              if (mapping != NULL){
+              if (sr_nat_lookup_external(&(sr->nat), ip_hdr->ip_dst, new_icmp_hrd_t8->port, nat_mapping_icmp, ip_hdr->ip_src, 0, 0, 0, 0, &xlate)){
 
                 /* aiming host ip */
-                rtable = sr_helper_rtable(sr, mapping->ip_int);
+                rtable = sr_helper_rtable(sr, xlate.ip_int, &rt_entry);
 
                 /* Set up IP Header */
-                new_ip_hdr->ip_dst = mapping->ip_int;
-                new_ip_hdr->ip_ttl--;
-                new_ip_hdr->ip_p = ip_protocol_icmp;
-                new_ip_hdr->ip_sum = new_ip_hdr->ip_sum >> 16;
-                new_ip_hdr->ip_sum = cksum(new_ip_hdr, sizeof(sr_ip_hdr_t));
+                new_ip_hdr->ip_sum = cksum_update32(new_ip_hdr->ip_sum, new_ip_hdr->ip_dst, xlate.ip_int);
+                new_ip_hdr->ip_dst = xlate.ip_int;
+                ip_decrement_ttl(new_ip_hdr);
 
                 /* Set up ICMP Header */
-                new_icmp_hrd_t8->port = mapping->aux_int;
-                new_icmp_hrd_t8->icmp_sum = new_icmp_hrd_t8->icmp_sum >> 16;
-                /*
-                new_icmp_hrd_t8->icmp_sum = cksum(new_icmp_hrd_t8, len - sizeof(struct sr_ethernet_hdr) - 
-                  sizeof(struct sr_ip_hdr));
-                */
-                
-                
-                free(mapping);
+                new_icmp_hrd_t8->icmp_sum = cksum_update16(new_icmp_hrd_t8->icmp_sum, new_icmp_hrd_t8->port, xlate.aux_int);
+                new_icmp_hrd_t8->port = xlate.aux_int;
               }
 
               /* Missed -> send reply ?*/
@@ -404,10 +431,7 @@ int sr_handle_ippacket(struct sr_instance* sr,
                 new_ip_hdr->ip_sum = cksum(new_ip_hdr, sizeof(sr_ip_hdr_t));
 
                 /* Set up ICMP Header */
-                new_icmp_hrd_t8->icmp_type = 0;
-                new_icmp_hrd_t8->icmp_sum = new_icmp_hrd_t8->icmp_sum >> 16;
-                new_icmp_hrd_t8->icmp_sum = cksum(new_icmp_hrd_t8, len - sizeof(struct sr_ethernet_hdr) - 
-                  sizeof(struct sr_ip_hdr));
+                icmp_set_type(new_icmp_hrd, 0);
 
               }
 
@@ -443,22 +467,18 @@ int sr_handle_ippacket(struct sr_instance* sr,
               new_ip_hdr->ip_sum = cksum(new_ip_hdr, sizeof(sr_ip_hdr_t));
         
               /* Set up ICMP Header */
-              new_icmp_hrd->icmp_type = 0;
-              new_icmp_hrd->icmp_sum = new_icmp_hrd->icmp_sum >> 16;
-              new_icmp_hrd->icmp_sum = cksum(new_icmp_hrd, len - sizeof(struct sr_ethernet_hdr) - 
-                sizeof(struct sr_ip_hdr));
+              icmp_set_type(new_icmp_hrd, 0);
             }
             
 
             /* Check Cache */
-            struct sr_arpentry * entry;
-            entry = sr_arpcache_lookup(&(sr->cache), rtable->gw.s_addr);
+            struct sr_arpentry entry;
 
             /* Hit */
-            if (entry){
+            if (sr_arpcache_get(&(sr->cache), rtable->gw.s_addr, &entry)){
               
               /* Set up Ethernet Header */
-              memcpy(new_e_hdr->ether_dhost, entry->mac, ETHER_ADDR_LEN);
+              memcpy(new_e_hdr->ether_dhost, entry.mac, ETHER_ADDR_LEN);
               memcpy(new_e_hdr->ether_shost, if_list->addr, ETHER_ADDR_LEN);
 
               /* send icmp echo reply packet */
@@ -473,19 +493,19 @@ int sr_handle_ippacket(struct sr_instance* sr,
             else{
               uint8_t *arp_packet = sr_create_arppacket(if_list->addr, if_list->ip, rtable->gw.s_addr);
               sr_send_packet(sr, arp_packet, sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr), rtable->interface);
+              sr_buf_free(arp_packet);
               sr_arpcache_queuereq(&(sr->cache), rtable->gw.s_addr, new_packet, len, rtable->interface);
             }
          
           }
           
-          free(rtable);
-          free(new_packet);
+          sr_buf_free(new_packet);
         }
       }
 
 
       /* if it is TCP/UDP, send ICMP port unreachable */
-      else if ((ip_hdr->ip_p == 0x0006) || (ip_hdr->ip_p == 0x0011)){
+      else if ((ip_hdr->ip_p == ip_protocol_tcp) || (ip_hdr->ip_p == ip_protocol_udp)){
         
         /* Sanity-check */
         if ( len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)){
@@ -520,6 +540,7 @@ int sr_handle_ippacket(struct sr_instance* sr,
 
       /* checking routing table, perform LPM */
       struct sr_rt* rtable;
+      struct sr_rt rt_entry;
 
 
       if (nat_reply_special_mark && (strncmp(interface, eth2, 4)==0) ){
@@ -529,19 +550,22 @@ int sr_handle_ippacket(struct sr_instance* sr,
             + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
       
         /* check mapping */
-        struct sr_nat_mapping* mapping;
-        mapping = sr_nat_lookup_external(&(sr->nat), icmp_hrd_t8->port, nat_mapping_icmp, 0, 0, 0, 0, 0);
+        struct sr_nat_xlate xlate;
 
-        if (mapping != NULL){
-          rtable = sr_helper_rtable(sr, mapping->ip_int);
-          free(mapping); 
+        if (sr_nat_lookup_external(&(sr->nat), ip_hdr->ip_dst, icmp_hrd_t8->port, nat_mapping_icmp, ip_hdr->ip_src, 0, 0, 0, 0, &xlate)){
+          rtable = sr_helper_rtable(sr, xlate.ip_int, &rt_entry);
+        }
+
+        /* no mapping for this reply, drop it */
+        else{
+          return -1;
         }
 
         
       }
 
       else{
-        rtable = sr_helper_rtable(sr, ip_hdr->ip_dst);
+        rtable = sr_helper_rtable(sr, ip_hdr->ip_dst, &rt_entry);
       }
      
 
@@ -556,7 +580,7 @@ int sr_handle_ippacket(struct sr_instance* sr,
       /* if match, check ARP cache */
       else{
 
-        struct sr_arpentry* entry;
+        struct sr_arpentry entry;
 
         /* get new interface */
         if_list = sr_get_interface(sr, rtable->interface);
@@ -571,28 +595,22 @@ int sr_handle_ippacket(struct sr_instance* sr,
           /* from inside to outside */
           if (strncmp(interface, eth1, 4)==0) {
 
-            /* checking the nat mapping table*/
-            struct sr_nat_mapping* mapping;
-            mapping = sr_nat_lookup_internal(&(sr->nat), ip_hdr->ip_src, icmp_hrd_t8->port, nat_mapping_icmp, 0, 0, 0, 0, 0);
+            /* checking the nat mapping table, not found, create a new mapping */
+            struct sr_nat_xlate xlate;
+            if (!sr_nat_lookup_internal(&(sr->nat), ip_hdr->ip_src, icmp_hrd_t8->port, nat_mapping_icmp, ip_hdr->ip_dst, 0, 0, 0, 0, &xlate) &&
+                !sr_nat_insert_mapping(sr, &(sr->nat), ip_hdr->ip_src, icmp_hrd_t8->port, nat_mapping_icmp, ip_hdr->ip_dst, 0, 0, 0, 0, &xlate)){
 
-            /* not found, create a new mapping */
-            if (mapping == NULL){
-              mapping = sr_nat_insert_mapping(sr, &(sr->nat), ip_hdr->ip_src, icmp_hrd_t8->port, nat_mapping_icmp, 0, 0, 0, 0, 0);
+              /* no external id left, drop it */
+              return -1;
             }
 
-            /* update ip_src to eth2 interface ip */
-            ip_hdr->ip_src = sr_get_interface(sr, "eth2")->ip;
-            ip_hdr->ip_sum = ip_hdr->ip_sum >> 16;
-            ip_hdr->ip_sum = cksum(ip_hdr, 4*(ip_hdr->ip_hl));
+            /* update ip_src to the external address */
+            ip_hdr->ip_sum = cksum_update32(ip_hdr->ip_sum, ip_hdr->ip_src, xlate.ip_ext);
+            ip_hdr->ip_src = xlate.ip_ext;
 
             /* update icmp t8 header */
-            icmp_hrd_t8->port = mapping->aux_ext;
-            icmp_hrd_t8->icmp_sum = icmp_hrd_t8->icmp_sum >> 16;
-            icmp_hrd_t8->icmp_sum = cksum(icmp_hrd_t8, len - sizeof(struct sr_ethernet_hdr) - 
-              sizeof(struct sr_ip_hdr));
-
-            
-            free(mapping);
+            icmp_hrd_t8->icmp_sum = cksum_update16(icmp_hrd_t8->icmp_sum, icmp_hrd_t8->port, xlate.aux_ext);
+            icmp_hrd_t8->port = xlate.aux_ext;
           }
 
           /* dst to me, is a reply */
@@ -602,22 +620,17 @@ int sr_handle_ippacket(struct sr_instance* sr,
             if (strncmp(interface, eth2, 4)==0){
 
               /* check mapping */
-              struct sr_nat_mapping* mapping;
-              mapping = sr_nat_lookup_external(&(sr->nat), icmp_hrd_t8->port, nat_mapping_icmp, 0, 0, 0, 0, 0);
+              struct sr_nat_xlate xlate;
 
-              if (mapping != NULL){
+              if (sr_nat_lookup_external(&(sr->nat), ip_hdr->ip_dst, icmp_hrd_t8->port, nat_mapping_icmp, ip_hdr->ip_src, 0, 0, 0, 0, &xlate)){
 
                 /* Set up IP Header */
-                ip_hdr->ip_dst = mapping->ip_int;
-                ip_hdr->ip_sum = ip_hdr->ip_sum >> 16;
-                ip_hdr->ip_sum = cksum(ip_hdr, 4*(ip_hdr->ip_hl));
+                ip_hdr->ip_sum = cksum_update32(ip_hdr->ip_sum, ip_hdr->ip_dst, xlate.ip_int);
+                ip_hdr->ip_dst = xlate.ip_int;
 
                 /* Set up ICMP Header */
-                icmp_hrd_t8->port = mapping->aux_int;
-                icmp_hrd_t8->icmp_sum = icmp_hrd_t8->icmp_sum >> 16;
-                icmp_hrd_t8->icmp_sum = cksum(icmp_hrd_t8, len - sizeof(struct sr_ethernet_hdr) - 
-                  sizeof(struct sr_ip_hdr));
-                free(mapping);
+                icmp_hrd_t8->icmp_sum = cksum_update16(icmp_hrd_t8->icmp_sum, icmp_hrd_t8->port, xlate.aux_int);
+                icmp_hrd_t8->port = xlate.aux_int;
               }
 
               /* case not Mapping is fit, send unreachable? */
@@ -641,165 +654,486 @@ int sr_handle_ippacket(struct sr_instance* sr,
         }
 
         /* if Hit, Send */
-        if ((entry = sr_arpcache_lookup(&(sr->cache), ip_hdr->ip_dst)) != NULL){
+        if (sr_arpcache_get(&(sr->cache), ip_hdr->ip_dst, &entry)){
 
           /* setup Ip Header */
-          ip_hdr->ip_ttl--;
-          ip_hdr->ip_sum = ip_hdr->ip_sum >> 16;
-          ip_hdr->ip_sum = cksum(ip_hdr, 4*(ip_hdr->ip_hl));
+          ip_decrement_ttl(ip_hdr);
 
           /* set up Etherent header */
           memcpy(e_hdr->ether_shost, if_list->addr, ETHER_ADDR_LEN);
-          memcpy(e_hdr->ether_dhost, entry->mac, ETHER_ADDR_LEN);
+          memcpy(e_hdr->ether_dhost, entry.mac, ETHER_ADDR_LEN);
 
           sr_send_packet(sr, packet, len, if_list->name); 
-          free(entry);
 
         }
 
         /*if Miss */
         else{
-          sr_arpcache_queuereq(&(sr->cache), rtable->gw.s_addr, packet, len, rtable->interface);
-        
+          /* ask at once rather than at the next sweep, the queue is bounded */
+          struct sr_arpreq *req = sr_arpcache_queuereq(&(sr->cache), rtable->gw.s_addr, packet, len, rtable->interface);
+          if (req != NULL){
+            sr_handle_arpreq(sr, req);
+          }
         }
       }
 
-      free(rtable);
     }
 
   return 0;
 }
 
-int sr_handle_tcppacket_from_outside(struct sr_instance* sr,
+/* Route an already translated packet out: LPM, then ARP.
+   The caller checks the TTL before translating, so that a time
+   exceeded error still quotes the original header.
+   The caller keeps ownership of packet. */
+int sr_forward_ippacket(struct sr_instance* sr,
         uint8_t * packet/* lent */,
         unsigned int len,
         char* interface/* lent */){
 
-    /* set up header */
-    /*
-    sr_ethernet_hdr_t *e_hdr = (sr_ethernet_hdr_t *)(packet);
-    sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
-    sr_tcp_hdr_t* tcp_hdr = (sr_tcp_hdr_t *)(packet 
-            + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
-    */
-    /* get ack, syn, fin */
-    /*
-    int ack = tcp_hdr->flag & (1 << 4);
-    int syn = tcp_hdr->flag & (1 << 1);
-    int fin = tcp_hdr->flag & 1;
-    */
+  sr_ethernet_hdr_t *e_hdr = (sr_ethernet_hdr_t *)(packet);
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
 
-    /*
-    struct sr_nat_mapping* mapping;
-    mapping = sr_nat_lookup_external(&(sr->nat), tcp_hdr->port_dst, nat_mapping_tcp);
+  /* checking routing table, perform LPM */
+  struct sr_rt* rtable;
+  struct sr_rt rt_entry;
+  rtable = sr_helper_rtable(sr, ip_hdr->ip_dst, &rt_entry);
 
+  /* if not match, provide ICMP net unreachable */
+  if (!rtable->gw.s_addr){
+
+    /* Destination net unreachable (type 3, code 0) */
+    sr_handle_unreachable(sr, packet, interface, 3, 0);
+  }
+
+  /* if match, check ARP cache */
+  else{
+
+    struct sr_arpentry entry;
+    struct sr_if* if_list; 
+    /* get new interface */
+    if_list = sr_get_interface(sr, rtable->interface);
+
+
+    /* if Hit, Send */
+    if (sr_arpcache_get(&(sr->cache), ip_hdr->ip_dst, &entry)){
+
+      /* setup Ip Header */
+      ip_decrement_ttl(ip_hdr);
+
+      /* set up Etherent header */
+      memcpy(e_hdr->ether_shost, if_list->addr, ETHER_ADDR_LEN);
+      memcpy(e_hdr->ether_dhost, entry.mac, ETHER_ADDR_LEN);
+
+      sr_send_packet(sr, packet, len, if_list->name); 
 
-    if (mapping != NULL){
-      free(mapping);      
     }
-    */
+
+    /*if Miss */
+    else{
+      /* ask at once rather than at the next sweep, the queue is bounded */
+      struct sr_arpreq *req = sr_arpcache_queuereq(&(sr->cache), rtable->gw.s_addr, packet, len, rtable->interface);
+      if (req != NULL){
+        sr_handle_arpreq(sr, req);
+      }
+    }
+  }
 
 
   return 0;
 }
 
-int sr_handle_tcppacket_from_inside(struct sr_instance* sr,
+/* Find the TCP or UDP header behind the IP header. Returns NULL if the
+   segment is cut short or has run out of TTL (the time exceeded error is
+   sent here, before any translation). */
+static uint8_t* sr_get_l4_hdr(struct sr_instance* sr,
+        uint8_t * packet, unsigned int len, char* interface, unsigned int hdr_len){
+
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+  unsigned int ip_hl = ip_hdr->ip_hl * 4;
+
+  if (ip_hl < sizeof(sr_ip_hdr_t) ||
+      len < sizeof(sr_ethernet_hdr_t) + ip_hl + hdr_len){
+    fprintf(stderr , "** Error: tcp/udp packet is wayy to short \n");
+    return NULL;
+  }
+
+  /* Time exceeded (type 11, code 0) */
+  if (ip_hdr->ip_ttl <= 1){
+    fprintf(stderr , "** Error: ippacket time out\n");
+    sr_handle_unreachable(sr, packet, interface, 11, 0);
+    return NULL;
+  }
+
+  return packet + sizeof(sr_ethernet_hdr_t) + ip_hl;
+}
+
+int sr_handle_tcppacket_from_outside(struct sr_instance* sr,
         uint8_t * packet/* lent */,
         unsigned int len,
         char* interface/* lent */){
 
   /* set up header */
-
-  sr_ethernet_hdr_t *e_hdr = (sr_ethernet_hdr_t *)(packet);
   sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
-  sr_tcp_hdr_t* tcp_hdr = (sr_tcp_hdr_t *)(packet 
-          + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+  sr_tcp_hdr_t* tcp_hdr = (sr_tcp_hdr_t *)sr_get_l4_hdr(sr, packet, len, interface, sizeof(sr_tcp_hdr_t));
+
+  if (tcp_hdr == NULL){
+    return -1;
+  }
 
   /* get ack, syn, fin */
   int ack = tcp_hdr->flag & (1 << 4);
   int syn = tcp_hdr->flag & (1 << 1);
   int fin = tcp_hdr->flag & 1;
 
-  struct sr_nat_mapping* mapping;
-  mapping = sr_nat_lookup_internal(&(sr->nat), ip_hdr->ip_src, tcp_hdr->port_src, nat_mapping_tcp,
-   ip_hdr->ip_dst, tcp_hdr->port_dst, ack, syn, fin);
+  /* nothing is mapped on this port, nobody listens on the NAT itself */
+  struct sr_nat_xlate xlate;
+  if (!sr_nat_lookup_external(&(sr->nat), ip_hdr->ip_dst, tcp_hdr->port_dst, nat_mapping_tcp,
+        ip_hdr->ip_src, tcp_hdr->port_src, ack, syn, fin, &xlate)){
+
+    /* Port unreachable (type 3, code 3) */
+    sr_handle_unreachable(sr, packet, interface, 3, 3);
+    return -1;
+  }
+
+  /* set up ip_hdr */
+  /* update ip_dst to the internal host, the TCP checksum covers it
+     through the pseudo-header */
+  ip_hdr->ip_sum = cksum_update32(ip_hdr->ip_sum, ip_hdr->ip_dst, xlate.ip_int);
+  tcp_hdr->tcp_sum = cksum_update32(tcp_hdr->tcp_sum, ip_hdr->ip_dst, xlate.ip_int);
+  ip_hdr->ip_dst = xlate.ip_int;
+
+  /* update tcp header */
+  tcp_hdr->tcp_sum = cksum_update16(tcp_hdr->tcp_sum, tcp_hdr->port_dst, xlate.aux_int);
+  tcp_hdr->port_dst = xlate.aux_int;
+
+  return sr_forward_ippacket(sr, packet, len, interface);
+}
+
+int sr_handle_tcppacket_from_inside(struct sr_instance* sr,
+        uint8_t * packet/* lent */,
+        unsigned int len,
+        char* interface/* lent */){
+
+  /* set up header */
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+  sr_tcp_hdr_t* tcp_hdr = (sr_tcp_hdr_t *)sr_get_l4_hdr(sr, packet, len, interface, sizeof(sr_tcp_hdr_t));
+
+  if (tcp_hdr == NULL){
+    return -1;
+  }
+
+  /* get ack, syn, fin */
+  int ack = tcp_hdr->flag & (1 << 4);
+  int syn = tcp_hdr->flag & (1 << 1);
+  int fin = tcp_hdr->flag & 1;
 
   /* Not found, create a new mapping for this tcp connection */
-  if (mapping == NULL){
-    mapping = sr_nat_insert_mapping(sr, &(sr->nat), ip_hdr->ip_src, tcp_hdr->port_src, nat_mapping_tcp,
-      ip_hdr->ip_dst, tcp_hdr->port_dst, ack, syn, fin);
+  struct sr_nat_xlate xlate;
+  if (!sr_nat_lookup_internal(&(sr->nat), ip_hdr->ip_src, tcp_hdr->port_src, nat_mapping_tcp,
+        ip_hdr->ip_dst, tcp_hdr->port_dst, ack, syn, fin, &xlate) &&
+      !sr_nat_insert_mapping(sr, &(sr->nat), ip_hdr->ip_src, tcp_hdr->port_src, nat_mapping_tcp,
+        ip_hdr->ip_dst, tcp_hdr->port_dst, ack, syn, fin, &xlate)){
+
+    /* no external port left, drop it */
+    return -1;
+  }
+
+  /* hairpin: the destination is another mapping of ours, send it straight
+     back in as if it had come from outside */
+  if (sr_nat_is_external(&(sr->nat), ip_hdr->ip_dst)){
+    struct sr_nat_xlate peer;
+    if (!sr_nat_lookup_external(&(sr->nat), ip_hdr->ip_dst, tcp_hdr->port_dst, nat_mapping_tcp,
+          xlate.ip_ext, xlate.aux_ext, ack, syn, fin, &peer)){
+
+      /* Port unreachable (type 3, code 3) */
+      sr_handle_unreachable(sr, packet, interface, 3, 3);
+      return -1;
+    }
+
+    ip_hdr->ip_sum = cksum_update32(ip_hdr->ip_sum, ip_hdr->ip_dst, peer.ip_int);
+    tcp_hdr->tcp_sum = cksum_update32(tcp_hdr->tcp_sum, ip_hdr->ip_dst, peer.ip_int);
+    ip_hdr->ip_dst = peer.ip_int;
+    tcp_hdr->tcp_sum = cksum_update16(tcp_hdr->tcp_sum, tcp_hdr->port_dst, peer.aux_int);
+    tcp_hdr->port_dst = peer.aux_int;
   }
 
   /* set up ip_hdr */
-  /* update ip_src to eth2 interface ip */
-  ip_hdr->ip_src = sr_get_interface(sr, "eth2")->ip;
-  ip_hdr->ip_sum = ip_hdr->ip_sum >> 16;
-  ip_hdr->ip_sum = cksum(ip_hdr, 4*(ip_hdr->ip_hl));
+  /* update ip_src to the external address, the TCP checksum covers it
+     through the pseudo-header */
+  ip_hdr->ip_sum = cksum_update32(ip_hdr->ip_sum, ip_hdr->ip_src, xlate.ip_ext);
+  tcp_hdr->tcp_sum = cksum_update32(tcp_hdr->tcp_sum, ip_hdr->ip_src, xlate.ip_ext);
+  ip_hdr->ip_src = xlate.ip_ext;
 
   /* update tcp header */
-  tcp_hdr->port_src = mapping->aux_ext;
-  tcp_hdr->tcp_sum = tcp_hdr->tcp_sum >> 16;
-  tcp_hdr->tcp_sum = cksum(tcp_hdr, len - sizeof(struct sr_ethernet_hdr) - 
-    sizeof(struct sr_ip_hdr));
+  tcp_hdr->tcp_sum = cksum_update16(tcp_hdr->tcp_sum, tcp_hdr->port_src, xlate.aux_ext);
+  tcp_hdr->port_src = xlate.aux_ext;
 
-  free(mapping);
+  return sr_forward_ippacket(sr, packet, len, interface);
+}
 
-  /* ---------------- similar function as forward ------------------ */
 
-  /* checking routing table, perform LPM */
-  struct sr_rt* rtable;
-  rtable = sr_helper_rtable(sr, ip_hdr->ip_dst);
+int sr_handle_udppacket_from_outside(struct sr_instance* sr,
+        uint8_t * packet/* lent */,
+        unsigned int len,
+        char* interface/* lent */){
 
-  /* if not match, provide ICMP net unreachable */
-  if (!rtable->gw.s_addr){
+  /* set up header */
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+  sr_udp_hdr_t* udp_hdr = (sr_udp_hdr_t *)sr_get_l4_hdr(sr, packet, len, interface, sizeof(sr_udp_hdr_t));
 
-    /* Destination net unreachable (type 3, code 0) */
-    sr_handle_unreachable(sr, packet, interface, 3, 0);
+  if (udp_hdr == NULL){
+    return -1;
   }
 
-  /* if match, check ARP cache */
-  else{
+  /* nothing is mapped on this port */
+  struct sr_nat_xlate xlate;
+  if (!sr_nat_lookup_external(&(sr->nat), ip_hdr->ip_dst, udp_hdr->port_dst, nat_mapping_udp,
+        ip_hdr->ip_src, udp_hdr->port_src, 0, 0, 0, &xlate)){
 
-    struct sr_arpentry* entry;
-    struct sr_if* if_list; 
-    /* get new interface */
-    if_list = sr_get_interface(sr, rtable->interface);
+    /* Port unreachable (type 3, code 3) */
+    sr_handle_unreachable(sr, packet, interface, 3, 3);
+    return -1;
+  }
 
+  /* set up ip_dst and port_dst to the internal host */
+  udp_set_dst(ip_hdr, udp_hdr, xlate.ip_int, xlate.aux_int);
 
-    /* if Hit, Send */
-    if ((entry = sr_arpcache_lookup(&(sr->cache), ip_hdr->ip_dst)) != NULL){
+  return sr_forward_ippacket(sr, packet, len, interface);
+}
 
-      /* setup Ip Header */
-      ip_hdr->ip_ttl--;
-      ip_hdr->ip_sum = ip_hdr->ip_sum >> 16;
-      ip_hdr->ip_sum = cksum(ip_hdr, 4*(ip_hdr->ip_hl));
+int sr_handle_udppacket_from_inside(struct sr_instance* sr,
+        uint8_t * packet/* lent */,
+        unsigned int len,
+        char* interface/* lent */){
 
-      /* set up Etherent header */
-      memcpy(e_hdr->ether_shost, if_list->addr, ETHER_ADDR_LEN);
-      memcpy(e_hdr->ether_dhost, entry->mac, ETHER_ADDR_LEN);
+  /* set up header */
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+  sr_udp_hdr_t* udp_hdr = (sr_udp_hdr_t *)sr_get_l4_hdr(sr, packet, len, interface, sizeof(sr_udp_hdr_t));
 
-      sr_send_packet(sr, packet, len, if_list->name); 
-      free(entry);
+  if (udp_hdr == NULL){
+    return -1;
+  }
 
-    }
+  /* Not found, create a new mapping for this flow */
+  struct sr_nat_xlate xlate;
+  if (!sr_nat_lookup_internal(&(sr->nat), ip_hdr->ip_src, udp_hdr->port_src, nat_mapping_udp,
+        ip_hdr->ip_dst, udp_hdr->port_dst, 0, 0, 0, &xlate) &&
+      !sr_nat_insert_mapping(sr, &(sr->nat), ip_hdr->ip_src, udp_hdr->port_src, nat_mapping_udp,
+        ip_hdr->ip_dst, udp_hdr->port_dst, 0, 0, 0, &xlate)){
 
-    /*if Miss */
-    else{
-      sr_arpcache_queuereq(&(sr->cache), rtable->gw.s_addr, packet, len, rtable->interface);
-    
+    /* no external port left, drop it */
+    return -1;
+  }
+
+  /* hairpin: the destination is another mapping of ours, send it straight
+     back in as if it had come from outside */
+  if (sr_nat_is_external(&(sr->nat), ip_hdr->ip_dst)){
+    struct sr_nat_xlate peer;
+    if (!sr_nat_lookup_external(&(sr->nat), ip_hdr->ip_dst, udp_hdr->port_dst, nat_mapping_udp,
+          xlate.ip_ext, xlate.aux_ext, 0, 0, 0, &peer)){
+
+      /* Port unreachable (type 3, code 3) */
+      sr_handle_unreachable(sr, packet, interface, 3, 3);
+      return -1;
     }
+    udp_set_dst(ip_hdr, udp_hdr, peer.ip_int, peer.aux_int);
+  }
+
+  /* set up ip_src and port_src to the external side */
+  udp_set_src(ip_hdr, udp_hdr, xlate.ip_ext, xlate.aux_ext);
+
+  return sr_forward_ippacket(sr, packet, len, interface);
+}
+
+
+/* Find the packet quoted in an ICMP error, and the start of its transport
+   header with *l4_len bytes of it present (at least 8). Returns NULL if
+   the quote is cut short. */
+static sr_ip_hdr_t* sr_get_quoted_hdr(uint8_t * packet, unsigned int len,
+        uint8_t ** l4, unsigned int * l4_len){
+
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+  unsigned int off = sizeof(sr_ethernet_hdr_t) + ip_hdr->ip_hl * 4 + 8;
+  sr_ip_hdr_t *inner;
+
+  if (ip_hdr->ip_hl * 4 < sizeof(sr_ip_hdr_t) || len < off + sizeof(sr_ip_hdr_t)){
+    return NULL;
+  }
+  inner = (sr_ip_hdr_t *)(packet + off);
+  off += inner->ip_hl * 4;
+  if (inner->ip_hl * 4 < sizeof(sr_ip_hdr_t) || len < off + 8){
+    return NULL;
   }
 
-  free(rtable);
+  *l4 = packet + off;
+  *l4_len = len - off;
+  return inner;
+}
+
+/* Where the translated fields of a quoted transport header sit: the port
+   (echo id for ICMP) on one side and the checksum, as offsets into the
+   quote (-1 for a checksum that is missing or unused), plus the port on the
+   other side as a lookup key. Returns -1 for anything the NAT does not
+   translate. */
+static int sr_quoted_fields(sr_ip_hdr_t *inner, uint8_t *l4, unsigned int l4_len, int src,
+        sr_nat_mapping_type *type, int *port_off, uint16_t *peer_port, int *sum_off){
+
+  uint16_t sum;
+
+  switch (inner->ip_p){
+    case ip_protocol_tcp:
+      *type = nat_mapping_tcp;
+      *sum_off = l4_len >= 18 ? 16 : -1;
+      break;
+
+    case ip_protocol_udp:
+      *type = nat_mapping_udp;
+      memcpy(&sum, l4 + 6, 2);
+      *sum_off = sum ? 6 : -1;
+      break;
+
+    case ip_protocol_icmp:
+      /* only echoes have an id to translate */
+      if (l4[0] != 8 && l4[0] != 0){
+        return -1;
+      }
+      *type = nat_mapping_icmp;
+      *port_off = 4;
+      *peer_port = 0;
+      *sum_off = 2;
+      return 0;
 
+    default:
+      return -1;
+  }
+
+  /* TCP and UDP both start with the source and destination ports */
+  *port_off = src ? 0 : 2;
+  memcpy(peer_port, l4 + (src ? 2 : 0), 2);
   return 0;
 }
 
+/* Rewrite one end of the packet quoted in an ICMP error to (ip, port).
+   Every quoted word that changes moves the error's own checksum as well. */
+static void sr_rewrite_quoted(sr_icmp_hdr_t *icmp_hdr, sr_ip_hdr_t *inner, int src,
+        uint8_t *l4, int port_off, int sum_off, uint32_t ip, uint16_t port){
+
+  uint32_t old_ip = src ? inner->ip_src : inner->ip_dst;
+  uint16_t old_port, old_sum, sum;
+
+  memcpy(&old_port, l4 + port_off, 2);
+
+  /* quoted IP header */
+  old_sum = inner->ip_sum;
+  inner->ip_sum = cksum_update32(inner->ip_sum, old_ip, ip);
+  icmp_hdr->icmp_sum = cksum_update16(icmp_hdr->icmp_sum, old_sum, inner->ip_sum);
+
+  /* quoted transport checksum, TCP and UDP cover the address through the
+     pseudo-header */
+  if (sum_off >= 0){
+    memcpy(&old_sum, l4 + sum_off, 2);
+    sum = old_sum;
+    if (inner->ip_p != ip_protocol_icmp){
+      sum = cksum_update32(sum, old_ip, ip);
+    }
+    sum = cksum_update16(sum, old_port, port);
+    if (inner->ip_p == ip_protocol_udp && sum == 0){
+      sum = 0xffff;
+    }
+    memcpy(l4 + sum_off, &sum, 2);
+    icmp_hdr->icmp_sum = cksum_update16(icmp_hdr->icmp_sum, old_sum, sum);
+  }
+
+  /* the address and port themselves */
+  icmp_hdr->icmp_sum = cksum_update32(icmp_hdr->icmp_sum, old_ip, ip);
+  icmp_hdr->icmp_sum = cksum_update16(icmp_hdr->icmp_sum, old_port, port);
+  if (src){
+    inner->ip_src = ip;
+  }
+  else {
+    inner->ip_dst = ip;
+  }
+  memcpy(l4 + port_off, &port, 2);
+}
+
+/* An ICMP error from outside about a packet we sent out: the quote has our
+   external address as its source. Hand it to the internal host. */
+int sr_handle_icmperror_from_outside(struct sr_instance* sr,
+        uint8_t * packet/* lent */,
+        unsigned int len,
+        char* interface/* lent */){
+
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+  sr_icmp_hdr_t *icmp_hdr = (sr_icmp_hdr_t *)((uint8_t *)ip_hdr + ip_hdr->ip_hl * 4);
+  sr_nat_mapping_type type;
+  struct sr_nat_xlate xlate;
+  int port_off, sum_off;
+  uint16_t port, peer_port;
+  unsigned int l4_len;
+  uint8_t *l4;
+
+  sr_ip_hdr_t *inner = sr_get_quoted_hdr(packet, len, &l4, &l4_len);
+  if (inner == NULL || sr_quoted_fields(inner, l4, l4_len, 1, &type, &port_off, &peer_port, &sum_off) < 0){
+    return -1;
+  }
+  memcpy(&port, l4 + port_off, 2);
+
+  /* not about any of our mappings, or would expire on the way: no error
+     is sent about an error */
+  if (!sr_nat_peek_external(&(sr->nat), inner->ip_src, port, type, &xlate) ||
+      ip_hdr->ip_ttl <= 1){
+    return -1;
+  }
+
+  ip_hdr->ip_sum = cksum_update32(ip_hdr->ip_sum, ip_hdr->ip_dst, xlate.ip_int);
+  ip_hdr->ip_dst = xlate.ip_int;
+  sr_rewrite_quoted(icmp_hdr, inner, 1, l4, port_off, sum_off, xlate.ip_int, xlate.aux_int);
+
+  return sr_forward_ippacket(sr, packet, len, interface);
+}
+
+/* An ICMP error from an internal host about a packet that came in through
+   the NAT: the quote has the internal host as its destination. Send it out
+   from the external side of the mapping. */
+int sr_handle_icmperror_from_inside(struct sr_instance* sr,
+        uint8_t * packet/* lent */,
+        unsigned int len,
+        char* interface/* lent */){
+
+  sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+  sr_icmp_hdr_t *icmp_hdr = (sr_icmp_hdr_t *)((uint8_t *)ip_hdr + ip_hdr->ip_hl * 4);
+  sr_nat_mapping_type type;
+  struct sr_nat_xlate xlate;
+  int port_off, sum_off;
+  uint16_t port, peer_port;
+  unsigned int l4_len;
+  uint8_t *l4;
+
+  sr_ip_hdr_t *inner = sr_get_quoted_hdr(packet, len, &l4, &l4_len);
+  if (inner == NULL || sr_quoted_fields(inner, l4, l4_len, 0, &type, &port_off, &peer_port, &sum_off) < 0){
+    return -1;
+  }
+  memcpy(&port, l4 + port_off, 2);
+
+  if (!sr_nat_peek_internal(&(sr->nat), inner->ip_dst, port, type, inner->ip_src, peer_port, &xlate) ||
+      ip_hdr->ip_ttl <= 1){
+    return -1;
+  }
+
+  ip_hdr->ip_sum = cksum_update32(ip_hdr->ip_sum, ip_hdr->ip_src, xlate.ip_ext);
+  ip_hdr->ip_src = xlate.ip_ext;
+  sr_rewrite_quoted(icmp_hdr, inner, 0, l4, port_off, sum_off, xlate.ip_ext, xlate.aux_ext);
+
+  return sr_forward_ippacket(sr, packet, len, interface);
+}
+
 
-/* create an new packet using incoming packet */
+/* create an new packet using incoming packet, in a pool buffer the caller
+   gives back with sr_buf_free */
 uint8_t* sr_copy_packet(uint8_t* packet, unsigned int len){
 
-  uint8_t * new_packet = (uint8_t *)malloc(len);
+  uint8_t * new_packet = (uint8_t *)sr_buf_alloc(len);
   memcpy(new_packet, packet, len);
 
   return new_packet;
@@ -815,8 +1149,8 @@ void sr_handle_unreachable(struct sr_instance* sr,
   unsigned int total_len = sizeof(sr_ethernet_hdr_t)
    + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t);
 
-  /* malloc new space for the new packet and copy the information from an IP to it */
-  uint8_t * new_packet = (uint8_t *)malloc(total_len);
+  /* take a buffer for the new packet and copy the information from an IP to it */
+  uint8_t * new_packet = (uint8_t *)sr_buf_alloc(total_len);
   memcpy(new_packet, packet, sizeof(sr_ethernet_hdr_t)
    + sizeof(sr_ip_hdr_t));
 
@@ -833,6 +1167,7 @@ void sr_handle_unreachable(struct sr_instance* sr,
   struct sr_if* iface;
   for (iface = sr->if_list; iface != NULL; iface = iface->next){
     if(iface->ip == new_ip_hdr->ip_src){
+      sr_buf_free(new_packet);
       return;
     }
   }
@@ -874,15 +1209,16 @@ void sr_handle_unreachable(struct sr_instance* sr,
 
   /* send ICMP out */
   sr_send_packet(sr, new_packet, total_len, interface);
-  free(new_packet);
+  sr_buf_free(new_packet);
   
 }
 
-/* routing table helper, to get the mask number in order to provide LPM */
-struct sr_rt *sr_helper_rtable(struct sr_instance* sr, uint32_t ip)
+/* routing table helper, to get the mask number in order to provide LPM.
+   The best match is copied into *rtable, which is returned; gw stays 0 if
+   nothing matches */
+struct sr_rt *sr_helper_rtable(struct sr_instance* sr, uint32_t ip, struct sr_rt *rtable)
 {
 
-  struct sr_rt *rtable = (struct sr_rt *)malloc(sizeof(struct sr_rt));
   rtable->gw.s_addr = 0;
   rtable->mask.s_addr = 0;
 
@@ -31,9 +31,17 @@
 #define INIT_TTL 255
 #define PACKET_DUMP_SIZE 1024
 
+/* receive buffer, room for many commands of at most 10000 bytes each */
+#define SR_RX_BUF_SZ (256 * 1024)
+
+/* output queue, frames are written out in one go when it fills */
+#define SR_TX_BUF_SZ (256 * 1024)
+
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_uring;
+struct sr_io;
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -53,9 +61,41 @@ struct sr_instance
     struct sr_if* if_list; /* list of interfaces */
     struct sr_rt* routing_table; /* routing table */
     struct sr_arpcache cache;   /* ARP cache */
-    pthread_attr_t attr;
     FILE* logfile;
 
+    /* bytes read from the server, commands are parsed from rx_head on */
+    uint8_t* rx_buf;
+    unsigned int rx_head;
+    unsigned int rx_tail;
+
+    /* framed packets waiting to go to the server, written once the event
+       loop has nothing more to read, when the queue fills, or when
+       tx_timerfd goes off tx_delay_us after the first of them was queued.
+       What the socket has no room for stays queued, tx_blocked set, until
+       the loop sees it writable. Without tx_buf every packet is written at
+       once. */
+    uint8_t* tx_buf;
+    unsigned int tx_len;
+    unsigned int tx_delay_us;
+    int tx_timerfd;
+    int tx_blocked;
+    unsigned long tx_dropped; /* packets with no room to queue or write */
+
+    /* event loop: epoll set, one second tick timer, and the eventfd that
+       wakes it for the control commands posted in ctl_pending */
+    int ev_fd;
+    int tick_fd;
+    int ctl_fd;
+    volatile unsigned int ctl_pending;
+
+    /* io_uring carrying the server connection in place of recv and
+       writev, when asked for and the kernel has it */
+    struct sr_uring* uring;
+
+    /* backend moving frames on local interfaces, in place of the server */
+    const struct sr_io* io;
+    void* io_state;
+
     int enable_nat;
     struct sr_nat nat; /* Network Address Translator */
 };
@@ -65,8 +105,14 @@ int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
+void sr_receive_packet(struct sr_instance* , uint8_t* , unsigned int , char* );
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
+int sr_read_from_server_ready(struct sr_instance* );
+int sr_read_from_server_buffered(struct sr_instance* );
+uint8_t* sr_rx_reserve(struct sr_instance* );
+int sr_init_output(struct sr_instance* , unsigned int );
+int sr_flush_output(struct sr_instance* );
 
 /* -- sr_router.c -- */
 
@@ -76,9 +122,14 @@ int sr_handle_arppacket(struct sr_instance* ,uint8_t *, unsigned int , char* );
 int sr_handle_ippacket(struct sr_instance* ,uint8_t *, unsigned int , char* );
 void sr_handle_unreachable(struct sr_instance*, uint8_t *, char*, uint8_t, uint8_t);
 uint8_t* sr_copy_packet(uint8_t* , unsigned int);
-struct sr_rt* sr_helper_rtable(struct sr_instance* , uint32_t);
+struct sr_rt* sr_helper_rtable(struct sr_instance* , uint32_t, struct sr_rt* );
 int sr_handle_tcppacket_from_inside(struct sr_instance* , uint8_t * ,unsigned int , char* );
 int sr_handle_tcppacket_from_outside(struct sr_instance* , uint8_t * ,unsigned int , char* );
+int sr_handle_udppacket_from_inside(struct sr_instance* , uint8_t * ,unsigned int , char* );
+int sr_handle_udppacket_from_outside(struct sr_instance* , uint8_t * ,unsigned int , char* );
+int sr_handle_icmperror_from_inside(struct sr_instance* , uint8_t * ,unsigned int , char* );
+int sr_handle_icmperror_from_outside(struct sr_instance* , uint8_t * ,unsigned int , char* );
+int sr_forward_ippacket(struct sr_instance* , uint8_t * ,unsigned int , char* );
 
 
 /* -- sr_if.c -- */
@@ -0,0 +1,436 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_tap.c
+ *
+ * Description:
+ *
+ * TAP backend (-i tap:config) running the router on Linux TAP devices, for
+ * testing and benchmarking on one machine. The kernel side of each device
+ * stands for whatever is on the other end of the router's wire, so it can
+ * be moved into a network namespace and given an address there, and ping
+ * or iperf run across the router.
+ *
+ * The router's own addresses do not come from the devices but from the
+ * config file, one interface per line,
+ *
+ *     eth1 10.0.1.1 02:00:00:00:01:01 tap0
+ *
+ * naming the router interface, its IPv4 and MAC address, and the TAP
+ * device under it, created if it does not exist already. Without a device
+ * the interface name is used. Blank lines and lines starting with # are
+ * skipped.
+ *
+ * Frames and bytes each way are counted per interface and reported, with
+ * the rate since the previous report, on SIGUSR1 and at exit.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#include "sr_io.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_protocol.h"
+
+/* interfaces one router can have here */
+#define SR_TAP_MAX_IFS 16
+
+/* frames read per interface per wakeup, so one cannot starve the others */
+#define SR_TAP_RX_BATCH 64
+
+/* big enough for any frame a TAP device hands over */
+#define SR_TAP_FRAME 65536
+
+struct sr_tap_count
+{
+    unsigned long rx_frames;
+    unsigned long rx_bytes;
+    unsigned long tx_frames;
+    unsigned long tx_bytes;
+};
+
+struct sr_tap_if
+{
+    char name[sr_IFACE_NAMELEN];
+    char dev[IFNAMSIZ];
+    int fd;
+
+    struct sr_tap_count count;
+    struct sr_tap_count last; /* as of the previous report */
+    unsigned long tx_drops;
+};
+
+struct sr_tap
+{
+    int nifs;
+    struct sr_tap_if ifs[SR_TAP_MAX_IFS];
+    struct timespec start;
+    struct timespec last; /* time of the previous report */
+    uint8_t frame[SR_TAP_FRAME];
+};
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tap_open_dev(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_tap_open_dev(const char* dev)
+{
+    struct ifreq ifr;
+    int fd;
+
+    if ((fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0)
+    {
+        perror("open(/dev/net/tun):sr_tap_open_dev");
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0)
+    {
+        perror("ioctl(TUNSETIFF):sr_tap_open_dev");
+        close(fd);
+        return -1;
+    }
+    return fd;
+} /* -- sr_tap_open_dev -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tap_parse_mac(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_tap_parse_mac(const char* str, unsigned char* mac)
+{
+    unsigned int b[ETHER_ADDR_LEN];
+    char end;
+    int i;
+
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x%c",
+               &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end) != ETHER_ADDR_LEN)
+    { return -1; }
+    for (i = 0; i < ETHER_ADDR_LEN; i++)
+    {
+        if (b[i] > 0xff)
+        { return -1; }
+        mac[i] = (unsigned char)b[i];
+    }
+    return 0;
+} /* -- sr_tap_parse_mac -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tap_open(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void sr_tap_close(struct sr_instance* sr);
+
+static int sr_tap_open(struct sr_instance* sr, char* spec)
+{
+    struct sr_tap* st;
+    struct sr_tap_if* tif;
+    struct in_addr ip;
+    unsigned char mac[ETHER_ADDR_LEN];
+    char line[BUFSIZ];
+    char name[32], ipstr[32], macstr[32], dev[32];
+    int n, lineno = 0;
+    FILE* fp;
+
+    if ((fp = fopen(spec, "r")) == NULL)
+    {
+        fprintf(stderr, "Unable to read %s, expected tap:config\n", spec);
+        return -1;
+    }
+    if ((st = (struct sr_tap *)calloc(1, sizeof(struct sr_tap))) == NULL)
+    {
+        fclose(fp);
+        return -1;
+    }
+    sr->io_state = st;
+
+    while (fgets(line, BUFSIZ, fp) != 0)
+    {
+        lineno++;
+        n = sscanf(line, "%31s %31s %31s %31s", name, ipstr, macstr, dev);
+        if (n <= 0 || name[0] == '#')
+        { continue; }
+        if (n < 3 || inet_aton(ipstr, &ip) == 0 || sr_tap_parse_mac(macstr, mac) != 0)
+        {
+            fprintf(stderr, "%s:%d: expected interface, IP, MAC and device\n",
+                    spec, lineno);
+            goto fail;
+        }
+        if (n == 3)
+        { strcpy(dev, name); }
+        if (strlen(dev) >= IFNAMSIZ)
+        {
+            fprintf(stderr, "%s:%d: device name %s too long\n", spec, lineno, dev);
+            goto fail;
+        }
+        if (st->nifs == SR_TAP_MAX_IFS)
+        {
+            fprintf(stderr, "More than %d interfaces\n", SR_TAP_MAX_IFS);
+            goto fail;
+        }
+
+        tif = &st->ifs[st->nifs];
+        strncpy(tif->name, name, sr_IFACE_NAMELEN - 1);
+        strncpy(tif->dev, dev, IFNAMSIZ - 1);
+        if ((tif->fd = sr_tap_open_dev(dev)) < 0)
+        {
+            fprintf(stderr, "Unable to open %s on %s\n", name, dev);
+            goto fail;
+        }
+        st->nifs++;
+
+        sr_add_interface(sr, name);
+        sr_set_ether_addr(sr, mac);
+        sr_set_ether_ip(sr, ip.s_addr);
+    }
+    fclose(fp);
+
+    if (st->nifs == 0)
+    {
+        fprintf(stderr, "No interfaces in %s\n", spec);
+        sr_tap_close(sr);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &st->start);
+    st->last = st->start;
+    return 0;
+
+fail:
+    fclose(fp);
+    sr_tap_close(sr);
+    return -1;
+} /* -- sr_tap_open -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tap_send(..)
+ * Scope: Local
+ *
+ * A TAP device takes one frame per write, so there is nothing to queue.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_tap_send(struct sr_instance* sr, uint8_t* buf, unsigned int len,
+                       const char* iface)
+{
+    struct sr_tap* st = (struct sr_tap *)sr->io_state;
+    struct sr_tap_if* tif = NULL;
+    int i;
+
+    for (i = 0; i < st->nifs; i++)
+    {
+        if (strncmp(st->ifs[i].name, iface, sr_IFACE_NAMELEN) == 0)
+        {
+            tif = &st->ifs[i];
+            break;
+        }
+    }
+    if (tif == NULL)
+    {
+        fprintf(stderr, "** Error: no interface %s\n", iface);
+        return -1;
+    }
+
+    if (write(tif->fd, buf, len) != (ssize_t)len)
+    {
+        /* EIO until the kernel side is up, as a cable that is not plugged in */
+        if (errno != EAGAIN && errno != EIO)
+        { perror("write(..):sr_tap_send"); }
+        tif->tx_drops++;
+        return -1;
+    }
+    tif->count.tx_frames++;
+    tif->count.tx_bytes += len;
+    return 0;
+} /* -- sr_tap_send -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tap_flush(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_tap_flush(struct sr_instance* sr)
+{
+    sr->tx_len = 0;
+    return 0;
+} /* -- sr_tap_flush -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tap_fds(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_tap_fds(struct sr_instance* sr, int* fds, int max)
+{
+    struct sr_tap* st = (struct sr_tap *)sr->io_state;
+    int i;
+
+    for (i = 0; i < st->nifs && i < max; i++)
+    { fds[i] = st->ifs[i].fd; }
+    return i;
+} /* -- sr_tap_fds -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tap_ready(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_tap_ready(struct sr_instance* sr, int fd)
+{
+    struct sr_tap* st = (struct sr_tap *)sr->io_state;
+    struct sr_tap_if* tif = NULL;
+    ssize_t len;
+    int i;
+
+    for (i = 0; i < st->nifs; i++)
+    {
+        if (st->ifs[i].fd == fd)
+        {
+            tif = &st->ifs[i];
+            break;
+        }
+    }
+    if (tif == NULL)
+    { return 1; }
+
+    /* level triggered, whatever is left over wakes the loop again */
+    for (i = 0; i < SR_TAP_RX_BATCH; i++)
+    {
+        if ((len = read(fd, st->frame, SR_TAP_FRAME)) < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+            { break; }
+            perror("read(..):sr_tap_ready");
+            return -1;
+        }
+        tif->count.rx_frames++;
+        tif->count.rx_bytes += len;
+        if (len >= (ssize_t)sizeof(sr_ethernet_hdr_t))
+        {
+            sr_receive_packet(sr, st->frame, (unsigned int)len, tif->name);
+        }
+    }
+    return 1;
+} /* -- sr_tap_ready -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tap_report_count(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void sr_tap_report_count(const char* what, const struct sr_tap_count* now,
+                                const struct sr_tap_count* before, double secs)
+{
+    unsigned long rx_frames = now->rx_frames - before->rx_frames;
+    unsigned long rx_bytes = now->rx_bytes - before->rx_bytes;
+    unsigned long tx_frames = now->tx_frames - before->tx_frames;
+    unsigned long tx_bytes = now->tx_bytes - before->tx_bytes;
+
+    if (secs <= 0)
+    { secs = 1e-9; }
+    fprintf(stderr, "  %-8s rx %lu frames %lu bytes (%.0f pps %.2f Mbit/s)"
+            " tx %lu frames %lu bytes (%.0f pps %.2f Mbit/s)\n",
+            what, rx_frames, rx_bytes, rx_frames / secs, rx_bytes * 8 / secs / 1e6,
+            tx_frames, tx_bytes, tx_frames / secs, tx_bytes * 8 / secs / 1e6);
+} /* -- sr_tap_report_count -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tap_report_all(..)
+ * Scope: Local
+ *
+ * Print what went through each interface since the previous report, or
+ * since the start when total is set.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_tap_report_all(struct sr_tap* st, int total)
+{
+    struct sr_tap_count zero;
+    struct timespec now;
+    double secs;
+    int i;
+
+    memset(&zero, 0, sizeof(zero));
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (total)
+    {
+        secs = (now.tv_sec - st->start.tv_sec) + (now.tv_nsec - st->start.tv_nsec) / 1e9;
+    }
+    else
+    {
+        secs = (now.tv_sec - st->last.tv_sec) + (now.tv_nsec - st->last.tv_nsec) / 1e9;
+    }
+
+    fprintf(stderr, "TAP throughput over %.3f s%s\n", secs, total ? " in total" : "");
+    for (i = 0; i < st->nifs; i++)
+    {
+        sr_tap_report_count(st->ifs[i].name, &st->ifs[i].count,
+                            total ? &zero : &st->ifs[i].last, secs);
+        if (st->ifs[i].tx_drops > 0)
+        {
+            fprintf(stderr, "  %-8s dropped %lu frames on send\n",
+                    st->ifs[i].name, st->ifs[i].tx_drops);
+        }
+        st->ifs[i].last = st->ifs[i].count;
+    }
+    st->last = now;
+} /* -- sr_tap_report_all -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tap_report(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void sr_tap_report(struct sr_instance* sr)
+{
+    sr_tap_report_all((struct sr_tap *)sr->io_state, 0);
+} /* -- sr_tap_report -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tap_close(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void sr_tap_close(struct sr_instance* sr)
+{
+    struct sr_tap* st = (struct sr_tap *)sr->io_state;
+    int i;
+
+    if (st == NULL)
+    { return; }
+
+    if (st->start.tv_sec != 0)
+    { sr_tap_report_all(st, 1); }
+    for (i = 0; i < st->nifs; i++)
+    { close(st->ifs[i].fd); }
+    free(st);
+    sr->io_state = NULL;
+} /* -- sr_tap_close -- */
+
+const struct sr_io sr_io_tap =
+{
+    "tap",
+    sr_tap_open,
+    sr_tap_send,
+    sr_tap_flush,
+    sr_tap_fds,
+    sr_tap_ready,
+    sr_tap_close,
+    sr_tap_report
+};
@@ -0,0 +1,555 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_uring.c
+ *
+ * Description:
+ *
+ * The rings are driven by hand through the raw syscalls rather than
+ * liburing. Receive completions are copied aside as they are reaped and
+ * handled later from sr_uring_read, because waiting for a send (from a
+ * flush inside the packet path) must reap too and may not re-enter the
+ * router. A provided buffer goes back to the kernel once its bytes have
+ * been copied into the receive buffer.
+ *
+ * A send that comes up short breaks its chain, the linked sends behind it
+ * complete with -ECANCELED, and whatever did not go out is sent again as
+ * a new chain, so the stream never gets out of step.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "sr_router.h"
+#include "sr_uring.h"
+
+#ifdef _URING_
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/* submission queue entries, the send chain of one flush must fit */
+#define SR_URING_ENTRIES 64
+
+/* provided receive buffers, a power of two */
+#define SR_URING_NBUFS 64
+#define SR_URING_BUF_SZ 4096
+#define SR_URING_BGID 0
+
+/* bytes per send of a chain */
+#define SR_URING_TX_CHUNK (64 * 1024)
+
+/* user_data of the two kinds of request */
+#define SR_URING_RX 1
+#define SR_URING_TX 2
+
+/* a receive completion reaped but not handled yet */
+struct sr_uring_rx
+{
+    int32_t res;
+    uint32_t flags;
+};
+
+struct sr_uring
+{
+    int fd;
+
+    /* submission queue */
+    void* sq_ptr;
+    size_t sq_sz;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    size_t sqes_sz;
+
+    /* completion queue */
+    void* cq_ptr;
+    size_t cq_sz;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    /* provided receive buffers */
+    struct io_uring_buf_ring* br;
+    uint8_t* bufs;
+    unsigned short br_tail;
+    int rx_armed;
+
+    /* every buffer in flight has at most one completion here, plus the
+       one ending the multishot receive */
+    struct sr_uring_rx rx[SR_URING_NBUFS + 2];
+    unsigned rx_head;
+    unsigned rx_tail;
+
+    /* the queue buffer being sent, which the router gets back next flush */
+    uint8_t* tx_spare;
+    unsigned int tx_len;
+    unsigned int tx_done;
+    unsigned int tx_due; /* completions still to come */
+    int tx_error;
+};
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_enter(..)
+ * Scope: Local
+ *
+ * Submit everything queued and, with wait, block for one completion.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_uring_enter(struct sr_uring* u, int wait)
+{
+    unsigned int to_submit;
+    int ret;
+
+    do
+    {
+        to_submit = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        ret = syscall(__NR_io_uring_enter, u->fd, to_submit, wait ? 1 : 0,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while ( ret < 0 && errno == EINTR );
+
+    if ( ret < 0 )
+    {
+        perror("io_uring_enter(..):sr_uring_enter");
+        return -1;
+    }
+    return 0;
+} /* -- sr_uring_enter -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_sqe(..)
+ * Scope: Local
+ *
+ * The next free submission entry, cleared. Only the caller's thread writes
+ * the tail, so it is published straight away; the kernel does not look at
+ * it before the next io_uring_enter.
+ *
+ *---------------------------------------------------------------------------*/
+
+static struct io_uring_sqe* sr_uring_sqe(struct sr_uring* u)
+{
+    struct io_uring_sqe* sqe;
+    unsigned tail = *u->sq_tail;
+
+    if ( tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries &&
+         sr_uring_enter(u, 0) != 0 )
+    { return NULL; }
+
+    sqe = &u->sqes[tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+} /* -- sr_uring_sqe -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_give_buf(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void sr_uring_give_buf(struct sr_uring* u, unsigned short bid)
+{
+    struct io_uring_buf* buf = &u->br->bufs[u->br_tail & (SR_URING_NBUFS - 1)];
+
+    buf->addr = (uintptr_t)(u->bufs + (size_t)bid * SR_URING_BUF_SZ);
+    buf->len = SR_URING_BUF_SZ;
+    buf->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+} /* -- sr_uring_give_buf -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_arm_rx(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_uring_arm_rx(struct sr_instance* sr)
+{
+    struct sr_uring* u = sr->uring;
+    struct io_uring_sqe* sqe;
+
+    if ( (sqe = sr_uring_sqe(u)) == NULL )
+    { return -1; }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sr->sockfd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = SR_URING_BGID;
+    sqe->user_data = SR_URING_RX;
+    u->rx_armed = 1;
+    return sr_uring_enter(u, 0);
+} /* -- sr_uring_arm_rx -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_queue_tx(..)
+ * Scope: Local
+ *
+ * Queue what is left of the send in flight as a chain of linked sends.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_uring_queue_tx(struct sr_instance* sr)
+{
+    struct sr_uring* u = sr->uring;
+    struct io_uring_sqe* sqe;
+    unsigned int off, len;
+
+    for ( off = u->tx_done; off < u->tx_len; off += len )
+    {
+        len = u->tx_len - off;
+        if ( len > SR_URING_TX_CHUNK )
+        { len = SR_URING_TX_CHUNK; }
+
+        if ( (sqe = sr_uring_sqe(u)) == NULL )
+        { return -1; }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = sr->sockfd;
+        sqe->addr = (uintptr_t)(u->tx_spare + off);
+        sqe->len = len;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = SR_URING_TX;
+        if ( off + len < u->tx_len )
+        { sqe->flags = IOSQE_IO_LINK; }
+        u->tx_due++;
+    }
+
+    return sr_uring_enter(u, 0);
+} /* -- sr_uring_queue_tx -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_reap(..)
+ * Scope: Local
+ *
+ * Take every completion off the queue, setting receive ones aside and
+ * counting send ones against the send in flight.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_uring_reap(struct sr_uring* u)
+{
+    struct io_uring_cqe* cqe;
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    for ( ; head != tail; head++ )
+    {
+        cqe = &u->cqes[head & *u->cq_mask];
+        if ( cqe->user_data == SR_URING_RX )
+        {
+            u->rx[u->rx_tail % (SR_URING_NBUFS + 2)].res = cqe->res;
+            u->rx[u->rx_tail % (SR_URING_NBUFS + 2)].flags = cqe->flags;
+            u->rx_tail++;
+            if ( !(cqe->flags & IORING_CQE_F_MORE) )
+            { u->rx_armed = 0; }
+        }
+        else if ( cqe->user_data == SR_URING_TX )
+        {
+            u->tx_due--;
+            if ( cqe->res > 0 )
+            { u->tx_done += cqe->res; }
+            else if ( cqe->res == 0 ||
+                      (cqe->res != -ECANCELED && cqe->res != -EINTR &&
+                       cqe->res != -EAGAIN && cqe->res != -ENOBUFS) )
+            { u->tx_error = cqe->res ? -cqe->res : EPIPE; }
+        }
+    }
+
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+} /* -- sr_uring_reap -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_wait_tx(..)
+ * Scope: Local
+ *
+ * Wait until all of the send in flight is out, sending the rest again
+ * after a short send. Returns 0, or -1 if the connection is broken.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_uring_wait_tx(struct sr_instance* sr)
+{
+    struct sr_uring* u = sr->uring;
+
+    while ( u->tx_due > 0 || (u->tx_done < u->tx_len && u->tx_error == 0) )
+    {
+        if ( u->tx_due == 0 )
+        {
+            if ( sr_uring_queue_tx(sr) != 0 )
+            { return -1; }
+            continue;
+        }
+        if ( sr_uring_enter(u, 1) != 0 )
+        { return -1; }
+        sr_uring_reap(u);
+    }
+
+    u->tx_len = u->tx_done = 0;
+    if ( u->tx_error != 0 )
+    {
+        fprintf(stderr, "send(..):sr_uring_wait_tx: %s\n", strerror(u->tx_error));
+        u->tx_error = 0;
+        return -1;
+    }
+    return 0;
+} /* -- sr_uring_wait_tx -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_free(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void sr_uring_free(struct sr_uring* u)
+{
+    if ( u->sqes != NULL && u->sqes != MAP_FAILED )
+    { munmap(u->sqes, u->sqes_sz); }
+    if ( u->cq_ptr != NULL && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr )
+    { munmap(u->cq_ptr, u->cq_sz); }
+    if ( u->sq_ptr != NULL && u->sq_ptr != MAP_FAILED )
+    { munmap(u->sq_ptr, u->sq_sz); }
+    if ( u->fd >= 0 )
+    { close(u->fd); }
+    free(u->br);
+    free(u->bufs);
+    free(u->tx_spare);
+    free(u);
+} /* -- sr_uring_free -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_init(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+int sr_uring_init(struct sr_instance* sr)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct sr_uring* u;
+    void* mem;
+    int i;
+
+    if ( (u = (struct sr_uring *)calloc(1, sizeof(struct sr_uring))) == NULL )
+    { return -1; }
+
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, SR_URING_ENTRIES, &p);
+    if ( u->fd < 0 )
+    {
+        perror("io_uring_setup(..):sr_uring_init");
+        free(u);
+        return -1;
+    }
+
+    /* map the two rings, one mapping for both on kernels that allow it */
+    u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ( p.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        if ( u->cq_sz > u->sq_sz )
+        { u->sq_sz = u->cq_sz; }
+        u->cq_sz = u->sq_sz;
+    }
+    u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    u->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? u->sq_ptr :
+        mmap(NULL, u->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             u->fd, IORING_OFF_CQ_RING);
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if ( u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED || u->sqes == MAP_FAILED )
+    {
+        perror("mmap(..):sr_uring_init");
+        sr_uring_free(u);
+        return -1;
+    }
+
+    u->sq_head = (unsigned *)((uint8_t *)u->sq_ptr + p.sq_off.head);
+    u->sq_tail = (unsigned *)((uint8_t *)u->sq_ptr + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((uint8_t *)u->sq_ptr + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((uint8_t *)u->sq_ptr + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *)((uint8_t *)u->cq_ptr + p.cq_off.head);
+    u->cq_tail = (unsigned *)((uint8_t *)u->cq_ptr + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((uint8_t *)u->cq_ptr + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((uint8_t *)u->cq_ptr + p.cq_off.cqes);
+
+    /* the provided buffer ring, page aligned, and the buffers it hands out */
+    if ( posix_memalign(&mem, getpagesize(), SR_URING_NBUFS * sizeof(struct io_uring_buf)) != 0 )
+    {
+        sr_uring_free(u);
+        return -1;
+    }
+    memset(mem, 0, SR_URING_NBUFS * sizeof(struct io_uring_buf));
+    u->br = (struct io_uring_buf_ring *)mem;
+    if ( posix_memalign(&mem, getpagesize(), SR_URING_NBUFS * SR_URING_BUF_SZ) != 0 )
+    {
+        sr_uring_free(u);
+        return -1;
+    }
+    u->bufs = (uint8_t *)mem;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)u->br;
+    reg.ring_entries = SR_URING_NBUFS;
+    reg.bgid = SR_URING_BGID;
+    if ( syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0 )
+    {
+        perror("io_uring_register(..):sr_uring_init");
+        sr_uring_free(u);
+        return -1;
+    }
+    for ( i = 0; i < SR_URING_NBUFS; i++ )
+    { sr_uring_give_buf(u, i); }
+
+    /* the router fills one queue buffer while the other is being sent */
+    if ( sr->tx_buf != 0 &&
+         (u->tx_spare = (uint8_t *)malloc(SR_TX_BUF_SZ)) == NULL )
+    {
+        sr_uring_free(u);
+        return -1;
+    }
+
+    sr->uring = u;
+    if ( sr_uring_arm_rx(sr) != 0 )
+    {
+        sr->uring = NULL;
+        sr_uring_free(u);
+        return -1;
+    }
+    return 0;
+} /* -- sr_uring_init -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_fd(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+int sr_uring_fd(struct sr_instance* sr)
+{
+    return sr->uring->fd;
+} /* -- sr_uring_fd -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_read(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+int sr_uring_read(struct sr_instance* sr)
+{
+    struct sr_uring* u = sr->uring;
+    struct sr_uring_rx* c;
+    unsigned short bid;
+    uint8_t* dst;
+    int ret;
+
+    sr_uring_reap(u);
+
+    /* a flush while handling these may reap more behind them */
+    while ( u->rx_head != u->rx_tail )
+    {
+        c = &u->rx[u->rx_head++ % (SR_URING_NBUFS + 2)];
+
+        if ( c->res == 0 )
+        {
+            fprintf(stderr,"Error: server closed the connection\n");
+            return -1;
+        }
+        if ( c->res < 0 )
+        {
+            /* out of buffers, posted again below once some are back */
+            if ( c->res == -ENOBUFS )
+            { continue; }
+            fprintf(stderr, "recv(..):sr_uring_read: %s\n", strerror(-c->res));
+            return -1;
+        }
+
+        /* at most one partial command is left over, a buffer always fits */
+        bid = c->flags >> IORING_CQE_BUFFER_SHIFT;
+        if ( (dst = sr_rx_reserve(sr)) == 0 )
+        { return -1; }
+        memcpy(dst, u->bufs + (size_t)bid * SR_URING_BUF_SZ, c->res);
+        sr->rx_tail += c->res;
+        sr_uring_give_buf(u, bid);
+
+        if ( (ret = sr_read_from_server_buffered(sr)) != 1 )
+        { return ret; }
+    }
+
+    if ( !u->rx_armed && sr_uring_arm_rx(sr) != 0 )
+    { return -1; }
+    return 1;
+} /* -- sr_uring_read -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_send(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+int sr_uring_send(struct sr_instance* sr)
+{
+    struct sr_uring* u = sr->uring;
+    uint8_t* buf;
+
+    if ( sr_uring_wait_tx(sr) != 0 )
+    {
+        sr->tx_len = 0;
+        return -1;
+    }
+
+    /* the spare is free again, swap it with the full one */
+    buf = sr->tx_buf;
+    sr->tx_buf = u->tx_spare;
+    u->tx_spare = buf;
+    u->tx_len = sr->tx_len;
+    sr->tx_len = 0;
+
+    return sr_uring_queue_tx(sr);
+} /* -- sr_uring_send -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_uring_destroy(..)
+ * Scope: Global
+ *---------------------------------------------------------------------------*/
+
+void sr_uring_destroy(struct sr_instance* sr)
+{
+    if ( sr->uring == NULL )
+    { return; }
+
+    sr_uring_wait_tx(sr);
+    sr_uring_free(sr->uring);
+    sr->uring = NULL;
+} /* -- sr_uring_destroy -- */
+
+#else /* _URING_ */
+
+int sr_uring_init(struct sr_instance* sr)
+{
+    fprintf(stderr, "Built without io_uring support\n");
+    return -1;
+}
+
+int sr_uring_fd(struct sr_instance* sr)
+{ return -1; }
+
+int sr_uring_read(struct sr_instance* sr)
+{ return -1; }
+
+int sr_uring_send(struct sr_instance* sr)
+{ return -1; }
+
+void sr_uring_destroy(struct sr_instance* sr)
+{ }
+
+#endif /* _URING_ */
@@ -0,0 +1,41 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_uring.h
+ *
+ * Description:
+ *
+ * io_uring transport for the connection to the server, used by the event
+ * loop in place of recv and writev when asked for with -i uring. A
+ * multishot receive stays posted over a ring of provided buffers, so data
+ * arrives without a syscall per read, and each flush of the output queue
+ * goes to the kernel as one chain of linked sends while the router fills
+ * a second queue buffer. Needs a 6.0 or later kernel; built in when the
+ * io_uring header is found (_URING_), otherwise sr_uring_init always
+ * fails and the connection stays on recv and writev.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_URING_H
+#define SR_URING_H
+
+struct sr_instance;
+
+/* Move the connected instance's socket onto an io_uring, after
+   sr_init_output. Returns 0, or -1 with sr->uring left NULL. */
+int sr_uring_init(struct sr_instance* sr);
+
+/* The ring's fd, readable while completions are waiting. */
+int sr_uring_fd(struct sr_instance* sr);
+
+/* Reap completions and handle every command they completed. Returns 1 to
+   carry on, 0 when the session is closed, -1 on error. */
+int sr_uring_read(struct sr_instance* sr);
+
+/* Start sending the output queue and give the router the spare queue
+   buffer, first waiting for the send before this one. Returns 0, or -1 if
+   the connection is broken. */
+int sr_uring_send(struct sr_instance* sr);
+
+/* Wait for the last send and tear the ring down. */
+void sr_uring_destroy(struct sr_instance* sr);
+
+#endif /* -- SR_URING_H -- */
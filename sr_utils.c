@@ -5,7 +5,133 @@
 #include "sr_utils.h"
 
 
+/* The Internet checksum is the same whichever byte order the 16 bit words
+   are added in, as long as the result is read back the same way. The kernels
+   below add the data as native words into a wide accumulator with end around
+   carry, and cksum() folds that to 16 bits, which then already sits in
+   network order in memory. */
+
+/* end around carry add of 64 bit words */
+static uint64_t cksum_add64(uint64_t sum, uint64_t word) {
+  sum += word;
+  return sum + (sum < word);
+}
+
+/* the tail of any kernel: 8, 4, 2 and 1 byte steps */
+static uint64_t cksum_add_tail(const uint8_t *data, int len, uint64_t sum) {
+  uint64_t w64;
+  uint32_t w32;
+  uint16_t w16;
+  uint8_t last[2];
+
+  for (; len >= 8; data += 8, len -= 8) {
+    memcpy(&w64, data, 8);
+    sum = cksum_add64(sum, w64);
+  }
+  if (len >= 4) {
+    memcpy(&w32, data, 4);
+    sum = cksum_add64(sum, w32);
+    data += 4;
+    len -= 4;
+  }
+  if (len >= 2) {
+    memcpy(&w16, data, 2);
+    sum = cksum_add64(sum, w16);
+    data += 2;
+    len -= 2;
+  }
+  if (len > 0) {
+    /* odd byte is the first half of a word padded with zero */
+    last[0] = data[0];
+    last[1] = 0;
+    memcpy(&w16, last, 2);
+    sum = cksum_add64(sum, w16);
+  }
+  return sum;
+}
+
+static uint64_t cksum_add_scalar(const uint8_t *data, int len) {
+  return cksum_add_tail(data, len, 0);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CKSUM_X86 1
+#include <immintrin.h>
+
+/* 16 bytes per step, each 64 bit lane collects two 32 bit words so it cannot
+   overflow for any packet we will ever see */
+__attribute__((target("sse2")))
+static uint64_t cksum_add_sse2(const uint8_t *data, int len) {
+  __m128i acc = _mm_setzero_si128();
+  __m128i lo_mask = _mm_set_epi32(0, -1, 0, -1);
+  __m128i v;
+  uint64_t lanes[2];
+
+  for (; len >= 16; data += 16, len -= 16) {
+    v = _mm_loadu_si128((const __m128i *)data);
+    acc = _mm_add_epi64(acc, _mm_and_si128(v, lo_mask));
+    acc = _mm_add_epi64(acc, _mm_srli_epi64(v, 32));
+  }
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return cksum_add_tail(data, len, cksum_add64(lanes[0], lanes[1]));
+}
+
+/* same as the SSE2 kernel, two 16 byte loads per step */
+__attribute__((target("avx2")))
+static uint64_t cksum_add_avx2(const uint8_t *data, int len) {
+  __m256i acc0 = _mm256_setzero_si256();
+  __m256i acc1 = _mm256_setzero_si256();
+  __m256i lo_mask = _mm256_set_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+  __m256i v0, v1;
+  uint64_t lanes[4];
+  uint64_t sum;
+
+  for (; len >= 64; data += 64, len -= 64) {
+    v0 = _mm256_loadu_si256((const __m256i *)data);
+    v1 = _mm256_loadu_si256((const __m256i *)(data + 32));
+    acc0 = _mm256_add_epi64(acc0, _mm256_and_si256(v0, lo_mask));
+    acc1 = _mm256_add_epi64(acc1, _mm256_srli_epi64(v0, 32));
+    acc0 = _mm256_add_epi64(acc0, _mm256_and_si256(v1, lo_mask));
+    acc1 = _mm256_add_epi64(acc1, _mm256_srli_epi64(v1, 32));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+  sum = cksum_add64(cksum_add64(lanes[0], lanes[1]), cksum_add64(lanes[2], lanes[3]));
+  return cksum_add_tail(data, len, sum);
+}
+#endif /* x86 */
+
+static uint64_t cksum_add_resolve(const uint8_t *data, int len);
+
+/* kernel in use, picked on the first call */
+static uint64_t (*cksum_add)(const uint8_t *, int) = cksum_add_resolve;
+
+static uint64_t cksum_add_resolve(const uint8_t *data, int len) {
+  cksum_add = cksum_add_scalar;
+#ifdef CKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    cksum_add = cksum_add_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    cksum_add = cksum_add_sse2;
+#endif
+  return cksum_add(data, len);
+}
+
+static uint16_t cksum_fold(uint64_t sum) {
+  uint16_t res;
+
+  while (sum > 0xffff)
+    sum = (sum >> 16) + (sum & 0xffff);
+  res = ~sum;
+  return res ? res : 0xffff;
+}
+
 uint16_t cksum (const void *_data, int len) {
+  return cksum_fold(cksum_add(_data, len));
+}
+
+/* the original byte pair loop, which the kernels must agree with */
+uint16_t cksum_ref (const void *_data, int len) {
   const uint8_t *data = _data;
   uint32_t sum;
 
@@ -19,6 +145,99 @@ uint16_t cksum (const void *_data, int len) {
   return sum ? sum : 0xffff;
 }
 
+const char *cksum_kernel_name(int kernel) {
+  static const char *names[] = { "scalar", "sse2", "avx2" };
+
+  return (kernel >= 0 && kernel < cksum_kernel_count) ? names[kernel] : NULL;
+}
+
+int cksum_kernel_available(int kernel) {
+  if (kernel == cksum_kernel_scalar)
+    return 1;
+#ifdef CKSUM_X86
+  __builtin_cpu_init();
+  if (kernel == cksum_kernel_sse2)
+    return __builtin_cpu_supports("sse2");
+  if (kernel == cksum_kernel_avx2)
+    return __builtin_cpu_supports("avx2");
+#endif
+  return 0;
+}
+
+uint16_t cksum_with(int kernel, const void *_data, int len) {
+#ifdef CKSUM_X86
+  if (kernel == cksum_kernel_sse2)
+    return cksum_fold(cksum_add_sse2(_data, len));
+  if (kernel == cksum_kernel_avx2)
+    return cksum_fold(cksum_add_avx2(_data, len));
+#endif
+  return cksum_fold(cksum_add_scalar(_data, len));
+}
+
+
+/* HC' = ~(~HC + ~m + m'), eqn. 3 of RFC 1624 */
+uint16_t cksum_update16(uint16_t sum, uint16_t old_word, uint16_t new_word) {
+  uint32_t acc = (uint16_t)~sum;
+
+  acc += (uint16_t)~old_word;
+  acc += new_word;
+  while (acc > 0xffff)
+    acc = (acc >> 16) + (acc & 0xffff);
+  return (uint16_t)~acc;
+}
+
+/* a 32 bit field is two adjacent 16 bit words */
+uint16_t cksum_update32(uint16_t sum, uint32_t old_word, uint32_t new_word) {
+  sum = cksum_update16(sum, (uint16_t)(old_word >> 16), (uint16_t)(new_word >> 16));
+  return cksum_update16(sum, (uint16_t)old_word, (uint16_t)new_word);
+}
+
+/* TTL shares a 16 bit word with the protocol field */
+void ip_decrement_ttl(sr_ip_hdr_t *ip_hdr) {
+  uint16_t old_word, new_word;
+
+  memcpy(&old_word, &(ip_hdr->ip_ttl), sizeof(uint16_t));
+  ip_hdr->ip_ttl--;
+  memcpy(&new_word, &(ip_hdr->ip_ttl), sizeof(uint16_t));
+  ip_hdr->ip_sum = cksum_update16(ip_hdr->ip_sum, old_word, new_word);
+}
+
+/* type shares a 16 bit word with the code field */
+void icmp_set_type(sr_icmp_hdr_t *icmp_hdr, uint8_t type) {
+  uint16_t old_word, new_word;
+
+  memcpy(&old_word, icmp_hdr, sizeof(uint16_t));
+  icmp_hdr->icmp_type = type;
+  memcpy(&new_word, icmp_hdr, sizeof(uint16_t));
+  icmp_hdr->icmp_sum = cksum_update16(icmp_hdr->icmp_sum, old_word, new_word);
+}
+
+/* The UDP checksum covers the addresses through the pseudo-header. A zero
+   checksum was never computed and stays zero, and a computed one that
+   comes out as zero is sent as 0xffff (RFC 768). */
+static uint16_t udp_cksum_update(uint16_t sum, uint32_t old_ip, uint32_t new_ip,
+    uint16_t old_port, uint16_t new_port) {
+  if (sum == 0)
+    return 0;
+  sum = cksum_update32(sum, old_ip, new_ip);
+  sum = cksum_update16(sum, old_port, new_port);
+  return sum ? sum : 0xffff;
+}
+
+void udp_set_src(sr_ip_hdr_t *ip_hdr, sr_udp_hdr_t *udp_hdr, uint32_t ip, uint16_t port) {
+  ip_hdr->ip_sum = cksum_update32(ip_hdr->ip_sum, ip_hdr->ip_src, ip);
+  udp_hdr->udp_sum = udp_cksum_update(udp_hdr->udp_sum, ip_hdr->ip_src, ip, udp_hdr->port_src, port);
+  ip_hdr->ip_src = ip;
+  udp_hdr->port_src = port;
+}
+
+void udp_set_dst(sr_ip_hdr_t *ip_hdr, sr_udp_hdr_t *udp_hdr, uint32_t ip, uint16_t port) {
+  ip_hdr->ip_sum = cksum_update32(ip_hdr->ip_sum, ip_hdr->ip_dst, ip);
+  udp_hdr->udp_sum = udp_cksum_update(udp_hdr->udp_sum, ip_hdr->ip_dst, ip, udp_hdr->port_dst, port);
+  ip_hdr->ip_dst = ip;
+  udp_hdr->port_dst = port;
+}
+
 
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
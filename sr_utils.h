@@ -30,6 +30,35 @@
 
 uint16_t cksum(const void *_data, int len);
 
+/* For cksum_test: the byte pair loop cksum() replaced, and cksum() on a
+   given kernel, which must only be asked for if cksum_kernel_available(). */
+enum cksum_kernel {
+  cksum_kernel_scalar,
+  cksum_kernel_sse2,
+  cksum_kernel_avx2,
+  cksum_kernel_count
+};
+uint16_t cksum_ref(const void *_data, int len);
+const char *cksum_kernel_name(int kernel);
+int cksum_kernel_available(int kernel);
+uint16_t cksum_with(int kernel, const void *_data, int len);
+
+/* Patch a stored checksum for a 16 or 32 bit field of the covered data that
+   changed from old_word to new_word, both as they sit in the packet
+   (RFC 1624). Costs the same whatever the length of the covered data. */
+uint16_t cksum_update16(uint16_t sum, uint16_t old_word, uint16_t new_word);
+uint16_t cksum_update32(uint16_t sum, uint32_t old_word, uint32_t new_word);
+
+struct sr_ip_hdr;
+struct sr_icmp_hdr;
+struct sr_udp_hdr;
+
+/* header rewrites that keep the checksum in step */
+void ip_decrement_ttl(struct sr_ip_hdr *ip_hdr);
+void icmp_set_type(struct sr_icmp_hdr *icmp_hdr, uint8_t type);
+void udp_set_src(struct sr_ip_hdr *ip_hdr, struct sr_udp_hdr *udp_hdr, uint32_t ip, uint16_t port);
+void udp_set_dst(struct sr_ip_hdr *ip_hdr, struct sr_udp_hdr *udp_hdr, uint32_t ip, uint16_t port);
+
 uint16_t ethertype(uint8_t *buf);
 uint8_t ip_protocol(uint8_t *buf);
 
@@ -35,11 +35,17 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/timerfd.h>
+#include <poll.h>
 
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_uring.h"
+#include "sr_io.h"
+#include "sr_event.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
@@ -331,84 +337,125 @@ int sr_read_from_server(struct sr_instance* sr /* borrowed */)
     return sr_read_from_server_expect(sr, 0);
 }
 
-int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
-{
-    int command, len;
-    unsigned char *buf = 0;
-    c_packet_ethernet_header* sr_pkt = 0;
-    int ret = 0, bytes_read = 0;
+/*-----------------------------------------------------------------------------
+ * Method: sr_rx_next(..)
+ * Scope: Local
+ *
+ * Length of the command at the front of the receive buffer if all of it
+ * has arrived, 0 if it has not, -1 if its length field is bad.
+ *
+ *---------------------------------------------------------------------------*/
 
-    /* REQUIRES */
-    assert(sr);
+static int sr_rx_next(struct sr_instance* sr /* borrowed */)
+{
+    uint32_t len;
 
-    /*---------------------------------------------------------------------------
-      Read a command from the server
-      -------------------------------------------------------------------------*/
+    if ( sr->rx_tail - sr->rx_head < 4 )
+    { return 0; }
 
-    bytes_read = 0;
+    memcpy(&len, sr->rx_buf + sr->rx_head, 4);
+    len = ntohl(len);
 
-    /* attempt to read the size of the incoming packet */
-    while( bytes_read < 4)
+    if ( len > 10000 || len < sizeof(c_base) )
     {
-        do
-        { /* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if((ret = recv(sr->sockfd,((uint8_t*)&len) + bytes_read,
-                            4 - bytes_read, 0)) == -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
+        fprintf(stderr,"Error: command length to large %u\n",len);
+        return -1;
+    }
 
-                perror("recv(..):sr_client.c::sr_read_from_server");
-                return -1;
-            }
-            bytes_read += ret;
-        } while ( errno == EINTR); /* be mindful of signals */
+    return ( sr->rx_tail - sr->rx_head >= len ) ? (int)len : 0;
+} /* -- sr_rx_next -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_rx_reserve(..)
+ * Scope: Global
+ *
+ * Make room at the end of the receive buffer by moving the unparsed rest,
+ * never more than one partial command, to the front. Returns where new
+ * bytes go, SR_RX_BUF_SZ - rx_tail of them, or 0 if out of memory.
+ *
+ *---------------------------------------------------------------------------*/
+
+uint8_t* sr_rx_reserve(struct sr_instance* sr /* borrowed */)
+{
+    if ( sr->rx_buf == 0 )
+    {
+        if ( (sr->rx_buf = (uint8_t *)malloc(SR_RX_BUF_SZ)) == 0 )
+        {
+            fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
+            return 0;
+        }
+        sr->rx_head = sr->rx_tail = 0;
+    }
 
+    if ( sr->rx_head > 0 )
+    {
+        memmove(sr->rx_buf, sr->rx_buf + sr->rx_head, sr->rx_tail - sr->rx_head);
+        sr->rx_tail -= sr->rx_head;
+        sr->rx_head = 0;
     }
 
-    len = ntohl(len);
+    return sr->rx_buf + sr->rx_tail;
+} /* -- sr_rx_reserve -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_rx_fill(..)
+ * Scope: Local
+ *
+ * One recv into the receive buffer, as much as the server has ready and
+ * fits. Returns the bytes read, 0 if a
+ * non-blocking socket had nothing, -1 on an error or when the server has
+ * gone away.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_rx_fill(struct sr_instance* sr /* borrowed */)
+{
+    int ret;
+
+    if ( sr_rx_reserve(sr) == 0 )
+    { return -1; }
 
-    if ( len > 10000 || len < 0 )
+    do
+    { /* -- just in case SIGALRM breaks recv -- */
+        ret = recv(sr->sockfd, sr->rx_buf + sr->rx_tail, SR_RX_BUF_SZ - sr->rx_tail, 0);
+    } while ( ret == -1 && errno == EINTR ); /* be mindful of signals */
+
+    if ( ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+    { return 0; }
+    if ( ret == -1 )
     {
-        fprintf(stderr,"Error: command length to large %d\n",len);
-        close(sr->sockfd);
+        perror("recv(..):sr_client.c::sr_read_from_server");
         return -1;
     }
-
-    if((buf = malloc(len)) == 0)
+    if ( ret == 0 )
     {
-        fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
+        fprintf(stderr,"Error: server closed the connection\n");
         return -1;
     }
 
-    /* set first field of command since we've already read it */
-    *((int *)buf) = htonl(len);
+    sr->rx_tail += ret;
+    return ret;
+} /* -- sr_rx_fill -- */
 
-    bytes_read = 0;
+/*-----------------------------------------------------------------------------
+ * Method: sr_handle_command(..)
+ * Scope: Local
+ *
+ * Act on one complete command of len bytes, parsed in place in the receive
+ * buffer. Returns 1 to carry on, 0 when the session is closed, -1 on error.
+ *
+ *---------------------------------------------------------------------------*/
 
-    /* read the rest of the command */
-    while ( bytes_read < len - 4)
-    {
-        do
-        {/* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if ((ret = read(sr->sockfd, buf+4+bytes_read, len - 4 - bytes_read)) ==
-                    -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
-                fprintf(stderr,"Error: failed reading command body %d\n",ret);
-                close(sr->sockfd);
-                return -1;
-            }
-            bytes_read += ret;
-        } while (errno == EINTR); /* be mindful of signals */
-    }
+static int sr_handle_command(struct sr_instance* sr /* borrowed */,
+                             unsigned char* buf /* borrowed */,
+                             int len, int expected_cmd)
+{
+    int command, ret;
 
-    /* My entry for most unreadable line of code - guido */
-    /* ... you win - mc                                  */
-    command = *(((int *)buf)+1) = ntohl(*(((int *)buf)+1));
+    /* the handlers expect the command type in host order */
+    memcpy(&command, buf + 4, 4);
+    command = ntohl(command);
+    memcpy(buf + 4, &command, 4);
 
     /* make sure the command is what we expected if we were expecting something */
     if(expected_cmd && command!=expected_cmd) {
@@ -424,22 +471,7 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
         /* -------------        VNSPACKET     -------------------- */
 
         case VNSPACKET:
-            sr_pkt = (c_packet_ethernet_header *)buf;
-
-            /* -- check if it is an ARP to another router if so drop   -- */
-            if ( sr_arp_req_not_for_us(sr,
-                    (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base))) )
-            { break; }
-
-            /* -- log packet -- */
-            sr_log_packet(sr, buf + sizeof(c_packet_header),
-                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
-
-            /* -- pass to router, student's code should take over here -- */
-            sr_handlepacket(sr,
+            sr_receive_packet(sr,
                     (buf+sizeof(c_packet_header)),
                     len - sizeof(c_packet_ethernet_header) +
                     sizeof(struct sr_ethernet_hdr),
@@ -454,8 +486,6 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             fprintf(stderr,"Reason: %s\n",((c_close*)buf)->mErrorMessage);
             sr_session_closed_help();
 
-            if(buf)
-            { free(buf); }
             return 0;
             break;
 
@@ -501,11 +531,132 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
     }/* -- switch -- */
 
-    if(buf)
-    { free(buf); }
+    return ret;
+} /* -- sr_handle_command -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_receive_packet(..)
+ * Scope: global
+ *
+ * A frame arrived on iface, from the server or from an I/O backend. Drops
+ * ARP requests for other hosts, logs it and hands it to the router.
+ *
+ *---------------------------------------------------------------------------*/
+
+void sr_receive_packet(struct sr_instance* sr /* borrowed */,
+                       uint8_t* packet /* lent */,
+                       unsigned int len,
+                       char* iface /* lent */)
+{
+    /* -- check if it is an ARP to another router if so drop   -- */
+    if ( sr_arp_req_not_for_us(sr, packet, len, iface) )
+    { return; }
+
+    /* -- log packet -- */
+    sr_log_packet(sr, packet, len);
+
+    /* -- pass to router, student's code should take over here -- */
+    sr_handlepacket(sr, packet, len, iface);
+} /* -- sr_receive_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_read_from_server_expect(..)
+ * Scope: global
+ *
+ * Read until at least one whole command is buffered and handle it. In the
+ * main loop (no expected command) every other complete command that came
+ * in with the same recv is handled too, so under load a single syscall
+ * feeds a whole batch of packets to the router.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
+{
+    int len, ret;
+
+    /* REQUIRES */
+    assert(sr);
+
+    /* read until at least one whole command is buffered */
+    while ( (len = sr_rx_next(sr)) == 0 )
+    {
+        if ( sr_rx_fill(sr) < 0 )
+        {
+            close(sr->sockfd);
+            return -1;
+        }
+    }
+
+    /* handle it, and in the main loop everything else that is complete */
+    do
+    {
+        if ( len < 0 )
+        {
+            close(sr->sockfd);
+            return -1;
+        }
+        ret = sr_handle_command(sr, sr->rx_buf + sr->rx_head, len, expected_cmd);
+        sr->rx_head += len;
+    } while ( ret == 1 && expected_cmd == 0 && (len = sr_rx_next(sr)) != 0 );
+
+    /* the batch is done, send whatever it produced */
+    if ( sr_flush_output(sr) != 0 )
+    { return -1; }
+
     return ret;
 }/* -- sr_read_from_server -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_read_from_server_ready(..)
+ * Scope: global
+ *
+ * For the event loop once the socket is readable: one recv, then every
+ * command it completed. Output is left queued for the loop to flush.
+ * Returns 1 to carry on, 0 when the session is closed, -1 on error.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_read_from_server_ready(struct sr_instance* sr /* borrowed */)
+{
+    /* REQUIRES */
+    assert(sr);
+
+    if ( sr_rx_fill(sr) < 0 )
+    {
+        close(sr->sockfd);
+        return -1;
+    }
+
+    return sr_read_from_server_buffered(sr);
+} /* -- sr_read_from_server_ready -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_read_from_server_buffered(..)
+ * Scope: global
+ *
+ * Handle every complete command in the receive buffer, for whatever filled
+ * it. Returns 1 to carry on, 0 when the session is closed, -1 on error.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_read_from_server_buffered(struct sr_instance* sr /* borrowed */)
+{
+    int len, ret = 1;
+
+    while ( ret == 1 && (len = sr_rx_next(sr)) != 0 )
+    {
+        if ( len < 0 )
+        {
+            close(sr->sockfd);
+            return -1;
+        }
+        ret = sr_handle_command(sr, sr->rx_buf + sr->rx_head, len, 0);
+        sr->rx_head += len;
+    }
+
+    return ret;
+} /* -- sr_read_from_server_buffered -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_ether_addrs_match_interface(..)
  * Scope: Local
@@ -550,12 +701,162 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
 
 } /* -- sr_ether_addrs_match_interface -- */
 
+/* a write that has to wait for room in the socket polls for it at most
+   SR_WRITE_POLLS times, SR_WRITE_POLL_MS each */
+#define SR_WRITE_POLLS   100
+#define SR_WRITE_POLL_MS 10
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_write_iov(..)
+ * Scope: Local
+ *
+ * Write as much of iov to the server as it takes. A short write is carried
+ * on from where it stopped. When the socket is full (EAGAIN, ENOBUFS) it
+ * returns at once, or with wait polls for room, giving up after
+ * SR_WRITE_POLLS polls. Returns the bytes written, or -1 if the connection
+ * is broken, an error or hangup on the socket included.
+ *
+ *---------------------------------------------------------------------------*/
+
+static ssize_t sr_write_iov(struct sr_instance* sr /* borrowed */,
+                            struct iovec* iov /* borrowed */, int cnt, int wait)
+{
+    struct pollfd pfd;
+    ssize_t ret, done = 0;
+    int polls = 0;
+
+    while ( cnt > 0 )
+    {
+        ret = writev(sr->sockfd, iov, cnt);
+        if ( ret < 0 )
+        {
+            if ( errno == EINTR )
+            { continue; }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS )
+            {
+                if ( !wait )
+                { break; }
+                if ( polls++ == SR_WRITE_POLLS )
+                { break; }
+                pfd.fd = sr->sockfd;
+                pfd.events = POLLOUT;
+                pfd.revents = 0;
+                if ( poll(&pfd, 1, SR_WRITE_POLL_MS) < 0 && errno != EINTR )
+                {
+                    perror("poll(..):sr_write_iov");
+                    return -1;
+                }
+                if ( pfd.revents & (POLLERR | POLLHUP | POLLNVAL) )
+                {
+                    fprintf(stderr, "** Error: connection to the server failed while writing\n");
+                    return -1;
+                }
+                continue;
+            }
+            perror("writev(..):sr_client.c::sr_send_packet");
+            return -1;
+        }
+        done += ret;
+
+        /* drop what went out */
+        while ( cnt > 0 && (size_t)ret >= iov->iov_len )
+        {
+            ret -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if ( cnt > 0 )
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    return done;
+} /* -- sr_write_iov -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_flush_output(..)
+ * Scope: Global
+ *
+ * Write out everything queued for the server the socket has room for. The
+ * rest moves to the front of the queue and the event loop is asked to
+ * flush again once the socket is writable. Returns 0, or -1 if the
+ * connection is broken.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_flush_output(struct sr_instance* sr /* borrowed */)
+{
+    struct iovec iov;
+    ssize_t ret;
+
+    if ( sr->io != 0 )
+    { return sr->io->flush(sr); }
+
+    if ( sr->tx_buf == 0 || sr->tx_len == 0 )
+    { return 0; }
+
+    if ( sr->uring != 0 )
+    { return sr_uring_send(sr); }
+
+    iov.iov_base = sr->tx_buf;
+    iov.iov_len = sr->tx_len;
+    if ( (ret = sr_write_iov(sr, &iov, 1, 0)) < 0 )
+    {
+        /* on a broken connection there is nobody to send them to */
+        sr->tx_len = 0;
+        return -1;
+    }
+
+    /* keep what did not fit, a command cut short included */
+    sr->tx_len -= ret;
+    if ( sr->tx_len > 0 && ret > 0 )
+    { memmove(sr->tx_buf, sr->tx_buf + ret, sr->tx_len); }
+
+    return sr_event_want_write(sr, sr->tx_len > 0);
+} /* -- sr_flush_output -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_init_output(..)
+ * Scope: Global
+ *
+ * Queue packets for the server instead of writing each on its own, holding
+ * them at most delay_us. The event loop watches tx_timerfd for the
+ * deadline. Returns 0 on success.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_init_output(struct sr_instance* sr /* borrowed */, unsigned int delay_us)
+{
+    uint8_t* buf;
+    int fd;
+
+    if ( (buf = (uint8_t *)malloc(SR_TX_BUF_SZ)) == 0 )
+    { return -1; }
+
+    if ( (fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 )
+    {
+        perror("timerfd_create(..):sr_init_output");
+        free(buf);
+        return -1;
+    }
+
+    sr->tx_len = 0;
+    sr->tx_delay_us = delay_us;
+    sr->tx_timerfd = fd;
+    sr->tx_buf = buf;
+    return 0;
+} /* -- sr_init_output -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_send_packet(..)
  * Scope: Global
  *
  * Send a packet (ethernet header included!) of length 'len' to the server
- * to be injected onto the wire.
+ * to be injected onto the wire. With an output queue the framed packet is
+ * queued and goes out at the next flush, otherwise header and frame are
+ * written straight from the stack and the caller's buffer.
  *
  *---------------------------------------------------------------------------*/
 
@@ -564,8 +865,12 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          unsigned int len,
                          const char* iface /* borrowed */)
 {
-    c_packet_header *sr_pkt;
+    c_packet_header sr_pkt;
+    struct iovec iov[2];
+    struct itimerspec deadline;
     unsigned int total_len =  len + (sizeof(c_packet_header));
+    ssize_t sent;
+    int ret = 0;
 
     /* REQUIRES */
     assert(sr);
@@ -578,34 +883,70 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
         return -1;
     }
 
-    /* Create packet */
-    sr_pkt = (c_packet_header *)malloc(len +
-            sizeof(c_packet_header));
-    assert(sr_pkt);
-    sr_pkt->mLen  = htonl(total_len);
-    sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
-    memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
-            buf,len);
+    sr_pkt.mLen  = htonl(total_len);
+    sr_pkt.mType = htonl(VNSPACKET);
+    strncpy(sr_pkt.mInterfaceName,iface,16);
 
     /* -- log packet -- */
     sr_log_packet(sr,buf,len);
 
     if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
         fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
-        free ( sr_pkt );
         return -1;
     }
 
-    if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
-        fprintf(stderr, "Error writing packet\n");
-        free(sr_pkt);
+    if ( sr->io != 0 )
+    { return sr->io->send(sr, buf, len, iface); }
+
+    if ( sr->tx_buf == 0 )
+    {
+        iov[0].iov_base = &sr_pkt;
+        iov[0].iov_len = sizeof(c_packet_header);
+        iov[1].iov_base = buf;
+        iov[1].iov_len = len;
+        sent = sr_write_iov(sr, iov, 2, 1);
+        if ( sent == (ssize_t)total_len )
+        { return 0; }
+        if ( sent == 0 )
+        {
+            sr->tx_dropped++;
+            return -1;
+        }
+
+        /* a command cut short leaves the stream out of step, end the
+           session so the event loop sees it closed */
+        if ( sent > 0 )
+        {
+            fprintf(stderr, "** Error: server stopped reading mid packet, closing\n");
+            shutdown(sr->sockfd, SHUT_RDWR);
+        }
         return -1;
     }
 
-    free(sr_pkt);
+    if ( sr->tx_len + total_len > SR_TX_BUF_SZ )
+    { ret = sr_flush_output(sr); }
 
-    return 0;
+    /* still no room, the server is not keeping up */
+    if ( sr->tx_len + total_len > SR_TX_BUF_SZ )
+    {
+        sr->tx_dropped++;
+        return -1;
+    }
+
+    /* the first packet of a queue starts its clock */
+    if ( sr->tx_len == 0 )
+    {
+        memset(&deadline, 0, sizeof(deadline));
+        deadline.it_value.tv_sec = sr->tx_delay_us / 1000000;
+        deadline.it_value.tv_nsec = (sr->tx_delay_us % 1000000) * 1000;
+        timerfd_settime(sr->tx_timerfd, 0, &deadline, NULL);
+    }
+
+    memcpy(sr->tx_buf + sr->tx_len, &sr_pkt, sizeof(c_packet_header));
+    memcpy(sr->tx_buf + sr->tx_len + sizeof(c_packet_header), buf, len);
+    sr->tx_len += total_len;
+
+    return ret;
 } /* -- sr_send_packet -- */
 
 /*-----------------------------------------------------------------------------
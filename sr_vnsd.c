@@ -0,0 +1,1571 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_vnsd.c
+ *
+ * Description:
+ *
+ * vnsd, a stand-in for the VNS server to run sr against on one machine.
+ * It speaks the server side of the protocol in sr_vns_comm.c: the SHA1
+ * auth challenge checked against the same auth_key file sr reads, VNSOPEN
+ * or VNS_OPEN_TEMPLATE (answered with VNS_RTABLE), VNSHWINFO and VNSPACKET,
+ * and serves the topology in a config file (-c, vnsd.topo by default):
+ *
+ *     iface eth1 10.0.1.1 02:00:00:00:01:01 [255.255.255.0]
+ *     host  eth1 10.0.1.100 02:00:00:01:00:64
+ *     route 0.0.0.0 172.64.3.21 0.0.0.0 eth2
+ *     flow  10.0.1.100 172.64.3.21 1000 128 [port]
+ *     tcp   10.0.1.100 172.64.3.21 200 65536 [port]
+ *
+ * iface lines are the router's interfaces. host lines, after the iface
+ * they are on, are hosts on the wire behind it, which answer ARP requests
+ * and pings for their address. route lines go into the routing table sent
+ * for a template, after a host route for every host.
+ *
+ * flow lines make a host a traffic source: UDP frames of the given size at
+ * the given rate to the destination, from -D seconds after HWINFO for -d
+ * seconds. Each carries a sequence number and the time it was sent, so the
+ * host the router delivers it to, whichever that is, counts it and how long
+ * it took. A second after the last one is sent vnsd prints, for every flow,
+ * what was sent and received, the rates, and the latency, closes the
+ * session and exits, with status 1 if -L is given and a flow lost more than
+ * that percentage. Without flows it serves the one session until sr goes.
+ *
+ * tcp lines make a host open TCP connections at the given rate to the
+ * destination, each sending the given number of bytes, then closing. The
+ * client side keeps a window of segments in flight and completes the
+ * handshake and teardown; whichever host the router delivers the SYN to
+ * answers as the server, SYN+ACK, an ACK for every segment and FIN+ACK, so
+ * through NAT the whole exchange crosses the router's TCP translation and
+ * connection tracking. The report gives connections opened, established
+ * and completed per second, the acknowledged throughput, and the handshake
+ * latency. A connection that hears nothing for two seconds counts as
+ * failed, and failures count as loss for -L.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifdef _LINUX_
+#include <getopt.h>
+#endif /* _LINUX_ */
+
+#include "sr_protocol.h"
+#include "sr_utils.h"
+#include "vnscommand.h"
+#include "sha1.h"
+
+#define DEFAULT_PORT 8888
+#define DEFAULT_TOPO "vnsd.topo"
+#define DEFAULT_AUTH_KEY "auth_key"
+#define DEFAULT_DELAY 1.0
+#define DEFAULT_DURATION 10.0
+#define DEFAULT_UDP_PORT 9
+#define DEFAULT_TCP_PORT 80
+
+#define VNSD_MAX_IFS 16
+#define VNSD_MAX_HOSTS 64
+#define VNSD_MAX_FLOWS 64
+
+#define VNSD_AUTH_KEY_LEN 64
+#define VNSD_SALT_LEN 20
+#define VNSD_SHA1_LEN 20
+
+/* commands bigger than this are not from sr */
+#define VNSD_MAX_CMD (64 * 1024)
+
+/* stop generating traffic while this much output is waiting for sr */
+#define VNSD_OUT_MAX (256 * 1024)
+
+/* a source this far behind schedule skips the slots it missed */
+#define VNSD_MAX_LAG 0.05
+
+/* how long to wait for stragglers after the last frame is sent */
+#define VNSD_DRAIN 1.0
+
+/* latency histogram: one bucket per microsecond up to 10ms */
+#define VNSD_HIST 10000
+
+/* tcp flow clients use ports VNSD_TCP_PORT_BASE and up, one per open
+   connection, and keep VNSD_TCP_WINDOW segments of VNSD_TCP_MSS in flight */
+#define VNSD_TCP_PORT_BASE 10000
+#define VNSD_TCP_PORTS 50000
+#define VNSD_TCP_MSS 1460
+#define VNSD_TCP_WINDOW 32
+#define VNSD_TCP_TIMEOUT 2.0
+
+/* initial sequence numbers of the client and of the stateless server */
+#define VNSD_TCP_ISN 1000
+#define VNSD_TCP_SERVER_ISN 5000
+
+#define VNSD_TCP_FIN 0x01
+#define VNSD_TCP_SYN 0x02
+#define VNSD_TCP_ACK 0x10
+
+/* marks a flow frame, with the flow, sequence number and send time */
+#define VNSD_MAGIC 0x766e7364
+
+struct vnsd_probe
+{
+    uint32_t magic;
+    uint32_t flow;
+    uint32_t seq;
+    uint32_t sec;
+    uint32_t nsec;
+} __attribute__ ((packed));
+
+/* client side of one connection of a tcp flow */
+enum vnsd_tcp_state
+{
+    vnsd_tcp_free,
+    vnsd_tcp_syn_sent,
+    vnsd_tcp_established,
+    vnsd_tcp_fin_sent
+};
+
+struct vnsd_conn
+{
+    enum vnsd_tcp_state state;
+    double opened; /* SYN sent */
+    double last; /* heard from the server */
+    uint32_t sent; /* bytes */
+    uint32_t acked;
+};
+
+struct vnsd_iface
+{
+    char name[16];
+    uint32_t ip;
+    uint32_t mask;
+    uint8_t mac[ETHER_ADDR_LEN];
+
+    unsigned long rx_frames; /* from the router */
+    unsigned long rx_bytes;
+    unsigned long tx_frames; /* to the router */
+    unsigned long tx_bytes;
+};
+
+struct vnsd_host
+{
+    int iface;
+    uint32_t ip;
+    uint8_t mac[ETHER_ADDR_LEN];
+};
+
+struct vnsd_flow
+{
+    int src; /* host */
+    uint32_t dst;
+    unsigned int pps; /* or connections per second */
+    unsigned int size; /* frame bytes, or bytes per connection */
+    uint16_t port;
+    int tcp;
+
+    /* tcp: connections opened are numbered, and use the port and slot in
+       conns of their number modulo VNSD_TCP_PORTS; tail is the oldest one
+       not yet completed or failed */
+    struct vnsd_conn* conns;
+    unsigned long head;
+    unsigned long tail;
+    unsigned long established;
+    unsigned long completed;
+    unsigned long failed;
+    unsigned long acked_bytes;
+
+    double next; /* when the next frame is due */
+    uint32_t seq;
+    unsigned long sent;
+    unsigned long missed; /* slots skipped while behind */
+    unsigned long recv; /* or handshakes timed, for tcp */
+    unsigned long recv_bytes;
+    unsigned long reordered;
+    uint32_t last_seq;
+
+    double lat_min;
+    double lat_max;
+    double lat_sum;
+    unsigned long hist[VNSD_HIST + 1]; /* the last bucket is 10ms and over */
+};
+
+struct vnsd
+{
+    int nifs;
+    struct vnsd_iface ifs[VNSD_MAX_IFS];
+    int nhosts;
+    struct vnsd_host hosts[VNSD_MAX_HOSTS];
+    int nflows;
+    struct vnsd_flow* flows;
+    char* routes; /* route lines from the topology */
+    char auth_key[VNSD_AUTH_KEY_LEN + 1];
+
+    int fd;
+    uint8_t salt[VNSD_SALT_LEN];
+    int opened; /* HWINFO sent */
+    double start; /* traffic starts */
+    double stop; /* and stops */
+
+    uint8_t* in;
+    unsigned int in_len;
+    unsigned int in_size;
+    uint8_t* out;
+    unsigned int out_head;
+    unsigned int out_len;
+    unsigned int out_size;
+
+    unsigned long unmatched; /* frames from the router for nobody */
+    unsigned long icmp; /* ICMP errors and other frames for hosts */
+};
+
+static volatile sig_atomic_t vnsd_stop = 0;
+
+static void usage(char* );
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_now(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static double vnsd_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+} /* -- vnsd_now -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_parse_mac(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_parse_mac(const char* str, uint8_t* mac)
+{
+    unsigned int b[ETHER_ADDR_LEN];
+    char end;
+    int i;
+
+    if (sscanf(str, "%x:%x:%x:%x:%x:%x%c",
+               &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end) != ETHER_ADDR_LEN)
+    { return -1; }
+    for (i = 0; i < ETHER_ADDR_LEN; i++)
+    {
+        if (b[i] > 0xff)
+        { return -1; }
+        mac[i] = (uint8_t)b[i];
+    }
+    return 0;
+} /* -- vnsd_parse_mac -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_find_iface(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_find_iface(struct vnsd* vs, const char* name)
+{
+    int i;
+
+    for (i = 0; i < vs->nifs; i++)
+    {
+        if (strncmp(vs->ifs[i].name, name, sizeof(vs->ifs[i].name)) == 0)
+        { return i; }
+    }
+    return -1;
+} /* -- vnsd_find_iface -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_find_host(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_find_host(struct vnsd* vs, int iface, uint32_t ip)
+{
+    int i;
+
+    for (i = 0; i < vs->nhosts; i++)
+    {
+        if (vs->hosts[i].ip == ip && (iface < 0 || vs->hosts[i].iface == iface))
+        { return i; }
+    }
+    return -1;
+} /* -- vnsd_find_host -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_load_topo(..)
+ * Scope: Local
+ *
+ * Read the topology file, see the top of the file. Returns 0 or -1.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_load_topo(struct vnsd* vs, const char* filename)
+{
+    FILE* fp;
+    char line[BUFSIZ];
+    char kind[32], a[32], b[32], c[32], d[32], e[32];
+    struct in_addr ip, ip2;
+    struct vnsd_flow* flow;
+    size_t routes_len = 0;
+    int n, i, lineno = 0;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    while (fgets(line, BUFSIZ, fp) != 0)
+    {
+        lineno++;
+        n = sscanf(line, "%31s %31s %31s %31s %31s %31s", kind, a, b, c, d, e);
+        if (n <= 0 || kind[0] == '#')
+        { continue; }
+
+        if (strcmp(kind, "iface") == 0 && n >= 4 && vs->nifs < VNSD_MAX_IFS &&
+            strlen(a) < sizeof(vs->ifs[0].name) && inet_aton(b, &ip) != 0 &&
+            vnsd_parse_mac(c, vs->ifs[vs->nifs].mac) == 0 &&
+            (n == 4 || inet_aton(d, &ip2) != 0))
+        {
+            strcpy(vs->ifs[vs->nifs].name, a);
+            vs->ifs[vs->nifs].ip = ip.s_addr;
+            vs->ifs[vs->nifs].mask = (n == 4) ? htonl(0xffffff00) : ip2.s_addr;
+            vs->nifs++;
+        }
+        else if (strcmp(kind, "host") == 0 && n == 4 && vs->nhosts < VNSD_MAX_HOSTS &&
+                 (i = vnsd_find_iface(vs, a)) >= 0 && inet_aton(b, &ip) != 0 &&
+                 vnsd_parse_mac(c, vs->hosts[vs->nhosts].mac) == 0)
+        {
+            vs->hosts[vs->nhosts].iface = i;
+            vs->hosts[vs->nhosts].ip = ip.s_addr;
+            vs->nhosts++;
+        }
+        else if (strcmp(kind, "route") == 0 && n == 5)
+        {
+            vs->routes = (char *)realloc(vs->routes, routes_len + strlen(line) + 2);
+            n = sprintf(vs->routes + routes_len, "%s %s %s %s\n", a, b, c, d);
+            routes_len += n;
+        }
+        else if (strcmp(kind, "flow") == 0 && n >= 5 && vs->nflows < VNSD_MAX_FLOWS &&
+                 inet_aton(a, &ip) != 0 && (i = vnsd_find_host(vs, -1, ip.s_addr)) >= 0 &&
+                 inet_aton(b, &ip2) != 0 && atoi(c) > 0 &&
+                 atoi(d) >= (int)(sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) +
+                                  sizeof(sr_udp_hdr_t) + sizeof(struct vnsd_probe)) &&
+                 atoi(d) <= 1514)
+        {
+            vs->flows = (struct vnsd_flow *)realloc(vs->flows,
+                    (vs->nflows + 1) * sizeof(struct vnsd_flow));
+            flow = &vs->flows[vs->nflows++];
+            memset(flow, 0, sizeof(*flow));
+            flow->src = i;
+            flow->dst = ip2.s_addr;
+            flow->pps = atoi(c);
+            flow->size = atoi(d);
+            flow->port = (n == 6) ? atoi(e) : DEFAULT_UDP_PORT;
+        }
+        else if (strcmp(kind, "tcp") == 0 && n >= 5 && vs->nflows < VNSD_MAX_FLOWS &&
+                 inet_aton(a, &ip) != 0 && (i = vnsd_find_host(vs, -1, ip.s_addr)) >= 0 &&
+                 inet_aton(b, &ip2) != 0 && atoi(c) > 0 && atoi(d) >= 0)
+        {
+            vs->flows = (struct vnsd_flow *)realloc(vs->flows,
+                    (vs->nflows + 1) * sizeof(struct vnsd_flow));
+            flow = &vs->flows[vs->nflows++];
+            memset(flow, 0, sizeof(*flow));
+            flow->src = i;
+            flow->dst = ip2.s_addr;
+            flow->pps = atoi(c);
+            flow->size = atoi(d);
+            flow->port = (n == 6) ? atoi(e) : DEFAULT_TCP_PORT;
+            flow->tcp = 1;
+            flow->conns = (struct vnsd_conn *)calloc(VNSD_TCP_PORTS, sizeof(struct vnsd_conn));
+        }
+        else
+        {
+            fprintf(stderr, "%s:%d: cannot make sense of %s", filename, lineno, line);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+
+    if (vs->nifs == 0)
+    {
+        fprintf(stderr, "No interfaces in %s\n", filename);
+        return -1;
+    }
+    return 0;
+} /* -- vnsd_load_topo -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_load_auth_key(..)
+ * Scope: Local
+ *
+ * The key is read the way sr_handle_auth_request reads it.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_load_auth_key(struct vnsd* vs, const char* filename)
+{
+    FILE* fp;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+    if (fgets(vs->auth_key, VNSD_AUTH_KEY_LEN + 1, fp) != vs->auth_key ||
+        strlen(vs->auth_key) != VNSD_AUTH_KEY_LEN)
+    {
+        fprintf(stderr, "%s does not start with a %d character key\n",
+                filename, VNSD_AUTH_KEY_LEN);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+} /* -- vnsd_load_auth_key -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_queue(..)
+ * Scope: Local
+ *
+ * Append a command to the output for sr, sent as the socket takes it.
+ *
+ *---------------------------------------------------------------------------*/
+
+static uint8_t* vnsd_queue(struct vnsd* vs, uint32_t type, unsigned int len)
+{
+    c_base* base;
+    uint8_t* buf;
+
+    if (vs->out_head > 0 && vs->out_head + vs->out_len + len > vs->out_size)
+    {
+        memmove(vs->out, vs->out + vs->out_head, vs->out_len);
+        vs->out_head = 0;
+    }
+    if (vs->out_len + len > vs->out_size)
+    {
+        vs->out_size = 2 * (vs->out_len + len);
+        if ((buf = (uint8_t *)realloc(vs->out, vs->out_size)) == NULL)
+        {
+            perror("realloc(..):vnsd_queue");
+            exit(1);
+        }
+        vs->out = buf;
+    }
+
+    buf = vs->out + vs->out_head + vs->out_len;
+    vs->out_len += len;
+    memset(buf, 0, len);
+    base = (c_base *)buf;
+    base->mLen = htonl(len);
+    base->mType = htonl(type);
+    return buf;
+} /* -- vnsd_queue -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_flush(..)
+ * Scope: Local
+ *
+ * Send what the socket will take. Returns 0, or -1 when sr has gone.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_flush(struct vnsd* vs)
+{
+    ssize_t n;
+
+    while (vs->out_len > 0)
+    {
+        n = send(vs->fd, vs->out + vs->out_head, vs->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+            { return 0; }
+            perror("send(..):vnsd_flush");
+            return -1;
+        }
+        vs->out_head += n;
+        vs->out_len -= n;
+    }
+    vs->out_head = 0;
+    return 0;
+} /* -- vnsd_flush -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_send_frame(..)
+ * Scope: Local
+ *
+ * Hand a frame to the router on interface iface. Returns the frame to fill.
+ *
+ *---------------------------------------------------------------------------*/
+
+static uint8_t* vnsd_send_frame(struct vnsd* vs, int iface, unsigned int len)
+{
+    uint8_t* buf = vnsd_queue(vs, VNSPACKET, sizeof(c_packet_header) + len);
+
+    strncpy(((c_packet_header *)buf)->mInterfaceName, vs->ifs[iface].name, 16);
+    vs->ifs[iface].tx_frames++;
+    vs->ifs[iface].tx_bytes += len;
+    return buf + sizeof(c_packet_header);
+} /* -- vnsd_send_frame -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_auth_request(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void vnsd_auth_request(struct vnsd* vs)
+{
+    uint8_t* buf;
+    unsigned int i;
+
+    for (i = 0; i < VNSD_SALT_LEN; i++)
+    { vs->salt[i] = (uint8_t)rand(); }
+
+    buf = vnsd_queue(vs, VNS_AUTH_REQUEST, sizeof(c_auth_request) + VNSD_SALT_LEN);
+    memcpy(((c_auth_request *)buf)->salt, vs->salt, VNSD_SALT_LEN);
+} /* -- vnsd_auth_request -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_auth_reply(..)
+ * Scope: Local
+ *
+ * Check the salted SHA1 of the key the way sr_handle_auth_request made it.
+ * Returns 1 if it matches.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_auth_reply(struct vnsd* vs, uint8_t* cmd, unsigned int len)
+{
+    c_auth_reply* ar = (c_auth_reply *)cmd;
+    c_auth_status* st;
+    SHA1Context sha1;
+    uint32_t digest[5];
+    uint32_t user_len;
+    const char* msg;
+    int i, ok;
+
+    user_len = ntohl(ar->usernameLen);
+    if (len < sizeof(c_auth_reply) || user_len > len - sizeof(c_auth_reply) ||
+        len - sizeof(c_auth_reply) - user_len != VNSD_SHA1_LEN)
+    {
+        ok = 0;
+        msg = "malformed auth reply";
+    }
+    else
+    {
+        SHA1Reset(&sha1);
+        SHA1Input(&sha1, vs->salt, VNSD_SALT_LEN);
+        SHA1Input(&sha1, (unsigned char *)vs->auth_key, VNSD_AUTH_KEY_LEN);
+        SHA1Result(&sha1);
+        for (i = 0; i < 5; i++)
+        { digest[i] = htonl(sha1.Message_Digest[i]); }
+        ok = (memcmp(ar->username + user_len, digest, VNSD_SHA1_LEN) == 0);
+        msg = ok ? "" : "bad auth key";
+        printf("Auth reply from %.*s: %s\n", (int)user_len, ar->username,
+               ok ? "ok" : msg);
+    }
+
+    st = (c_auth_status *)vnsd_queue(vs, VNS_AUTH_STATUS,
+                                     sizeof(c_auth_status) + strlen(msg) + 1);
+    st->auth_ok = ok;
+    strcpy(st->msg, msg);
+    return ok;
+} /* -- vnsd_auth_reply -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_open(..)
+ * Scope: Local
+ *
+ * VNSOPEN, or VNS_OPEN_TEMPLATE which also wants the routing table: host
+ * routes to every host, then the route lines.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void vnsd_open(struct vnsd* vs, uint8_t* cmd, int template)
+{
+    c_hwinfo* hw;
+    c_rtable* rt;
+    char* table;
+    char ip[32];
+    size_t len = 0;
+    int i, e = 0;
+
+    if (template)
+    {
+        table = (char *)malloc(vs->nhosts * 80 + (vs->routes ? strlen(vs->routes) : 0) + 1);
+        for (i = 0; i < vs->nhosts; i++)
+        {
+            strcpy(ip, inet_ntoa(*(struct in_addr *)&vs->hosts[i].ip));
+            len += sprintf(table + len, "%s %s 255.255.255.255 %s\n",
+                           ip, ip, vs->ifs[vs->hosts[i].iface].name);
+        }
+        if (vs->routes)
+        {
+            strcpy(table + len, vs->routes);
+            len += strlen(vs->routes);
+        }
+
+        rt = (c_rtable *)vnsd_queue(vs, VNS_RTABLE, sizeof(c_rtable) + len);
+        memcpy(rt->mVirtualHostID, ((c_open_template *)cmd)->mVirtualHostID, IDSIZE);
+        rt->mVirtualHostID[IDSIZE - 1] = '\0';
+        memcpy(rt->rtable, table, len);
+        free(table);
+        printf("Template %.30s for %s\n", ((c_open_template *)cmd)->templateName,
+               rt->mVirtualHostID);
+    }
+    else
+    {
+        printf("Open topology %d for %.32s\n", ntohs(((c_open *)cmd)->topoID),
+               ((c_open *)cmd)->mVirtualHostID);
+    }
+
+    hw = (c_hwinfo *)vnsd_queue(vs, VNSHWINFO,
+                                2 * sizeof(uint32_t) + 4 * vs->nifs * sizeof(c_hw_entry));
+    for (i = 0; i < vs->nifs; i++)
+    {
+        hw->mHWInfo[e].mKey = htonl(HWINTERFACE);
+        strcpy(hw->mHWInfo[e++].value, vs->ifs[i].name);
+        hw->mHWInfo[e].mKey = htonl(HWETHER);
+        memcpy(hw->mHWInfo[e++].value, vs->ifs[i].mac, ETHER_ADDR_LEN);
+        hw->mHWInfo[e].mKey = htonl(HWETHIP);
+        memcpy(hw->mHWInfo[e++].value, &vs->ifs[i].ip, 4);
+        hw->mHWInfo[e].mKey = htonl(HWMASK);
+        memcpy(hw->mHWInfo[e++].value, &vs->ifs[i].mask, 4);
+    }
+} /* -- vnsd_open -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_arp(..)
+ * Scope: Local
+ *
+ * Hosts answer the router's ARP requests for them.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void vnsd_arp(struct vnsd* vs, int iface, uint8_t* frame, unsigned int len)
+{
+    sr_arp_hdr_t* arp = (sr_arp_hdr_t *)(frame + sizeof(sr_ethernet_hdr_t));
+    sr_ethernet_hdr_t* eth;
+    sr_arp_hdr_t* rep;
+    uint8_t* buf;
+    int h;
+
+    if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t) ||
+        ntohs(arp->ar_op) != arp_op_request ||
+        (h = vnsd_find_host(vs, iface, arp->ar_tip)) < 0)
+    { return; }
+
+    buf = vnsd_send_frame(vs, iface, sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t));
+    eth = (sr_ethernet_hdr_t *)buf;
+    memcpy(eth->ether_dhost, arp->ar_sha, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, vs->hosts[h].mac, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ethertype_arp);
+
+    rep = (sr_arp_hdr_t *)(buf + sizeof(sr_ethernet_hdr_t));
+    memcpy(rep, arp, sizeof(sr_arp_hdr_t));
+    rep->ar_op = htons(arp_op_reply);
+    memcpy(rep->ar_sha, vs->hosts[h].mac, ETHER_ADDR_LEN);
+    rep->ar_sip = vs->hosts[h].ip;
+    memcpy(rep->ar_tha, arp->ar_sha, ETHER_ADDR_LEN);
+    rep->ar_tip = arp->ar_sip;
+} /* -- vnsd_arp -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_tcp_send(..)
+ * Scope: Local
+ *
+ * Send a TCP segment with paylen bytes of zeros from host h to the router.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void vnsd_tcp_send(struct vnsd* vs, int h, uint32_t dst, uint16_t sport,
+                          uint16_t dport, uint32_t seq, uint32_t ack, uint8_t flags,
+                          unsigned int paylen)
+{
+    static uint8_t pseudo[12 + sizeof(sr_tcp_hdr_t) + VNSD_TCP_MSS];
+    struct vnsd_host* host = &vs->hosts[h];
+    unsigned int tlen = sizeof(sr_tcp_hdr_t) + paylen;
+    uint16_t plen = htons(tlen);
+    sr_ethernet_hdr_t* eth;
+    sr_ip_hdr_t* ip;
+    sr_tcp_hdr_t* tcp;
+    uint8_t* buf;
+
+    buf = vnsd_send_frame(vs, host->iface, sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + tlen);
+    eth = (sr_ethernet_hdr_t *)buf;
+    memcpy(eth->ether_dhost, vs->ifs[host->iface].mac, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, host->mac, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ethertype_ip);
+
+    ip = (sr_ip_hdr_t *)(buf + sizeof(sr_ethernet_hdr_t));
+    ip->ip_v = 4;
+    ip->ip_hl = 5;
+    ip->ip_len = htons(sizeof(sr_ip_hdr_t) + tlen);
+    ip->ip_ttl = 64;
+    ip->ip_p = ip_protocol_tcp;
+    ip->ip_src = host->ip;
+    ip->ip_dst = dst;
+    ip->ip_sum = cksum(ip, sizeof(sr_ip_hdr_t));
+
+    tcp = (sr_tcp_hdr_t *)(ip + 1);
+    tcp->port_src = htons(sport);
+    tcp->port_dst = htons(dport);
+    tcp->seq_num = htonl(seq);
+    tcp->ack = htonl(ack);
+    tcp->data_offset = sizeof(sr_tcp_hdr_t) / 4;
+    tcp->flag = flags;
+    tcp->adv_window = htons(0xffff);
+
+    /* the checksum covers the pseudo header too */
+    memcpy(pseudo, &ip->ip_src, 4);
+    memcpy(pseudo + 4, &ip->ip_dst, 4);
+    pseudo[8] = 0;
+    pseudo[9] = ip_protocol_tcp;
+    memcpy(pseudo + 10, &plen, 2);
+    memcpy(pseudo + 12, tcp, tlen);
+    tcp->tcp_sum = cksum(pseudo, 12 + tlen);
+} /* -- vnsd_tcp_send -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_tcp_push(..)
+ * Scope: Local
+ *
+ * Send what the window of connection number num allows, and the FIN once
+ * everything is acknowledged.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void vnsd_tcp_push(struct vnsd* vs, struct vnsd_flow* flow, unsigned long num)
+{
+    struct vnsd_conn* conn = &flow->conns[num % VNSD_TCP_PORTS];
+    uint16_t sport = VNSD_TCP_PORT_BASE + num % VNSD_TCP_PORTS;
+    unsigned int seg;
+
+    while (conn->sent < flow->size && conn->sent - conn->acked < VNSD_TCP_WINDOW * VNSD_TCP_MSS)
+    {
+        seg = (flow->size - conn->sent < VNSD_TCP_MSS) ? flow->size - conn->sent : VNSD_TCP_MSS;
+        vnsd_tcp_send(vs, flow->src, flow->dst, sport, flow->port,
+                      VNSD_TCP_ISN + 1 + conn->sent, VNSD_TCP_SERVER_ISN + 1,
+                      VNSD_TCP_ACK, seg);
+        conn->sent += seg;
+    }
+
+    if (conn->acked == flow->size)
+    {
+        vnsd_tcp_send(vs, flow->src, flow->dst, sport, flow->port,
+                      VNSD_TCP_ISN + 1 + flow->size, VNSD_TCP_SERVER_ISN + 1,
+                      VNSD_TCP_FIN | VNSD_TCP_ACK, 0);
+        conn->state = vnsd_tcp_fin_sent;
+    }
+} /* -- vnsd_tcp_push -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_tcp(..)
+ * Scope: Local
+ *
+ * A TCP segment for host h. If it answers a connection of a tcp flow from
+ * h it moves that connection along; anything else h answers as a server
+ * that keeps no state: SYN+ACK to a SYN, an ACK for every segment with data
+ * and FIN+ACK to a FIN.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void vnsd_tcp(struct vnsd* vs, int h, uint8_t* frame, unsigned int len)
+{
+    sr_ip_hdr_t* ip = (sr_ip_hdr_t *)(frame + sizeof(sr_ethernet_hdr_t));
+    unsigned int hl = ip->ip_hl * 4;
+    sr_tcp_hdr_t* tcp = (sr_tcp_hdr_t *)((uint8_t *)ip + hl);
+    unsigned int sport = ntohs(tcp->port_src);
+    unsigned int dport = ntohs(tcp->port_dst);
+    uint32_t seq = ntohl(tcp->seq_num);
+    uint32_t ack = ntohl(tcp->ack);
+    struct vnsd_flow* flow = NULL;
+    struct vnsd_conn* conn;
+    unsigned int paylen, slot;
+    unsigned long num;
+    double now, lat;
+    int i;
+
+    if (ntohs(ip->ip_len) < hl + tcp->data_offset * 4)
+    {
+        vs->icmp++;
+        return;
+    }
+    paylen = ntohs(ip->ip_len) - hl - tcp->data_offset * 4;
+
+    for (i = 0; i < vs->nflows; i++)
+    {
+        if (vs->flows[i].tcp && vs->flows[i].src == h && vs->flows[i].dst == ip->ip_src &&
+            vs->flows[i].port == sport && dport >= VNSD_TCP_PORT_BASE &&
+            dport < VNSD_TCP_PORT_BASE + VNSD_TCP_PORTS)
+        {
+            flow = &vs->flows[i];
+            break;
+        }
+    }
+
+    if (flow == NULL)
+    {
+        if ((tcp->flag & (VNSD_TCP_SYN | VNSD_TCP_ACK)) == VNSD_TCP_SYN)
+        {
+            vnsd_tcp_send(vs, h, ip->ip_src, dport, sport, VNSD_TCP_SERVER_ISN, seq + 1,
+                          VNSD_TCP_SYN | VNSD_TCP_ACK, 0);
+        }
+        else if (tcp->flag & VNSD_TCP_FIN)
+        {
+            vnsd_tcp_send(vs, h, ip->ip_src, dport, sport, VNSD_TCP_SERVER_ISN + 1,
+                          seq + paylen + 1, VNSD_TCP_FIN | VNSD_TCP_ACK, 0);
+        }
+        else if (paylen > 0)
+        {
+            vnsd_tcp_send(vs, h, ip->ip_src, dport, sport, VNSD_TCP_SERVER_ISN + 1,
+                          seq + paylen, VNSD_TCP_ACK, 0);
+        }
+        return;
+    }
+
+    /* the connection on that port is the newest one that used it */
+    slot = dport - VNSD_TCP_PORT_BASE;
+    conn = &flow->conns[slot];
+    if (flow->head <= slot || conn->state == vnsd_tcp_free)
+    { return; }
+    num = flow->head - 1 - (flow->head - 1 - slot) % VNSD_TCP_PORTS;
+    now = vnsd_now();
+
+    switch (conn->state)
+    {
+        case vnsd_tcp_syn_sent:
+            if ((tcp->flag & (VNSD_TCP_SYN | VNSD_TCP_ACK)) != (VNSD_TCP_SYN | VNSD_TCP_ACK) ||
+                ack != VNSD_TCP_ISN + 1)
+            { return; }
+            conn->state = vnsd_tcp_established;
+            flow->established++;
+
+            lat = now - conn->opened;
+            flow->recv++;
+            if (flow->recv == 1 || lat < flow->lat_min)
+            { flow->lat_min = lat; }
+            if (lat > flow->lat_max)
+            { flow->lat_max = lat; }
+            flow->lat_sum += lat;
+            flow->hist[(lat * 1e6 < VNSD_HIST) ? (int)(lat * 1e6) : VNSD_HIST]++;
+
+            vnsd_tcp_send(vs, h, flow->dst, dport, sport, VNSD_TCP_ISN + 1, seq + 1,
+                          VNSD_TCP_ACK, 0);
+            vnsd_tcp_push(vs, flow, num);
+            break;
+
+        case vnsd_tcp_established:
+            /* the server acks segments as they come, so take the highest */
+            ack -= VNSD_TCP_ISN + 1;
+            if (!(tcp->flag & VNSD_TCP_ACK) || ack <= conn->acked || ack > conn->sent)
+            { return; }
+            flow->acked_bytes += ack - conn->acked;
+            conn->acked = ack;
+            vnsd_tcp_push(vs, flow, num);
+            break;
+
+        case vnsd_tcp_fin_sent:
+            if (!(tcp->flag & VNSD_TCP_FIN))
+            { return; }
+            vnsd_tcp_send(vs, h, flow->dst, dport, sport, VNSD_TCP_ISN + 2 + flow->size,
+                          seq + paylen + 1, VNSD_TCP_ACK, 0);
+            conn->state = vnsd_tcp_free;
+            flow->completed++;
+            break;
+
+        default:
+            return;
+    }
+    conn->last = now;
+} /* -- vnsd_tcp -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_ip(..)
+ * Scope: Local
+ *
+ * An IP packet for host h: a flow frame is counted against its flow, TCP
+ * goes to vnsd_tcp, an echo request is answered, anything else counted.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void vnsd_ip(struct vnsd* vs, int h, uint8_t* frame, unsigned int len)
+{
+    sr_ip_hdr_t* ip = (sr_ip_hdr_t *)(frame + sizeof(sr_ethernet_hdr_t));
+    unsigned int hl = ip->ip_hl * 4;
+    unsigned int off = sizeof(sr_ethernet_hdr_t) + hl;
+    struct vnsd_probe* probe;
+    struct vnsd_flow* flow;
+    sr_ethernet_hdr_t* eth;
+    sr_icmp_hdr_t* icmp;
+    sr_ip_hdr_t* rip;
+    struct timespec ts;
+    uint8_t* buf;
+    double lat;
+    unsigned int seq;
+
+    if (ip->ip_p == ip_protocol_udp &&
+        len >= off + sizeof(sr_udp_hdr_t) + sizeof(struct vnsd_probe))
+    {
+        probe = (struct vnsd_probe *)(frame + off + sizeof(sr_udp_hdr_t));
+        if (ntohl(probe->magic) == VNSD_MAGIC && ntohl(probe->flow) < (uint32_t)vs->nflows)
+        {
+            flow = &vs->flows[ntohl(probe->flow)];
+            seq = ntohl(probe->seq);
+            if (flow->recv > 0 && seq < flow->last_seq)
+            { flow->reordered++; }
+            else
+            { flow->last_seq = seq; }
+            flow->recv++;
+            flow->recv_bytes += len;
+
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            lat = (ts.tv_sec - (double)ntohl(probe->sec)) +
+                  ((double)ts.tv_nsec - ntohl(probe->nsec)) / 1e9;
+            if (flow->recv == 1 || lat < flow->lat_min)
+            { flow->lat_min = lat; }
+            if (lat > flow->lat_max)
+            { flow->lat_max = lat; }
+            flow->lat_sum += lat;
+            flow->hist[(lat * 1e6 < VNSD_HIST) ? (int)(lat * 1e6) : VNSD_HIST]++;
+            return;
+        }
+    }
+
+    if (ip->ip_p == ip_protocol_tcp && len >= off + sizeof(sr_tcp_hdr_t))
+    {
+        vnsd_tcp(vs, h, frame, len);
+        return;
+    }
+
+    icmp = (sr_icmp_hdr_t *)(frame + off);
+    if (ip->ip_p != ip_protocol_icmp || len < off + sizeof(sr_icmp_hdr_t) ||
+        icmp->icmp_type != 8)
+    {
+        vs->icmp++;
+        return;
+    }
+
+    /* echo request, send it back as the reply */
+    buf = vnsd_send_frame(vs, vs->hosts[h].iface, len);
+    memcpy(buf, frame, len);
+    eth = (sr_ethernet_hdr_t *)buf;
+    memcpy(eth->ether_dhost, ((sr_ethernet_hdr_t *)frame)->ether_shost, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, vs->hosts[h].mac, ETHER_ADDR_LEN);
+
+    rip = (sr_ip_hdr_t *)(buf + sizeof(sr_ethernet_hdr_t));
+    rip->ip_src = ip->ip_dst;
+    rip->ip_dst = ip->ip_src;
+    rip->ip_ttl = 64;
+    rip->ip_sum = 0;
+    rip->ip_sum = cksum(rip, hl);
+
+    icmp = (sr_icmp_hdr_t *)(buf + off);
+    icmp->icmp_type = 0;
+    icmp->icmp_sum = 0;
+    icmp->icmp_sum = cksum(icmp, ntohs(ip->ip_len) - hl);
+} /* -- vnsd_ip -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_packet(..)
+ * Scope: Local
+ *
+ * A frame the router sent out of one of its interfaces, to the hosts there.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void vnsd_packet(struct vnsd* vs, uint8_t* cmd, unsigned int len)
+{
+    c_packet_header* hdr = (c_packet_header *)cmd;
+    uint8_t* frame = cmd + sizeof(c_packet_header);
+    sr_ethernet_hdr_t* eth = (sr_ethernet_hdr_t *)frame;
+    sr_ip_hdr_t* ip;
+    char name[17];
+    int iface, h;
+
+    memcpy(name, hdr->mInterfaceName, 16);
+    name[16] = '\0';
+    if (len < sizeof(c_packet_header) + sizeof(sr_ethernet_hdr_t) ||
+        (iface = vnsd_find_iface(vs, name)) < 0)
+    {
+        vs->unmatched++;
+        return;
+    }
+    len -= sizeof(c_packet_header);
+    vs->ifs[iface].rx_frames++;
+    vs->ifs[iface].rx_bytes += len;
+
+    if (ntohs(eth->ether_type) == ethertype_arp)
+    {
+        vnsd_arp(vs, iface, frame, len);
+        return;
+    }
+
+    ip = (sr_ip_hdr_t *)(frame + sizeof(sr_ethernet_hdr_t));
+    if (ntohs(eth->ether_type) != ethertype_ip ||
+        len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) ||
+        len < sizeof(sr_ethernet_hdr_t) + ip->ip_hl * 4 ||
+        (h = vnsd_find_host(vs, iface, ip->ip_dst)) < 0 ||
+        memcmp(eth->ether_dhost, vs->hosts[h].mac, ETHER_ADDR_LEN) != 0)
+    {
+        vs->unmatched++;
+        return;
+    }
+    vnsd_ip(vs, h, frame, len);
+} /* -- vnsd_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_command(..)
+ * Scope: Local
+ *
+ * Act on one command from sr. Returns 1 to carry on, 0 when sr closed the
+ * session, -1 on a protocol error.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_command(struct vnsd* vs, uint8_t* cmd, unsigned int len)
+{
+    uint32_t type = ntohl(((c_base *)cmd)->mType);
+
+    switch (type)
+    {
+        case VNSPACKET:
+            if (vs->opened)
+            { vnsd_packet(vs, cmd, len); }
+            break;
+
+        case VNS_AUTH_REPLY:
+            if (!vnsd_auth_reply(vs, cmd, len))
+            { return -1; }
+            break;
+
+        case VNSOPEN:
+        case VNS_OPEN_TEMPLATE:
+            if (vs->opened || len < ((type == VNSOPEN) ? sizeof(c_open) : sizeof(c_open_template)))
+            { return -1; }
+            vnsd_open(vs, cmd, type == VNS_OPEN_TEMPLATE);
+            vs->opened = 1;
+            break;
+
+        case VNSCLOSE:
+            printf("sr closed the session\n");
+            return 0;
+
+        default:
+            fprintf(stderr, "Unexpected command %u from sr\n", type);
+            return -1;
+    }
+    return 1;
+} /* -- vnsd_command -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_read(..)
+ * Scope: Local
+ *
+ * Read what sr sent and act on every complete command. Returns 1 to carry
+ * on, 0 when sr has gone, -1 on error.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_read(struct vnsd* vs)
+{
+    unsigned int head = 0;
+    uint32_t len;
+    ssize_t n;
+    int ret = 1;
+
+    n = recv(vs->fd, vs->in + vs->in_len, vs->in_size - vs->in_len, MSG_DONTWAIT);
+    if (n == 0)
+    {
+        printf("sr disconnected\n");
+        return 0;
+    }
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EINTR)
+        { return 1; }
+        perror("recv(..):vnsd_read");
+        return -1;
+    }
+    vs->in_len += n;
+
+    while (ret == 1 && vs->in_len - head >= sizeof(c_base))
+    {
+        memcpy(&len, vs->in + head, 4);
+        len = ntohl(len);
+        if (len < sizeof(c_base) || len > VNSD_MAX_CMD)
+        {
+            fprintf(stderr, "Bad command length %u from sr\n", len);
+            return -1;
+        }
+        if (vs->in_len - head < len)
+        { break; }
+        ret = vnsd_command(vs, vs->in + head, len);
+        head += len;
+    }
+
+    memmove(vs->in, vs->in + head, vs->in_len - head);
+    vs->in_len -= head;
+    return ret;
+} /* -- vnsd_read -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_generate(..)
+ * Scope: Local
+ *
+ * Queue every flow frame, and open every tcp flow connection, that is due
+ * by now. Returns the time the next one is due.
+ *
+ *---------------------------------------------------------------------------*/
+
+static double vnsd_generate(struct vnsd* vs, double now)
+{
+    struct vnsd_flow* flow;
+    struct vnsd_host* src;
+    struct vnsd_conn* conn;
+    struct vnsd_probe* probe;
+    sr_ethernet_hdr_t* eth;
+    sr_ip_hdr_t* ip;
+    sr_udp_hdr_t* udp;
+    struct timespec ts;
+    uint8_t* buf;
+    double next = vs->stop;
+    int i;
+
+    for (i = 0; i < vs->nflows; i++)
+    {
+        flow = &vs->flows[i];
+        src = &vs->hosts[flow->src];
+        if (flow->next == 0)
+        { flow->next = vs->start; }
+
+        /* too far behind, forget the slots missed */
+        if (flow->next < now - VNSD_MAX_LAG)
+        {
+            flow->missed += (unsigned long)((now - flow->next) * flow->pps);
+            flow->next = now;
+        }
+
+        while (flow->tcp && flow->next <= now && flow->next < vs->stop &&
+               vs->out_len < VNSD_OUT_MAX)
+        {
+            flow->next += 1.0 / flow->pps;
+
+            /* every port still in use */
+            if (flow->head - flow->tail >= VNSD_TCP_PORTS)
+            {
+                flow->missed++;
+                continue;
+            }
+            conn = &flow->conns[flow->head % VNSD_TCP_PORTS];
+            memset(conn, 0, sizeof(*conn));
+            conn->state = vnsd_tcp_syn_sent;
+            conn->opened = conn->last = now;
+            vnsd_tcp_send(vs, flow->src, flow->dst,
+                          VNSD_TCP_PORT_BASE + flow->head % VNSD_TCP_PORTS, flow->port,
+                          VNSD_TCP_ISN, 0, VNSD_TCP_SYN, 0);
+            flow->head++;
+            flow->sent++;
+        }
+
+        while (!flow->tcp && flow->next <= now && flow->next < vs->stop &&
+               vs->out_len < VNSD_OUT_MAX)
+        {
+            buf = vnsd_send_frame(vs, src->iface, flow->size);
+
+            eth = (sr_ethernet_hdr_t *)buf;
+            memcpy(eth->ether_dhost, vs->ifs[src->iface].mac, ETHER_ADDR_LEN);
+            memcpy(eth->ether_shost, src->mac, ETHER_ADDR_LEN);
+            eth->ether_type = htons(ethertype_ip);
+
+            ip = (sr_ip_hdr_t *)(buf + sizeof(sr_ethernet_hdr_t));
+            ip->ip_v = 4;
+            ip->ip_hl = 5;
+            ip->ip_len = htons(flow->size - sizeof(sr_ethernet_hdr_t));
+            ip->ip_id = htons((uint16_t)flow->seq);
+            ip->ip_ttl = 64;
+            ip->ip_p = ip_protocol_udp;
+            ip->ip_src = src->ip;
+            ip->ip_dst = flow->dst;
+            ip->ip_sum = cksum(ip, sizeof(sr_ip_hdr_t));
+
+            /* no UDP checksum, which IPv4 allows */
+            udp = (sr_udp_hdr_t *)(ip + 1);
+            udp->port_src = htons(10000 + i);
+            udp->port_dst = htons(flow->port);
+            udp->length = htons(flow->size - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t));
+
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            probe = (struct vnsd_probe *)(udp + 1);
+            probe->magic = htonl(VNSD_MAGIC);
+            probe->flow = htonl(i);
+            probe->seq = htonl(flow->seq++);
+            probe->sec = htonl((uint32_t)ts.tv_sec);
+            probe->nsec = htonl((uint32_t)ts.tv_nsec);
+
+            flow->sent++;
+            flow->next += 1.0 / flow->pps;
+        }
+        if (flow->next < next)
+        { next = flow->next; }
+    }
+    return next;
+} /* -- vnsd_generate -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_tcp_reap(..)
+ * Scope: Local
+ *
+ * Move the tail of every tcp flow past the connections that completed, and
+ * fail the ones that have heard nothing for VNSD_TCP_TIMEOUT.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void vnsd_tcp_reap(struct vnsd* vs, double now)
+{
+    struct vnsd_flow* flow;
+    struct vnsd_conn* conn;
+    int i;
+
+    for (i = 0; i < vs->nflows; i++)
+    {
+        flow = &vs->flows[i];
+        while (flow->tcp && flow->tail < flow->head)
+        {
+            conn = &flow->conns[flow->tail % VNSD_TCP_PORTS];
+            if (conn->state != vnsd_tcp_free)
+            {
+                if (now - conn->last < VNSD_TCP_TIMEOUT)
+                { break; }
+                conn->state = vnsd_tcp_free;
+                flow->failed++;
+            }
+            flow->tail++;
+        }
+    }
+} /* -- vnsd_tcp_reap -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_percentile(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static char* vnsd_percentile(struct vnsd_flow* flow, double p, char* buf)
+{
+    unsigned long want = (unsigned long)(flow->recv * p);
+    unsigned long seen = 0;
+    int i;
+
+    for (i = 0; i < VNSD_HIST; i++)
+    {
+        seen += flow->hist[i];
+        if (seen > want)
+        {
+            sprintf(buf, "%d", i);
+            return buf;
+        }
+    }
+    sprintf(buf, ">%d", VNSD_HIST);
+    return buf;
+} /* -- vnsd_percentile -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_report(..)
+ * Scope: Local
+ *
+ * Print what every flow and interface saw. Returns 1 if a flow lost more
+ * than max_loss percent.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_report(struct vnsd* vs, double secs, double max_loss)
+{
+    struct vnsd_flow* flow;
+    char src[32], p50[16], p99[16];
+    unsigned long open;
+    unsigned long n;
+    double loss;
+    int i, failed = 0;
+
+    if (secs <= 0)
+    { secs = 1e-9; }
+
+    for (i = 0; i < vs->nflows; i++)
+    {
+        flow = &vs->flows[i];
+        strcpy(src, inet_ntoa(*(struct in_addr *)&vs->hosts[flow->src].ip));
+        if (flow->tcp)
+        {
+            /* connections still open after the drain */
+            for (open = 0, n = flow->tail; n < flow->head; n++)
+            { open += (flow->conns[n % VNSD_TCP_PORTS].state != vnsd_tcp_free); }
+            loss = flow->sent ? 100.0 * (flow->failed + open) / flow->sent : 0;
+
+            printf("tcp flow %d %s -> %s port %u, %u connections per second of %u bytes\n",
+                   i, src, inet_ntoa(*(struct in_addr *)&flow->dst), flow->port,
+                   flow->pps, flow->size);
+            printf("  opened %lu (%.0f/s), missed %lu, established %lu, completed %lu (%.0f/s),"
+                   " failed %lu, unfinished %lu\n",
+                   flow->sent, flow->sent / secs, flow->missed, flow->established,
+                   flow->completed, flow->completed / secs, flow->failed, open);
+            printf("  acked %lu bytes (%.2f Mbit/s)\n",
+                   flow->acked_bytes, flow->acked_bytes * 8 / secs / 1e6);
+            if (flow->recv > 0)
+            {
+                printf("  handshake us min %.1f avg %.1f p50 %s p99 %s max %.1f\n",
+                       flow->lat_min * 1e6, flow->lat_sum / flow->recv * 1e6,
+                       vnsd_percentile(flow, 0.5, p50), vnsd_percentile(flow, 0.99, p99),
+                       flow->lat_max * 1e6);
+            }
+            if (max_loss >= 0 && loss > max_loss)
+            { failed = 1; }
+            continue;
+        }
+
+        loss = flow->sent ? 100.0 * (flow->sent - (double)flow->recv) / flow->sent : 0;
+        if (loss < 0)
+        { loss = 0; }
+
+        printf("flow %d %s -> %s, %u pps of %u bytes\n", i, src,
+               inet_ntoa(*(struct in_addr *)&flow->dst), flow->pps, flow->size);
+        printf("  sent %lu (%.0f pps), missed %lu, received %lu (%.0f pps %.2f Mbit/s),"
+               " lost %.2f%%, reordered %lu\n",
+               flow->sent, flow->sent / secs, flow->missed, flow->recv, flow->recv / secs,
+               flow->recv_bytes * 8 / secs / 1e6, loss, flow->reordered);
+        if (flow->recv > 0)
+        {
+            printf("  latency us min %.1f avg %.1f p50 %s p99 %s max %.1f\n",
+                   flow->lat_min * 1e6, flow->lat_sum / flow->recv * 1e6,
+                   vnsd_percentile(flow, 0.5, p50), vnsd_percentile(flow, 0.99, p99),
+                   flow->lat_max * 1e6);
+        }
+        if (max_loss >= 0 && loss > max_loss)
+        { failed = 1; }
+    }
+
+    for (i = 0; i < vs->nifs; i++)
+    {
+        printf("%-8s to sr %lu frames %lu bytes, from sr %lu frames %lu bytes\n",
+               vs->ifs[i].name, vs->ifs[i].tx_frames, vs->ifs[i].tx_bytes,
+               vs->ifs[i].rx_frames, vs->ifs[i].rx_bytes);
+    }
+    if (vs->unmatched || vs->icmp)
+    {
+        printf("%lu frames for no host, %lu other packets for hosts\n",
+               vs->unmatched, vs->icmp);
+    }
+    return failed;
+} /* -- vnsd_report -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_serve(..)
+ * Scope: Local
+ *
+ * Run one session with sr on fd. Returns the exit status.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int vnsd_serve(struct vnsd* vs, double delay, double duration, double max_loss)
+{
+    struct pollfd pfd;
+    struct timespec tmo;
+    c_close* cl;
+    double now, next;
+    int ret = 1, one = 1;
+
+    vs->in_size = 2 * VNSD_MAX_CMD;
+    vs->in = (uint8_t *)malloc(vs->in_size);
+    setsockopt(vs->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    vnsd_auth_request(vs);
+
+    /* ret is 1 while the session lasts, 0 once sr closes it, -1 on error */
+    while (ret == 1 && !vnsd_stop)
+    {
+        now = vnsd_now();
+        next = now + 1;
+
+        if (vs->opened && vs->nflows > 0)
+        {
+            if (vs->start == 0)
+            {
+                vs->start = now + delay;
+                vs->stop = vs->start + duration;
+            }
+            if (now >= vs->stop + VNSD_DRAIN)
+            { break; }
+            if (now < vs->start)
+            { next = vs->start; }
+            else if (now < vs->stop)
+            { next = vnsd_generate(vs, now); }
+            else
+            { next = vs->stop + VNSD_DRAIN; }
+            vnsd_tcp_reap(vs, now);
+        }
+
+        if (vnsd_flush(vs) != 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        /* with the output full, wait for sr to take some */
+        pfd.fd = vs->fd;
+        pfd.events = POLLIN | (vs->out_len > 0 ? POLLOUT : 0);
+        next -= vnsd_now();
+        if (next < 0)
+        { next = 0; }
+        tmo.tv_sec = (time_t)next;
+        tmo.tv_nsec = (long)((next - tmo.tv_sec) * 1e9);
+        if (ppoll(&pfd, 1, (vs->out_len >= VNSD_OUT_MAX) ? NULL : &tmo, NULL) < 0)
+        {
+            if (errno == EINTR)
+            { continue; }
+            perror("ppoll(..):vnsd_serve");
+            ret = -1;
+            break;
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+        { ret = vnsd_read(vs); }
+    }
+
+    if (vs->start > 0 && vnsd_now() > vs->start)
+    {
+        /* losing sr before the end fails the run too */
+        now = vnsd_now();
+        ret = vnsd_report(vs, ((now < vs->stop) ? now : vs->stop) - vs->start, max_loss) ||
+              ret != 1 || vnsd_stop;
+    }
+    else
+    {
+        ret = (ret < 0 || (vs->nflows > 0 && !vnsd_stop));
+    }
+
+    /* say goodbye, if sr is still there */
+    cl = (c_close *)vnsd_queue(vs, VNSCLOSE, sizeof(c_close));
+    strcpy(cl->mErrorMessage, "vnsd done");
+    vnsd_flush(vs);
+    close(vs->fd);
+    free(vs->in);
+    return ret;
+} /* -- vnsd_serve -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: vnsd_signal(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void vnsd_signal(int sig)
+{
+    vnsd_stop = 1;
+} /* -- vnsd_signal -- */
+
+/*-----------------------------------------------------------------------------
+ *---------------------------------------------------------------------------*/
+
+int main(int argc, char **argv)
+{
+    int c, lfd, one = 1;
+    unsigned int port = DEFAULT_PORT;
+    char *topo = DEFAULT_TOPO;
+    char *auth_key = DEFAULT_AUTH_KEY;
+    double delay = DEFAULT_DELAY;
+    double duration = DEFAULT_DURATION;
+    double max_loss = -1;
+    struct sockaddr_in addr;
+    struct sigaction sa;
+    struct vnsd vs;
+
+    while ((c = getopt(argc, argv, "hp:c:a:D:d:L:")) != EOF)
+    {
+        switch (c)
+        {
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+                break;
+            case 'p':
+                port = atoi((char *) optarg);
+                break;
+            case 'c':
+                topo = optarg;
+                break;
+            case 'a':
+                auth_key = optarg;
+                break;
+            case 'D':
+                delay = strtod((char *) optarg, NULL);
+                break;
+            case 'd':
+                duration = strtod((char *) optarg, NULL);
+                break;
+            case 'L':
+                max_loss = strtod((char *) optarg, NULL);
+                break;
+            default:
+                usage(argv[0]);
+                exit(1);
+        } /* switch */
+    } /* -- while -- */
+
+    memset(&vs, 0, sizeof(vs));
+    if (vnsd_load_topo(&vs, topo) != 0 || vnsd_load_auth_key(&vs, auth_key) != 0)
+    { exit(1); }
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = vnsd_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lfd, 1) < 0)
+    {
+        perror("vnsd");
+        exit(1);
+    }
+
+    printf("vnsd serving %d interfaces, %d hosts and %d flows on port %u\n",
+           vs.nifs, vs.nhosts, vs.nflows, port);
+    fflush(stdout);
+    if ((vs.fd = accept(lfd, NULL, NULL)) < 0)
+    {
+        if (errno != EINTR)
+        { perror("accept(..):vnsd"); }
+        exit(1);
+    }
+    close(lfd);
+
+    return vnsd_serve(&vs, delay, duration, max_loss);
+} /* -- main -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: usage(..)
+ * Scope: local
+ *---------------------------------------------------------------------------*/
+
+static void usage(char* argv0)
+{
+    printf("Simple Router stand-in VNS server\n");
+    printf("Format: %s [-h] [-p port] [-c topology] [-a auth key file] \n", argv0);
+    printf("           [-D secs before traffic] [-d secs of traffic] \n");
+    printf("           [-L max loss (or failed connection) percent per flow, else exit 1] \n");
+} /* -- usage -- */
@@ -0,0 +1,596 @@
+/*-----------------------------------------------------------------------------
+ * File: sr_xdp.c
+ *
+ * Description:
+ *
+ * AF_XDP backend (-i xdp:eth1=veth0@10.0.1.1,...). Each interface gets an XDP
+ * socket bound to its queue 0 with a UMEM of its own, and a small XDP
+ * program, attached in generic (SKB) mode so it works on veth and any
+ * other driver, that redirects every frame arriving on queue 0 to the
+ * socket. Frames then bypass the kernel stack entirely, which never sees
+ * what the router is sent.
+ *
+ * Half the UMEM frames receive and live in the fill and receive rings,
+ * the other half transmit and cycle through a free list, the transmit
+ * ring and the completion ring. Received frames are handed to the router
+ * in place and go straight back on the fill ring.
+ *
+ * There is no libbpf here: the map, the program (five instructions) and
+ * the link attaching it are made with the bpf syscall, and the link going
+ * away with its fd detaches the program. Needs a 5.9 or later kernel for
+ * XDP links.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include "sr_io.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_protocol.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/* interfaces one router can have here */
+#define SR_XDP_MAX_IFS 16
+
+/* UMEM frames, half of them receiving, and the size of every ring */
+#define SR_XDP_FRAMES 4096
+#define SR_XDP_FRAME_SZ 2048
+#define SR_XDP_RING_SZ (SR_XDP_FRAMES / 2)
+
+/* the kernel is kicked every SR_XDP_TX_BATCH frames */
+#define SR_XDP_TX_BATCH 64
+
+/* one ring shared with the kernel, producer and consumer index it */
+struct sr_xdp_ring
+{
+    uint32_t* producer;
+    uint32_t* consumer;
+    uint32_t* flags;
+    void* desc;
+    void* map;
+    size_t map_sz;
+};
+
+struct sr_xdp_if
+{
+    char name[sr_IFACE_NAMELEN];
+    int fd;
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+
+    uint8_t* umem;
+    struct sr_xdp_ring rx;
+    struct sr_xdp_ring tx;
+    struct sr_xdp_ring fill;
+    struct sr_xdp_ring comp;
+
+    /* transmit frames not in the kernel's hands */
+    uint64_t tx_free[SR_XDP_RING_SZ];
+    unsigned int tx_nfree;
+    unsigned int tx_queued; /* frames put on the ring since the last kick */
+    unsigned long tx_drops;
+};
+
+struct sr_xdp
+{
+    int nifs;
+    struct sr_xdp_if ifs[SR_XDP_MAX_IFS];
+};
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_xdp_bpf(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_xdp_bpf(int cmd, union bpf_attr* attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+} /* -- sr_xdp_bpf -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_xdp_attach(..)
+ * Scope: Local
+ *
+ * Create the socket map, load the program redirecting to it, and attach
+ * the program to ifindex in generic mode.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_xdp_attach(struct sr_xdp_if* xif, int ifindex)
+{
+    struct bpf_insn prog[6];
+    union bpf_attr attr;
+    char log[1024];
+    int key = 0;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(int);
+    attr.value_size = sizeof(int);
+    attr.max_entries = 64;
+    if ((xif->map_fd = sr_xdp_bpf(BPF_MAP_CREATE, &attr)) < 0)
+    {
+        perror("bpf(BPF_MAP_CREATE):sr_xdp_attach");
+        return -1;
+    }
+
+    /* return bpf_redirect_map(&map, ctx->rx_queue_index, XDP_PASS); */
+    memset(prog, 0, sizeof(prog));
+    prog[0].code = BPF_LDX | BPF_W | BPF_MEM;
+    prog[0].dst_reg = BPF_REG_2;
+    prog[0].src_reg = BPF_REG_1;
+    prog[0].off = offsetof(struct xdp_md, rx_queue_index);
+    prog[1].code = BPF_LD | BPF_DW | BPF_IMM;
+    prog[1].dst_reg = BPF_REG_1;
+    prog[1].src_reg = BPF_PSEUDO_MAP_FD;
+    prog[1].imm = xif->map_fd;
+    prog[3].code = BPF_ALU64 | BPF_MOV | BPF_K;
+    prog[3].dst_reg = BPF_REG_3;
+    prog[3].imm = XDP_PASS;
+    prog[4].code = BPF_JMP | BPF_CALL;
+    prog[4].imm = BPF_FUNC_redirect_map;
+    prog[5].code = BPF_JMP | BPF_EXIT;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.insns = (uintptr_t)prog;
+    attr.license = (uintptr_t)"GPL";
+    attr.log_buf = (uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    log[0] = '\0';
+    if ((xif->prog_fd = sr_xdp_bpf(BPF_PROG_LOAD, &attr)) < 0)
+    {
+        perror("bpf(BPF_PROG_LOAD):sr_xdp_attach");
+        fprintf(stderr, "%s", log);
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xif->map_fd;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)&xif->fd;
+    if (sr_xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+    {
+        perror("bpf(BPF_MAP_UPDATE_ELEM):sr_xdp_attach");
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = xif->prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+    if ((xif->link_fd = sr_xdp_bpf(BPF_LINK_CREATE, &attr)) < 0)
+    {
+        perror("bpf(BPF_LINK_CREATE):sr_xdp_attach");
+        return -1;
+    }
+    return 0;
+} /* -- sr_xdp_attach -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_xdp_map_ring(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_xdp_map_ring(struct sr_xdp_if* xif, struct sr_xdp_ring* ring,
+                           struct xdp_ring_offset* off, size_t entry, off_t pgoff)
+{
+    uint8_t* map;
+
+    ring->map_sz = off->desc + SR_XDP_RING_SZ * entry;
+    map = (uint8_t *)mmap(NULL, ring->map_sz, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, xif->fd, pgoff);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap(..):sr_xdp_map_ring");
+        return -1;
+    }
+    ring->map = map;
+    ring->producer = (uint32_t *)(map + off->producer);
+    ring->consumer = (uint32_t *)(map + off->consumer);
+    ring->flags = (uint32_t *)(map + off->flags);
+    ring->desc = map + off->desc;
+    return 0;
+} /* -- sr_xdp_map_ring -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_xdp_open_if(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_xdp_open_if(struct sr_xdp_if* xif, int ifindex)
+{
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    socklen_t optlen = sizeof(off);
+    int ring_sz = SR_XDP_RING_SZ;
+    uint64_t* fill;
+    void* mem;
+    unsigned int i;
+
+    if ((xif->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0)
+    {
+        perror("socket(AF_XDP):sr_xdp_open_if");
+        return -1;
+    }
+
+    if (posix_memalign(&mem, getpagesize(), (size_t)SR_XDP_FRAMES * SR_XDP_FRAME_SZ) != 0)
+    { return -1; }
+    xif->umem = (uint8_t *)mem;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uintptr_t)xif->umem;
+    reg.len = (uint64_t)SR_XDP_FRAMES * SR_XDP_FRAME_SZ;
+    reg.chunk_size = SR_XDP_FRAME_SZ;
+    if (setsockopt(xif->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(xif->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_sz, sizeof(ring_sz)) < 0 ||
+        setsockopt(xif->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_sz, sizeof(ring_sz)) < 0 ||
+        setsockopt(xif->fd, SOL_XDP, XDP_RX_RING, &ring_sz, sizeof(ring_sz)) < 0 ||
+        setsockopt(xif->fd, SOL_XDP, XDP_TX_RING, &ring_sz, sizeof(ring_sz)) < 0 ||
+        getsockopt(xif->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+    {
+        perror("setsockopt(SOL_XDP):sr_xdp_open_if");
+        return -1;
+    }
+
+    if (sr_xdp_map_ring(xif, &xif->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) != 0 ||
+        sr_xdp_map_ring(xif, &xif->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) != 0 ||
+        sr_xdp_map_ring(xif, &xif->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) != 0 ||
+        sr_xdp_map_ring(xif, &xif->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) != 0)
+    { return -1; }
+
+    /* the first half of the frames receive, the rest transmit */
+    fill = (uint64_t *)xif->fill.desc;
+    for (i = 0; i < SR_XDP_RING_SZ; i++)
+    {
+        fill[i] = (uint64_t)i * SR_XDP_FRAME_SZ;
+        xif->tx_free[i] = (uint64_t)(i + SR_XDP_RING_SZ) * SR_XDP_FRAME_SZ;
+    }
+    __atomic_store_n(xif->fill.producer, SR_XDP_RING_SZ, __ATOMIC_RELEASE);
+    xif->tx_nfree = SR_XDP_RING_SZ;
+
+    /* generic mode copies, which every driver can do */
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = 0;
+    sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+    if (bind(xif->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+    {
+        perror("bind(..):sr_xdp_open_if");
+        return -1;
+    }
+
+    return sr_xdp_attach(xif, ifindex);
+} /* -- sr_xdp_open_if -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_xdp_complete(..)
+ * Scope: Local
+ *
+ * Take back the transmit frames the kernel is done with.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_xdp_complete(struct sr_xdp_if* xif)
+{
+    uint64_t* comp = (uint64_t *)xif->comp.desc;
+    uint32_t cons = *xif->comp.consumer;
+    uint32_t prod = __atomic_load_n(xif->comp.producer, __ATOMIC_ACQUIRE);
+
+    for ( ; cons != prod; cons++)
+    {
+        xif->tx_free[xif->tx_nfree++] = comp[cons & (SR_XDP_RING_SZ - 1)];
+    }
+    __atomic_store_n(xif->comp.consumer, cons, __ATOMIC_RELEASE);
+} /* -- sr_xdp_complete -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_xdp_kick(..)
+ * Scope: Local
+ *
+ * Have the kernel send what is on the transmit ring. In copy mode each
+ * call sends a batch, so keep at it while frames are left and it has not
+ * stopped making progress.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_xdp_kick(struct sr_xdp_if* xif)
+{
+    uint32_t prod = *xif->tx.producer;
+    uint32_t cons, last = 0;
+    int tries = 0;
+
+    xif->tx_queued = 0;
+    while ((cons = __atomic_load_n(xif->tx.consumer, __ATOMIC_ACQUIRE)) != prod)
+    {
+        if ((cons == last && ++tries > 3))
+        { break; }
+        last = cons;
+        if (sendto(xif->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 &&
+            errno != EAGAIN && errno != EBUSY && errno != ENOBUFS && errno != EINTR)
+        {
+            perror("sendto(..):sr_xdp_kick");
+            return -1;
+        }
+    }
+    sr_xdp_complete(xif);
+    return 0;
+} /* -- sr_xdp_kick -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_xdp_open(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void sr_xdp_close(struct sr_instance* sr);
+
+static int sr_xdp_open(struct sr_instance* sr, char* spec)
+{
+    struct sr_xdp* st;
+    struct sr_xdp_if* xif;
+    char *name, *dev, *addr;
+    int ifindex;
+
+    if ((st = (struct sr_xdp *)calloc(1, sizeof(struct sr_xdp))) == NULL)
+    { return -1; }
+    sr->io_state = st;
+
+    while (sr_io_next_iface(&spec, &name, &dev, &addr))
+    {
+        if (st->nifs == SR_XDP_MAX_IFS)
+        {
+            fprintf(stderr, "More than %d interfaces\n", SR_XDP_MAX_IFS);
+            sr_xdp_close(sr);
+            return -1;
+        }
+        xif = &st->ifs[st->nifs++];
+        xif->fd = xif->map_fd = xif->prog_fd = xif->link_fd = -1;
+        strncpy(xif->name, name, sr_IFACE_NAMELEN - 1);
+
+        /* no sr_io_kernel_addr check: the program redirects every frame
+           on the queue, so the kernel stack never gets one to answer */
+        if ((ifindex = sr_io_add_iface(sr, name, dev, addr)) < 0 ||
+            sr_xdp_open_if(xif, ifindex) != 0)
+        {
+            fprintf(stderr, "Unable to open %s on %s\n", name, dev);
+            sr_xdp_close(sr);
+            return -1;
+        }
+    }
+
+    if (st->nifs == 0)
+    {
+        fprintf(stderr, "No interfaces given, expected xdp:eth1=dev@ip,...\n");
+        sr_xdp_close(sr);
+        return -1;
+    }
+    return 0;
+} /* -- sr_xdp_open -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_xdp_send(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_xdp_send(struct sr_instance* sr, uint8_t* buf, unsigned int len,
+                       const char* iface)
+{
+    struct sr_xdp* st = (struct sr_xdp *)sr->io_state;
+    struct sr_xdp_if* xif = NULL;
+    struct xdp_desc* desc;
+    uint32_t prod;
+    uint64_t addr;
+    int i;
+
+    for (i = 0; i < st->nifs; i++)
+    {
+        if (strncmp(st->ifs[i].name, iface, sr_IFACE_NAMELEN) == 0)
+        {
+            xif = &st->ifs[i];
+            break;
+        }
+    }
+    if (xif == NULL || len > SR_XDP_FRAME_SZ)
+    {
+        fprintf(stderr, "** Error: cannot send %u bytes on %s\n", len, iface);
+        return -1;
+    }
+
+    /* out of frames means the ring is full, send it out and look again */
+    if (xif->tx_nfree == 0)
+    { sr_xdp_complete(xif); }
+    if (xif->tx_nfree == 0)
+    { sr_xdp_kick(xif); }
+    if (xif->tx_nfree == 0)
+    {
+        xif->tx_drops++;
+        return -1;
+    }
+
+    addr = xif->tx_free[--xif->tx_nfree];
+    memcpy(xif->umem + addr, buf, len);
+
+    prod = *xif->tx.producer;
+    desc = &((struct xdp_desc *)xif->tx.desc)[prod & (SR_XDP_RING_SZ - 1)];
+    desc->addr = addr;
+    desc->len = len;
+    desc->options = 0;
+    __atomic_store_n(xif->tx.producer, prod + 1, __ATOMIC_RELEASE);
+
+    sr->tx_len += len;
+    if (++xif->tx_queued >= SR_XDP_TX_BATCH)
+    { return sr_xdp_kick(xif); }
+    return 0;
+} /* -- sr_xdp_send -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_xdp_flush(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_xdp_flush(struct sr_instance* sr)
+{
+    struct sr_xdp* st = (struct sr_xdp *)sr->io_state;
+    int i, ret = 0;
+
+    for (i = 0; i < st->nifs; i++)
+    {
+        if (st->ifs[i].tx_queued > 0 && sr_xdp_kick(&st->ifs[i]) != 0)
+        { ret = -1; }
+    }
+    sr->tx_len = 0;
+    return ret;
+} /* -- sr_xdp_flush -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_xdp_fds(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static int sr_xdp_fds(struct sr_instance* sr, int* fds, int max)
+{
+    struct sr_xdp* st = (struct sr_xdp *)sr->io_state;
+    int i;
+
+    for (i = 0; i < st->nifs && i < max; i++)
+    { fds[i] = st->ifs[i].fd; }
+    return i;
+} /* -- sr_xdp_fds -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_xdp_ready(..)
+ * Scope: Local
+ *
+ * Hand the router every frame on the receive ring, in place, putting each
+ * frame back on the fill ring once the router is done with it.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_xdp_ready(struct sr_instance* sr, int fd)
+{
+    struct sr_xdp* st = (struct sr_xdp *)sr->io_state;
+    struct sr_xdp_if* xif = NULL;
+    struct xdp_desc* desc;
+    uint64_t* fill;
+    uint32_t cons, prod, fprod;
+    int i;
+
+    for (i = 0; i < st->nifs; i++)
+    {
+        if (st->ifs[i].fd == fd)
+        {
+            xif = &st->ifs[i];
+            break;
+        }
+    }
+    if (xif == NULL)
+    { return 1; }
+
+    /* every receive frame is on one of the two rings, so there is room */
+    fill = (uint64_t *)xif->fill.desc;
+    fprod = *xif->fill.producer;
+    cons = *xif->rx.consumer;
+    prod = __atomic_load_n(xif->rx.producer, __ATOMIC_ACQUIRE);
+    for ( ; cons != prod; cons++)
+    {
+        desc = &((struct xdp_desc *)xif->rx.desc)[cons & (SR_XDP_RING_SZ - 1)];
+        if (desc->len >= sizeof(sr_ethernet_hdr_t))
+        {
+            sr_receive_packet(sr, xif->umem + desc->addr, desc->len, xif->name);
+        }
+        fill[fprod++ & (SR_XDP_RING_SZ - 1)] = desc->addr & ~(uint64_t)(SR_XDP_FRAME_SZ - 1);
+    }
+    __atomic_store_n(xif->rx.consumer, cons, __ATOMIC_RELEASE);
+    __atomic_store_n(xif->fill.producer, fprod, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(xif->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)
+    { recvfrom(xif->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL); }
+    return 1;
+} /* -- sr_xdp_ready -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_xdp_close(..)
+ * Scope: Local
+ *---------------------------------------------------------------------------*/
+
+static void sr_xdp_close(struct sr_instance* sr)
+{
+    struct sr_xdp* st = (struct sr_xdp *)sr->io_state;
+    struct sr_xdp_if* xif;
+    struct sr_xdp_ring* rings[4];
+    int i, j;
+
+    if (st == NULL)
+    { return; }
+
+    for (i = 0; i < st->nifs; i++)
+    {
+        xif = &st->ifs[i];
+        if (xif->tx_queued > 0)
+        { sr_xdp_kick(xif); }
+        if (xif->tx_drops > 0)
+        {
+            fprintf(stderr, "%s dropped %lu frames on a full transmit ring\n",
+                    xif->name, xif->tx_drops);
+        }
+
+        /* the program goes with its link */
+        if (xif->link_fd >= 0)
+        { close(xif->link_fd); }
+        if (xif->prog_fd >= 0)
+        { close(xif->prog_fd); }
+        if (xif->map_fd >= 0)
+        { close(xif->map_fd); }
+
+        rings[0] = &xif->rx;
+        rings[1] = &xif->tx;
+        rings[2] = &xif->fill;
+        rings[3] = &xif->comp;
+        for (j = 0; j < 4; j++)
+        {
+            if (rings[j]->map != NULL)
+            { munmap(rings[j]->map, rings[j]->map_sz); }
+        }
+        if (xif->fd >= 0)
+        { close(xif->fd); }
+        free(xif->umem);
+    }
+    free(st);
+    sr->io_state = NULL;
+} /* -- sr_xdp_close -- */
+
+const struct sr_io sr_io_xdp =
+{
+    "xdp",
+    sr_xdp_open,
+    sr_xdp_send,
+    sr_xdp_flush,
+    sr_xdp_fds,
+    sr_xdp_ready,
+    sr_xdp_close,
+    NULL
+};